@@ -6,8 +6,10 @@
 #include <linux/kdev_t.h>
 #include <linux/prctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
 
 #include "rr/rr.h"
@@ -777,6 +779,10 @@ KernelMapping AddressSpace::map(Task* t, remote_ptr<void> addr,
 
   remove_range(dont_fork, MemoryRange(addr, num_bytes));
   remove_range(wipe_on_fork, MemoryRange(addr, num_bytes));
+  if (!software_watchpoint_pages.empty()) {
+    software_watchpoint_pages_dirty = true;
+  }
+  instruction_may_write_memory_cache.clear();
 
   // The mmap() man page doesn't specifically describe
   // what should happen if an existing map is
@@ -899,6 +905,10 @@ void AddressSpace::protect(Task* t, remote_ptr<void> addr, size_t num_bytes,
                            int prot) {
   LOG(debug) << "mprotect(" << addr << ", " << num_bytes << ", " << HEX(prot)
              << ")";
+  if (!software_watchpoint_pages.empty()) {
+    software_watchpoint_pages_dirty = true;
+  }
+  instruction_may_write_memory_cache.clear();
 
   MemoryRange last_overlap;
   auto protector = [this, prot, &last_overlap](Mapping m,
@@ -1111,6 +1121,12 @@ void AddressSpace::restore_breakpoint_at(remote_code_ptr addr) {
   }
 }
 
+bool AddressSpace::has_breakpoint_in(const MemoryRange& range) const {
+  auto it = breakpoints.lower_bound(remote_code_ptr(range.start().as_int()));
+  return it != breakpoints.end() &&
+         it->first.to_data_ptr<void>() < range.end();
+}
+
 int AddressSpace::access_bits_of(WatchType type) {
   switch (type) {
     case WATCH_EXEC:
@@ -1212,18 +1228,213 @@ bool AddressSpace::update_watchpoint_value(const MemoryRange& range,
   return changed;
 }
 
+// Set when process_vm_readv isn't usable here, e.g. because a seccomp
+// filter or an old kernel rejects it.
+static bool process_vm_readv_failed = false;
+
+void AddressSpace::update_watchpoint_values(
+    const vector<WatchpointEntry*>& entries, vector<bool>* changed) {
+  changed->assign(entries.size(), false);
+  Task* t = first_running_task();
+  if (!t || entries.empty()) {
+    return;
+  }
+  size_t done = 0;
+  if (!process_vm_readv_failed) {
+    vector<vector<uint8_t>> values(entries.size());
+    vector<struct iovec> local_iov(entries.size());
+    vector<struct iovec> remote_iov(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const MemoryRange& range = entries[i]->first;
+      values[i].resize(range.size());
+      local_iov[i].iov_base = values[i].data();
+      local_iov[i].iov_len = range.size();
+      remote_iov[i].iov_base = reinterpret_cast<void*>(range.start().as_int());
+      remote_iov[i].iov_len = range.size();
+    }
+    // Reads are only ever cut short between iovecs, at the first range
+    // that isn't fully readable. Ranges after that are read one at a time
+    // below, which handles partially readable ranges.
+    while (done < entries.size()) {
+      size_t count = min<size_t>(entries.size() - done, IOV_MAX);
+      ssize_t nread = process_vm_readv(t->tid, local_iov.data() + done, count,
+                                       remote_iov.data() + done, count, 0);
+      if (nread < 0) {
+        if (errno == ENOSYS || errno == EPERM) {
+          process_vm_readv_failed = true;
+        }
+        break;
+      }
+      size_t batch_end = done + count;
+      while (done < batch_end && (size_t)nread >= local_iov[done].iov_len) {
+        nread -= local_iov[done].iov_len;
+        Watchpoint& watchpoint = entries[done]->second;
+        (*changed)[done] =
+            !watchpoint.valid ||
+            memcmp(values[done].data(), watchpoint.value_bytes.data(),
+                   values[done].size()) != 0;
+        watchpoint.valid = true;
+        watchpoint.value_bytes = std::move(values[done]);
+        ++done;
+      }
+      if (done < batch_end) {
+        break;
+      }
+    }
+  }
+  for (size_t i = done; i < entries.size(); ++i) {
+    (*changed)[i] = update_watchpoint_value(entries[i]->first,
+                                            entries[i]->second);
+  }
+}
+
 void AddressSpace::update_watchpoint_values(remote_ptr<void> start,
                                             remote_ptr<void> end) {
   MemoryRange r(start, end);
+  vector<WatchpointEntry*> entries;
   for (auto& it : watchpoints) {
-    if (it.first.intersects(r) &&
-        update_watchpoint_value(it.first, it.second)) {
-      it.second.changed = true;
+    if (it.first.intersects(r)) {
+      entries.push_back(&it);
+    }
+  }
+  vector<bool> changed;
+  update_watchpoint_values(entries, &changed);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (changed[i]) {
+      entries[i]->second.changed = true;
       // We do nothing to track kernel reads of read-write watchpoints...
     }
   }
 }
 
+static bool modrm_is_register(const uint8_t* insn, size_t len, size_t i) {
+  return i < len && (insn[i] >> 6) == 3;
+}
+
+/**
+ * Returns false if the x86 instruction in |insn| certainly doesn't write
+ * memory. This only recognizes common instructions; anything else may.
+ */
+static bool x86_instruction_may_write_memory(const uint8_t* insn, size_t len,
+                                             SupportedArch arch) {
+  size_t i = 0;
+  // Operand-size and segment override prefixes don't matter here.
+  while (i < len &&
+         (insn[i] == 0x66 || insn[i] == 0x26 || insn[i] == 0x2e ||
+          insn[i] == 0x36 || insn[i] == 0x3e || insn[i] == 0x64 ||
+          insn[i] == 0x65)) {
+    ++i;
+  }
+  if (arch == x86_64 && i < len && (insn[i] & 0xf0) == 0x40) {
+    // REX prefix
+    ++i;
+  }
+  if (i >= len) {
+    return true;
+  }
+  uint8_t op = insn[i];
+  if (op == 0x0f) {
+    if (i + 1 >= len) {
+      return true;
+    }
+    uint8_t op2 = insn[i + 1];
+    if ((op2 >= 0x40 && op2 <= 0x4f) || (op2 >= 0x80 && op2 <= 0x8f) ||
+        op2 == 0x1f || op2 == 0xa3 || op2 == 0xaf || op2 == 0xb6 ||
+        op2 == 0xb7 || op2 == 0xbc || op2 == 0xbd || op2 == 0xbe ||
+        op2 == 0xbf) {
+      // cmovcc, jcc, nop, bt, imul, movzx, bsf, bsr, movsx
+      return false;
+    }
+    if (op2 >= 0x90 && op2 <= 0x9f) {
+      // setcc
+      return !modrm_is_register(insn, len, i + 2);
+    }
+    return true;
+  }
+  if (op < 0x40 && (op & 7) <= 5) {
+    // add, or, adc, sbb, and, sub, xor, cmp. Only the forms with a r/m
+    // destination write memory, and cmp writes nothing.
+    return (op & 7) <= 1 && (op & 0x38) != 0x38 &&
+           !modrm_is_register(insn, len, i + 1);
+  }
+  if ((op >= 0x58 && op <= 0x5f) || (op >= 0x70 && op <= 0x7f) ||
+      op == 0x84 || op == 0x85 || op == 0x8a || op == 0x8b || op == 0x8d ||
+      op == 0x90 || op == 0x98 || op == 0x99 || op == 0xa8 || op == 0xa9 ||
+      (op >= 0xb0 && op <= 0xbf) || op == 0xc3 || op == 0xc9 ||
+      op == 0xe9 || op == 0xeb) {
+    // pop, jcc, test, mov to register, lea, nop, cbw, cwd, mov immediate,
+    // ret, leave, jmp
+    return false;
+  }
+  if (op == 0x88 || op == 0x89 || op == 0xc0 || op == 0xc1 || op == 0xc6 ||
+      op == 0xc7 || (op >= 0xd0 && op <= 0xd3)) {
+    // mov to r/m, shifts and rotates
+    return !modrm_is_register(insn, len, i + 1);
+  }
+  if (i + 1 >= len) {
+    return true;
+  }
+  int reg = (insn[i + 1] >> 3) & 7;
+  switch (op) {
+    case 0x80:
+    case 0x81:
+    case 0x83:
+      // Group 1; /7 is cmp.
+      return reg != 7 && !modrm_is_register(insn, len, i + 1);
+    case 0xf6:
+    case 0xf7:
+      // Group 3; only not and neg write their r/m operand.
+      return (reg == 2 || reg == 3) && !modrm_is_register(insn, len, i + 1);
+    case 0xff:
+      // Group 5; inc and dec write their r/m operand, call and push write
+      // the stack, jmp writes nothing.
+      if (reg == 4 || reg == 5) {
+        return false;
+      }
+      return reg > 1 || !modrm_is_register(insn, len, i + 1);
+    default:
+      return true;
+  }
+}
+
+bool AddressSpace::instruction_may_write_memory(remote_code_ptr ip) {
+  auto it = instruction_may_write_memory_cache.find(ip);
+  if (it != instruction_may_write_memory_cache.end()) {
+    return it->second;
+  }
+  Task* t = first_running_task();
+  if (!t || !is_x86ish(arch())) {
+    return true;
+  }
+  uint8_t insn[16];
+  ssize_t len = t->read_bytes_fallible(ip.to_data_ptr<void>(), sizeof(insn),
+                                       insn);
+  if (len <= 0) {
+    return true;
+  }
+  replace_breakpoints_with_original_values(insn, len,
+                                           ip.to_data_ptr<uint8_t>());
+  bool result = x86_instruction_may_write_memory(insn, len, arch());
+  // Only cache instructions the tracee can't rewrite: those in private
+  // mappings that aren't writable. JITs write code through a writable
+  // mapping, or a shared alias of it, and we clear the cache whenever
+  // mappings or protections change.
+  remote_ptr<void> insn_start = ip.to_data_ptr<void>();
+  if (!has_mapping(insn_start)) {
+    return result;
+  }
+  const KernelMapping& m = mapping_of(insn_start).map;
+  if ((m.prot() & PROT_WRITE) || (m.flags() & MAP_SHARED) ||
+      insn_start + len > m.end()) {
+    return result;
+  }
+  if (instruction_may_write_memory_cache.size() >= 65536) {
+    instruction_may_write_memory_cache.clear();
+  }
+  instruction_may_write_memory_cache[ip] = result;
+  return result;
+}
+
 static int DR_WATCHPOINT(int n) { return 1 << n; }
 
 static bool watchpoint_triggered(uintptr_t debug_status,
@@ -1239,7 +1450,27 @@ static bool watchpoint_triggered(uintptr_t debug_status,
 bool AddressSpace::notify_watchpoint_fired(uintptr_t debug_status,
     remote_ptr<void> hit_addr,
     remote_code_ptr address_of_singlestep_start) {
+  // Without a hardware report, a singlestep can only have changed a watched
+  // value if the instruction it executed may write memory. Don't reread the
+  // values otherwise; with several watchpoints that's several reads per
+  // singlestep of reverse execution.
+  bool values_may_have_changed =
+      !is_x86ish(arch()) || (debug_status & DS_WATCHPOINT_ANY) ||
+      !(debug_status & DS_SINGLESTEP) || address_of_singlestep_start.is_null() ||
+      instruction_may_write_memory(address_of_singlestep_start);
+  vector<WatchpointEntry*> write_watchpoints;
+  if (values_may_have_changed) {
+    for (auto& it : watchpoints) {
+      if (it.second.watched_bits() & WRITE_BIT) {
+        write_watchpoints.push_back(&it);
+      }
+    }
+  }
+  vector<bool> values_changed;
+  update_watchpoint_values(write_watchpoints, &values_changed);
+
   bool triggered = false;
+  size_t write_index = 0;
   for (auto& it : watchpoints) {
     // On Skylake/4.14.13-300.fc27.x86_64 at least, we have observed a
     // situation where singlestepping through the instruction before a hardware
@@ -1248,8 +1479,11 @@ bool AddressSpace::notify_watchpoint_fired(uintptr_t debug_status,
     // This could be a HW issue or a kernel issue. Work around it by ignoring
     // triggered watchpoints that aren't on the instruction we just tried to
     // execute.
-    bool write_triggered = (it.second.watched_bits() & WRITE_BIT) &&
-        update_watchpoint_value(it.first, it.second);
+    bool write_triggered = false;
+    if (write_index < write_watchpoints.size() &&
+        write_watchpoints[write_index] == &it) {
+      write_triggered = values_changed[write_index++];
+    }
     // Depending on the architecture the hardware may indicate hit watchpoints
     // either by number, or by the address that triggered the watchpoint hit
     // - support either.
@@ -1293,6 +1527,9 @@ void AddressSpace::notify_written(remote_ptr<void> addr, size_t num_bytes,
                                   uint32_t flags) {
   if (!(flags & Task::IS_BREAKPOINT_RELATED)) {
     update_watchpoint_values(addr, addr + num_bytes);
+    if (!instruction_may_write_memory_cache.empty()) {
+      instruction_may_write_memory_cache.clear();
+    }
   }
   session()->accumulate_bytes_written(num_bytes);
 }
@@ -1318,6 +1555,10 @@ void AddressSpace::unmap(Task* t, remote_ptr<void> addr, ssize_t num_bytes) {
 void AddressSpace::unmap_internal(Task*, remote_ptr<void> addr,
                                   ssize_t num_bytes) {
   LOG(debug) << "munmap(" << addr << ", " << num_bytes << ")";
+  if (!software_watchpoint_pages.empty()) {
+    software_watchpoint_pages_dirty = true;
+  }
+  instruction_may_write_memory_cache.clear();
 
   auto unmapper = [this](Mapping m, MemoryRange rem) {
     LOG(debug) << "  unmapping (" << rem << ") ...";
@@ -1625,6 +1866,26 @@ void AddressSpace::verify(Task* t) const {
 
   LOG(debug) << "Verifying address space for task " << t->tid;
 
+  // The kernel's protections for software watchpoint pages deliberately
+  // differ from ours, so give a kernel mapping made up only of such pages
+  // the protection we expect there. It then merges with its neighbours
+  // and everything else about it is still checked.
+  auto normalize_watched = [&](const KernelMapping& km) -> KernelMapping {
+    if (software_watchpoint_pages.empty() ||
+        !software_watchpoint_pages.count(km.start()) ||
+        !has_mapping(km.start())) {
+      return km;
+    }
+    for (remote_ptr<void> p = km.start(); p < km.end(); p += page_size()) {
+      if (!software_watchpoint_pages.count(p)) {
+        return km;
+      }
+    }
+    return KernelMapping(km.start(), km.end(), km.fsname(), km.device(),
+                         km.inode(), mapping_of(km.start()).map.prot(),
+                         km.flags(), km.file_offset_bytes());
+  };
+
   MemoryMap::const_iterator mem_it = mem.begin();
   KernelMapIterator kernel_it(t);
   if (kernel_it.at_end()) {
@@ -1632,10 +1893,10 @@ void AddressSpace::verify(Task* t) const {
     return;
   }
   while (!kernel_it.at_end() && mem_it != mem.end()) {
-    KernelMapping km = kernel_it.current();
+    KernelMapping km = normalize_watched(kernel_it.current());
     ++kernel_it;
     while (!kernel_it.at_end()) {
-      KernelMapping next_km = kernel_it.current();
+      KernelMapping next_km = normalize_watched(kernel_it.current());
       if (!try_merge_adjacent(&km, next_km)) {
         break;
       }
@@ -1693,7 +1954,8 @@ AddressSpace::AddressSpace(Task* t, const string& exe, uint32_t exec_count)
       do_breakpoint_fault_addr_(nullptr),
       stopping_breakpoint_table_(nullptr),
       stopping_breakpoint_table_entry_size_(0),
-      first_run_event_(0) {
+      first_run_event_(0),
+      software_watchpoint_pages_dirty(false) {
   // TODO: this is a workaround of
   // https://github.com/rr-debugger/rr/issues/1113 .
   if (session_->done_initial_exec()) {
@@ -1737,7 +1999,10 @@ AddressSpace::AddressSpace(Session* session, const AddressSpace& o,
       saved_interpreter_base_(o.saved_interpreter_base_),
       saved_ld_path_(o.saved_ld_path_),
       last_free_memory(o.last_free_memory),
-      first_run_event_(0) {
+      first_run_event_(0),
+      // The kernel copies page protections into the clone.
+      software_watchpoint_pages(o.software_watchpoint_pages),
+      software_watchpoint_pages_dirty(o.software_watchpoint_pages_dirty) {
   for (auto& m : mem) {
     // The original address space continues to have exclusive ownership of
     // all local mappings.
@@ -1858,6 +2123,10 @@ vector<WatchConfig> AddressSpace::get_watchpoints_internal(
       }
       kv.second.changed = false;
     }
+    if (alignment == ALIGNED && kv.second.software) {
+      // Aligned configs are for the debug registers.
+      continue;
+    }
     vector<int8_t>* assigned_regs = nullptr;
     if (update_watchpoint_register_assignments == UPDATE_WATCHPOINT_REGISTER_ASSIGNMENTS) {
       kv.second.debug_regs_for_exec_read.clear();
@@ -1897,6 +2166,9 @@ bool AddressSpace::has_exec_watchpoint_fired(remote_code_ptr addr) {
 }
 
 bool AddressSpace::allocate_watchpoints() {
+  for (auto& kv : watchpoints) {
+    kv.second.software = false;
+  }
   vector<WatchConfig> regs = get_watchpoints_internal(ALL_WATCHPOINTS, ALIGNED,
       UPDATE_WATCHPOINT_REGISTER_ASSIGNMENTS);
 
@@ -1904,14 +2176,169 @@ bool AddressSpace::allocate_watchpoints() {
     // We can't validate the watchpoint set in this case
     FATAL() << "No tasks???";
   }
-  if ((*task_set().begin())->set_debug_regs(regs)) {
-    return true;
+  Task* t = *task_set().begin();
+  bool ok = t->set_debug_regs(regs);
+  if (!ok && session()->is_replaying()) {
+    // Too many or too large watchpoints for the debug registers. Move
+    // write-only watchpoints to page protection, largest first, until the
+    // rest fit. Read and exec watchpoints can't be emulated this way.
+    vector<pair<size_t, Watchpoint*>> candidates;
+    for (auto& kv : watchpoints) {
+      if (kv.second.watched_bits() == WRITE_BIT && kv.first.size() > 0 &&
+          can_software_watch(kv.first)) {
+        candidates.push_back(make_pair(kv.first.size(), &kv.second));
+      }
+    }
+    stable_sort(candidates.begin(), candidates.end(),
+                [](const pair<size_t, Watchpoint*>& a,
+                   const pair<size_t, Watchpoint*>& b) {
+                  return a.first > b.first;
+                });
+    for (auto& c : candidates) {
+      c.second->software = true;
+      regs = get_watchpoints_internal(ALL_WATCHPOINTS, ALIGNED,
+          UPDATE_WATCHPOINT_REGISTER_ASSIGNMENTS);
+      if (t->set_debug_regs(regs)) {
+        ok = true;
+        break;
+      }
+    }
   }
 
-  for (auto kv : watchpoints) {
-    kv.second.debug_regs_for_exec_read.clear();
+  if (!ok) {
+    for (auto& kv : watchpoints) {
+      kv.second.debug_regs_for_exec_read.clear();
+      kv.second.software = false;
+    }
   }
-  return false;
+  update_software_watchpoint_protection(t);
+  return ok;
+}
+
+bool AddressSpace::can_software_watch(const MemoryRange& range) const {
+  remote_ptr<void> end = ceil_page_size(range.end());
+  for (remote_ptr<void> p = floor_page_size(range.start()); p < end;
+       p += page_size()) {
+    if (!has_mapping(p)) {
+      return false;
+    }
+    const KernelMapping& m = mapping_of(p).map;
+    // Shared mappings can be written behind our back, and we can't trust
+    // our protection to survive the fallback write path in
+    // Task::write_bytes_helper for them.
+    if (!(m.flags() & MAP_PRIVATE) ||
+        (m.prot() & (PROT_READ | PROT_WRITE)) != (PROT_READ | PROT_WRITE)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void AddressSpace::update_software_watchpoint_protection(Task* t) {
+  std::map<remote_ptr<void>, int> pages;
+  for (auto& kv : watchpoints) {
+    if (!kv.second.software) {
+      continue;
+    }
+    remote_ptr<void> end = ceil_page_size(kv.first.end());
+    for (remote_ptr<void> p = floor_page_size(kv.first.start()); p < end;
+         p += page_size()) {
+      if (has_mapping(p)) {
+        int prot = mapping_of(p).map.prot();
+        if ((prot & (PROT_READ | PROT_WRITE)) == (PROT_READ | PROT_WRITE)) {
+          pages[p] = prot;
+        }
+      }
+    }
+  }
+  if (pages == software_watchpoint_pages && !software_watchpoint_pages_dirty) {
+    return;
+  }
+
+  // Coalesce runs of contiguous pages with the same protection into one
+  // mprotect.
+  vector<pair<MemoryRange, int>> runs;
+  auto add_page = [&runs](remote_ptr<void> p, int prot) {
+    if (!runs.empty() && runs.back().first.end() == p &&
+        runs.back().second == prot) {
+      runs.back().first = MemoryRange(runs.back().first.start(),
+                                      p + page_size());
+    } else {
+      runs.push_back(make_pair(MemoryRange(p, page_size()), prot));
+    }
+  };
+  for (auto& kv : software_watchpoint_pages) {
+    // Pages that were unmapped since need no restoring.
+    if (!pages.count(kv.first) && has_mapping(kv.first)) {
+      add_page(kv.first, mapping_of(kv.first).map.prot());
+    }
+  }
+  for (auto& kv : pages) {
+    if (software_watchpoint_pages_dirty ||
+        !software_watchpoint_pages.count(kv.first)) {
+      add_page(kv.first, kv.second & ~PROT_WRITE);
+    }
+  }
+  software_watchpoint_pages = std::move(pages);
+  software_watchpoint_pages_dirty = false;
+  if (runs.empty()) {
+    return;
+  }
+
+  LOG(debug) << "Updating protection of " << runs.size()
+             << " software watchpoint page run(s)";
+  AutoRemoteSyscalls remote(t);
+  int mprotect_syscallno = syscall_number_for_mprotect(t->arch());
+  for (auto& r : runs) {
+    remote.infallible_syscall_if_alive(mprotect_syscallno, r.first.start(),
+                                       r.first.size(), r.second);
+  }
+}
+
+void AddressSpace::unprotect_software_watchpoint_page(Task* t,
+                                                      remote_ptr<void> page) {
+  auto it = software_watchpoint_pages.find(page);
+  DEBUG_ASSERT(it != software_watchpoint_pages.end());
+  AutoRemoteSyscalls remote(t);
+  remote.infallible_syscall_if_alive(syscall_number_for_mprotect(t->arch()),
+                                     page, page_size(), it->second);
+}
+
+void AddressSpace::protect_software_watchpoint_page(Task* t,
+                                                    remote_ptr<void> page) {
+  auto it = software_watchpoint_pages.find(page);
+  DEBUG_ASSERT(it != software_watchpoint_pages.end());
+  AutoRemoteSyscalls remote(t);
+  remote.infallible_syscall_if_alive(syscall_number_for_mprotect(t->arch()),
+                                     page, page_size(),
+                                     it->second & ~PROT_WRITE);
+}
+
+bool AddressSpace::notify_software_watchpoint_write(remote_ptr<void> page) {
+  MemoryRange r(page, page_size());
+  vector<WatchpointEntry*> entries;
+  for (auto& kv : watchpoints) {
+    if (kv.second.software && kv.first.intersects(r)) {
+      entries.push_back(&kv);
+    }
+  }
+  vector<bool> changed;
+  update_watchpoint_values(entries, &changed);
+  bool triggered = false;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (changed[i]) {
+      entries[i]->second.changed = true;
+      triggered = true;
+    }
+  }
+  return triggered;
+}
+
+void AddressSpace::clear_software_watchpoints(Task* t) {
+  for (auto& kv : watchpoints) {
+    kv.second.software = false;
+  }
+  update_software_watchpoint_protection(t);
 }
 
 static inline void assert_coalescable(Task* t,
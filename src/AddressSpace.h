@@ -13,6 +13,7 @@
 #include <memory>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "preload/preload_interface.h"
@@ -574,6 +575,10 @@ public:
    * Restore any temporarily removed breakpoint at |addr|.
    */
   void restore_breakpoint_at(remote_code_ptr addr);
+  /**
+   * Returns true if any breakpoint is set in |range|.
+   */
+  bool has_breakpoint_in(const MemoryRange& range) const;
 
   /**
    * Manage watchpoints.  Analogous to breakpoint-managing
@@ -638,6 +643,44 @@ public:
       DONT_UPDATE_WATCHPOINT_REGISTER_ASSIGNMENTS);
   }
 
+  /**
+   * During replay, write watchpoints that don't fit in the debug registers
+   * are implemented by write-protecting the pages they cover. Returns true
+   * if |addr| is in such a page.
+   */
+  bool is_software_watchpoint_page(remote_ptr<void> addr) const {
+    return software_watchpoint_pages.count(floor_page_size(addr)) > 0;
+  }
+  /**
+   * Temporarily give the software watchpoint page at |page| its original
+   * protection, so a faulting write can be stepped.
+   */
+  void unprotect_software_watchpoint_page(Task* t, remote_ptr<void> page);
+  /**
+   * Write-protect the software watchpoint page at |page| again.
+   */
+  void protect_software_watchpoint_page(Task* t, remote_ptr<void> page);
+  /**
+   * The tracee wrote to the software watchpoint page at |page|. Recheck the
+   * watchpoints on that page only. Returns true if any of them changed.
+   */
+  bool notify_software_watchpoint_write(remote_ptr<void> page);
+  /**
+   * Re-protect software watchpoint pages if the tracee changed the mappings
+   * they're in since we last protected them.
+   */
+  void refresh_software_watchpoints(Task* t) {
+    if (software_watchpoint_pages_dirty) {
+      update_software_watchpoint_protection(t);
+    }
+  }
+  /**
+   * Restore the original protection of all software watchpoint pages and
+   * stop tracking them. Used when cloning into a session that can't
+   * handle the faults.
+   */
+  void clear_software_watchpoints(Task* t);
+
   void set_shm_size(remote_ptr<void> addr, size_t bytes) {
     shm_sizes[addr] = bytes;
   }
@@ -926,6 +969,20 @@ private:
   bool update_watchpoint_value(const MemoryRange& range,
                                Watchpoint& watchpoint);
   void update_watchpoint_values(remote_ptr<void> start, remote_ptr<void> end);
+  typedef std::pair<const MemoryRange, Watchpoint> WatchpointEntry;
+  /**
+   * Like calling update_watchpoint_value on each of |entries|, but reads
+   * them all with a single process_vm_readv where possible. Sets
+   * (*changed)[i] when the value of entries[i] changed.
+   */
+  void update_watchpoint_values(const std::vector<WatchpointEntry*>& entries,
+                                std::vector<bool>* changed);
+  /**
+   * Returns false if the x86 instruction at |ip| certainly doesn't write
+   * memory (or enter the kernel). Results for code in private, read-only
+   * mappings are cached until mappings change or rr writes memory.
+   */
+  bool instruction_may_write_memory(remote_code_ptr ip);
   // Whether to handle all watchpoints or just data watchpoints whose data
   // has changed. In the latter case we clear their changed status.
   enum WatchpointFilter { ALL_WATCHPOINTS, CHANGED_WATCHPOINTS };
@@ -944,6 +1001,15 @@ private:
    * in this address space.
    */
   bool allocate_watchpoints();
+  /**
+   * Returns true if every page of |range| can be write-protected to
+   * implement a software watchpoint.
+   */
+  bool can_software_watch(const MemoryRange& range) const;
+  /**
+   * Make the set of write-protected pages match the software watchpoints.
+   */
+  void update_software_watchpoint_protection(Task* t);
 
   /**
    * Merge the mappings adjacent to |it| in memory that are
@@ -1078,7 +1144,8 @@ private:
           write_count(0),
           value_bytes(num_bytes),
           valid(false),
-          changed(false) {}
+          changed(false),
+          software(false) {}
     Watchpoint(const Watchpoint&) = default;
     ~Watchpoint() { assert_valid(); }
 
@@ -1126,6 +1193,8 @@ private:
     std::vector<uint8_t> value_bytes;
     bool valid;
     bool changed;
+    // Implemented by write-protecting pages rather than by debug registers.
+    bool software;
   };
 
   // All breakpoints set in this VM.
@@ -1170,6 +1239,8 @@ private:
   // behalf of debuggers that assume that model.
   std::map<MemoryRange, Watchpoint> watchpoints;
   std::vector<std::map<MemoryRange, Watchpoint>> saved_watchpoints;
+  // Cached results of instruction_may_write_memory.
+  std::unordered_map<remote_code_ptr, bool> instruction_may_write_memory_cache;
   // Tracee memory is read and written through this fd, which is
   // opened for the tracee's magic /proc/[tid]/mem device.  The
   // advantage of this over ptrace is that we can access it even
@@ -1203,6 +1274,13 @@ private:
    */
   FrameTime first_run_event_;
 
+  // Pages we have write-protected to implement software watchpoints, mapped
+  // to the protection the tracee expects them to have.
+  std::map<remote_ptr<void>, int> software_watchpoint_pages;
+  // Set when the tracee changed mappings, which may have reset the
+  // protection of software watchpoint pages.
+  bool software_watchpoint_pages_dirty;
+
   std::set<remote_ptr<uint16_t>> stap_semaphores;
 
   /**
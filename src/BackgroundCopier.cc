@@ -0,0 +1,146 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "BackgroundCopier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+
+#include "kernel_metadata.h"
+#include "log.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+// Beyond this many queued copies, copy() copies synchronously.
+static const size_t MAX_QUEUED_JOBS = 16;
+
+BackgroundCopier::BackgroundCopier()
+    : thread_started(false), cpu_(-1), closing(false) {
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+}
+
+BackgroundCopier::~BackgroundCopier() {
+  finish();
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+}
+
+void* BackgroundCopier::thread_callback(void* p) {
+  static_cast<BackgroundCopier*>(p)->thread_main();
+  return nullptr;
+}
+
+// Don't compare ctime: unlinking or renaming the file changes it, and
+// that's harmless since we hold the inode open.
+static bool same_contents_version(const struct stat& a, const struct stat& b) {
+  return a.st_size == b.st_size && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+         a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+bool BackgroundCopier::copy(ScopedFd src, ScopedFd dest,
+                            const string& dest_path) {
+  Job job;
+  if (fstat(src, &job.src_stat) < 0) {
+    FATAL() << "Can't stat source for " << dest_path;
+  }
+  // Running out of space is the likeliest way for a copy to fail, so find
+  // out now, while the caller can still record the data another way.
+  if (job.src_stat.st_size > 0 &&
+      fallocate(dest, 0, 0, job.src_stat.st_size) < 0 &&
+      (errno == ENOSPC || errno == EDQUOT)) {
+    LOG(warn) << "No space to copy " << dest_path;
+    return false;
+  }
+  job.src = std::move(src);
+  job.dest = std::move(dest);
+  job.dest_path = dest_path;
+
+  if (!thread_started) {
+    // Block all signals in the helper thread, as for compression threads.
+    sigset_t set;
+    sigset_t old_mask;
+    sigfillset(&set);
+    sigprocmask(SIG_BLOCK, &set, &old_mask);
+    int err = pthread_create(&thread, nullptr, thread_callback, this);
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+    if (err) {
+      // Fall back to copying synchronously.
+      LOG(warn) << "Can't create copy thread: " << errno_name(err);
+      return copy_file(job.dest, job.src);
+    }
+    pthread_setname_np(thread, "file copier");
+    if (cpu_ >= 0) {
+      cpu_set_t mask;
+      CPU_ZERO(&mask);
+      CPU_SET(cpu_, &mask);
+      pthread_setaffinity_np(thread, sizeof(mask), &mask);
+    }
+    thread_started = true;
+  }
+
+  pthread_mutex_lock(&mutex);
+  if (jobs.size() >= MAX_QUEUED_JOBS) {
+    pthread_mutex_unlock(&mutex);
+    LOG(debug) << "Copy thread is behind; copying " << dest_path << " now";
+    return copy_file(job.dest, job.src);
+  }
+  jobs.push_back(std::move(job));
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  return true;
+}
+
+void BackgroundCopier::thread_main() {
+  pthread_mutex_lock(&mutex);
+  while (true) {
+    if (!jobs.empty()) {
+      Job job = std::move(jobs.front());
+      jobs.pop_front();
+      pthread_mutex_unlock(&mutex);
+
+      bool ok = copy_file(job.dest, job.src);
+      struct stat after;
+      if (ok && (fstat(job.src, &after) < 0 ||
+                 !same_contents_version(job.src_stat, after))) {
+        LOG(warn) << "Source of " << job.dest_path
+                  << " was modified while being copied";
+        ok = false;
+      }
+      job.src.close();
+      job.dest.close();
+
+      pthread_mutex_lock(&mutex);
+      if (!ok) {
+        failures.push_back(job.dest_path);
+      }
+      continue;
+    }
+    if (closing) {
+      break;
+    }
+    pthread_cond_wait(&cond, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+vector<string> BackgroundCopier::finish() {
+  if (thread_started) {
+    pthread_mutex_lock(&mutex);
+    closing = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread, nullptr);
+    thread_started = false;
+    closing = false;
+  }
+  vector<string> ret;
+  swap(ret, failures);
+  return ret;
+}
+
+} // namespace rr
@@ -0,0 +1,80 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_BACKGROUND_COPIER_H_
+#define RR_BACKGROUND_COPIER_H_
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "ScopedFd.h"
+
+namespace rr {
+
+/**
+ * Copies files on a helper thread so the recording doesn't stall while a
+ * large mapped file is copied into the trace directory. The source is
+ * pinned by keeping its fd open, so it's fine for the file to be unlinked
+ * or renamed over in the meantime; if it's modified in place after copy()
+ * is called, the copy is reported as failed by finish().
+ *
+ * All methods must be called from the same thread.
+ */
+class BackgroundCopier {
+public:
+  BackgroundCopier();
+  ~BackgroundCopier();
+
+  /**
+   * Queue a copy of |src| into |dest|. |dest_path| is only used to identify
+   * the copy in finish()'s failure list and log messages.
+   * Space for the copy is reserved up front, and if the helper thread is
+   * too far behind the copy is done synchronously instead. Returns false if
+   * either of those fails, in which case nothing is queued and the caller
+   * must not rely on |dest|.
+   */
+  bool copy(ScopedFd src, ScopedFd dest, const std::string& dest_path);
+
+  /**
+   * Run the helper thread on |cpu| (if >= 0) instead of inheriting our
+   * affinity. Takes effect when the thread is started by the first copy().
+   */
+  void set_cpu(int cpu) { cpu_ = cpu; }
+
+  /**
+   * Wait for all queued copies to complete and stop the helper thread.
+   * Returns the |dest_path| of each copy that failed.
+   */
+  std::vector<std::string> finish();
+
+private:
+  struct Job {
+    ScopedFd src;
+    ScopedFd dest;
+    std::string dest_path;
+    struct stat src_stat;
+  };
+
+  static void* thread_callback(void* p);
+  void thread_main();
+
+  pthread_t thread;
+  bool thread_started;
+  int cpu_;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // BEGIN protected by 'mutex'
+  // Bounded, since each job holds two fds open.
+  std::deque<Job> jobs;
+  std::vector<std::string> failures;
+  bool closing;
+  // END protected by 'mutex'
+};
+
+} // namespace rr
+
+#endif /* RR_BACKGROUND_COPIER_H_ */
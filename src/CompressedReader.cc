@@ -13,6 +13,7 @@
 #include <unistd.h>
 
 #include "CompressedWriter.h"
+#include "IoUring.h"
 #include "core.h"
 #include "util.h"
 
@@ -59,6 +60,58 @@ static bool read_all(const ScopedFd& fd, size_t size, void* data,
   return false;
 }
 
+void CompressedReader::start_prefetch(size_t block_size) {
+  IoUring* ring = IoUring::for_thread();
+  if (!ring) {
+    return;
+  }
+  finish_prefetch();
+  if (!prefetch) {
+    prefetch = unique_ptr<Prefetch>(new Prefetch());
+  }
+  // Enough for the next block compressed with CompressedWriter's slop for
+  // incompressible data, plus its header and the one after it.
+  prefetch->data.resize(block_size + block_size / 10 +
+                        2 * sizeof(CompressedWriter::BlockHeader));
+  static thread_local uint64_t next_id = 0;
+  prefetch->offset = fd_offset;
+  prefetch->length = 0;
+  prefetch->id = next_id++;
+  prefetch->pid = getpid();
+  prefetch->ring = ring;
+  prefetch->in_flight =
+      ring->queue_read(*fd, prefetch->data.data(), prefetch->data.size(),
+                       fd_offset, prefetch->id) &&
+      ring->submit();
+}
+
+void CompressedReader::finish_prefetch() {
+  if (!prefetch || !prefetch->in_flight) {
+    return;
+  }
+  prefetch->in_flight = false;
+  if (prefetch->pid != getpid()) {
+    // Issued by the process we were forked from; we'll never see it
+    // complete and the kernel isn't writing to our copy of the buffer.
+    return;
+  }
+  // Only the thread that issued the read may reap it from its ring.
+  DEBUG_ASSERT(prefetch->ring == IoUring::for_thread());
+  int32_t ret = prefetch->ring->wait(prefetch->id);
+  prefetch->length = ret > 0 ? ret : 0;
+}
+
+bool CompressedReader::read_block_data(void* data, size_t size) {
+  finish_prefetch();
+  if (prefetch && fd_offset >= prefetch->offset &&
+      fd_offset + size <= prefetch->offset + prefetch->length) {
+    memcpy(data, &prefetch->data[fd_offset - prefetch->offset], size);
+    fd_offset += size;
+    return true;
+  }
+  return read_all(*fd, size, data, &fd_offset);
+}
+
 static bool do_decompress(std::vector<uint8_t>& compressed,
                           std::vector<uint8_t>& uncompressed) {
   size_t out_size = uncompressed.size();
@@ -134,7 +187,7 @@ bool CompressedReader::refill_buffer(size_t* skip_bytes) {
 
   while (true) {
     CompressedWriter::BlockHeader header;
-    if (!read_all(*fd, sizeof(header), &header, &fd_offset)) {
+    if (!read_block_data(&header, sizeof(header))) {
       error = true;
       return false;
     }
@@ -152,7 +205,7 @@ bool CompressedReader::refill_buffer(size_t* skip_bytes) {
 
     std::vector<uint8_t> compressed_buf;
     compressed_buf.resize(header.compressed_length);
-    if (!read_all(*fd, compressed_buf.size(), &compressed_buf[0], &fd_offset)) {
+    if (!read_block_data(&compressed_buf[0], compressed_buf.size())) {
       error = true;
       return false;
     }
@@ -160,6 +213,10 @@ bool CompressedReader::refill_buffer(size_t* skip_bytes) {
     char ch;
     if (pread(*fd, &ch, 1, fd_offset) == 0) {
       eof = true;
+    } else {
+      // Only the last block of a file is short, so this one tells us the
+      // substream's block size.
+      start_prefetch(header.uncompressed_length);
     }
 
     buffer.resize(header.uncompressed_length);
@@ -182,7 +239,11 @@ void CompressedReader::rewind() {
   eof = false;
 }
 
-void CompressedReader::close() { fd = nullptr; }
+void CompressedReader::close() {
+  // The kernel may be reading into our prefetch buffer.
+  finish_prefetch();
+  fd = nullptr;
+}
 
 void CompressedReader::save_state() {
   DEBUG_ASSERT(!have_saved_state);
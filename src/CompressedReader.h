@@ -14,10 +14,13 @@
 
 namespace rr {
 
+class IoUring;
+
 /**
  * CompressedReader opens an input file written by CompressedWriter
  * and reads data from it. Currently data is decompressed by the thread that
- * calls read().
+ * calls read(). With --io-uring, the next compressed block is read
+ * asynchronously while the current one is being decompressed.
  */
 class CompressedReader {
 public:
@@ -65,6 +68,27 @@ public:
 protected:
   void process_skip();
   bool refill_buffer(size_t* skip_bytes = nullptr);
+  // Read |size| bytes at fd_offset and advance it, using prefetched data
+  // if possible.
+  bool read_block_data(void* data, size_t size);
+  // Start reading the block after the current one, given the uncompressed
+  // size of the current block.
+  void start_prefetch(size_t block_size);
+  void finish_prefetch();
+
+  /* Asynchronous read-ahead state. 'data' is being written by the kernel
+     while 'in_flight' is set. */
+  struct Prefetch {
+    std::vector<uint8_t> data;
+    uint64_t offset;
+    size_t length;
+    uint64_t id;
+    pid_t pid;
+    // The issuing thread's ring; only that thread may wait for the read.
+    IoUring* ring;
+    bool in_flight;
+  };
+  std::unique_ptr<Prefetch> prefetch;
 
   /* Our fd might be the dup of another fd, so we can't rely on its current file
      position.
@@ -13,7 +13,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "IoUring.h"
 #include "core.h"
+#include "log.h"
 #include "util.h"
 
 using namespace std;
@@ -24,6 +26,15 @@ namespace rr {
  * http://robert.ocallahan.org/2017/07/selecting-compression-algorithm-for-rr.html
  */
 static const int BROTLI_LEVEL = 5;
+/* The compression level adapts to load between these bounds. When the data
+ * the producer has written but we haven't finished compressing fills more
+ * than 3/4 of the buffer, or the producer had to wait for buffer space, we're
+ * falling behind, so we compress faster; when it's under 1/4 we have spare
+ * capacity and compress harder. Blocks decompress the same way whatever level
+ * was used.
+ */
+static const int BROTLI_MIN_LEVEL = 1;
+static const int BROTLI_MAX_LEVEL = 7;
 
 void* CompressedWriter::compression_thread_callback(void* p) {
   static_cast<CompressedWriter*>(p)->compression_thread();
@@ -48,10 +59,16 @@ CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
   next_thread_end_pos = 0;
   closing = false;
   write_error = false;
+  level = BROTLI_LEVEL;
+  min_level_ = level;
+  adapted_block_count = 0;
+  next_write_offset = 0;
 
   producer_reserved_pos = 0;
   producer_reserved_write_pos = 0;
   producer_reserved_upto_pos = 0;
+  producer_blocked_sec_ = 0;
+  producer_block_count_ = 0;
   error = false;
   if (fd < 0) {
     error = true;
@@ -127,6 +144,7 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
   // Wake up threads that might be waiting to consume data.
   pthread_cond_broadcast(&cond);
 
+  double block_start = 0;
   while (!error) {
     if (write_error) {
       error = true;
@@ -143,13 +161,71 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
       break;
     }
 
+    if (!block_start) {
+      block_start = monotonic_now_sec();
+      ++producer_block_count_;
+    }
     pthread_cond_wait(&cond, &mutex);
   }
 
   pthread_mutex_unlock(&mutex);
+
+  if (block_start) {
+    producer_blocked_sec_ += monotonic_now_sec() - block_start;
+  }
+}
+
+/**
+ * Write a compressed block at |offset|. Any error or "device full" is treated
+ * as fatal, as with write_all.
+ */
+static void write_block(int fd, const uint8_t* data, size_t len,
+                        uint64_t offset) {
+  if (pwrite_all_fallible(fd, data, len, offset) != (ssize_t)len) {
+    FATAL() << "Can't write " << len << " bytes";
+  }
 }
 
 void CompressedWriter::compression_thread() {
+  // Add slop for incompressible data
+  size_t outputbuf_size = (size_t)(block_size * 1.1) + sizeof(BlockHeader);
+  // With io_uring, we alternate between two registered output buffers so we
+  // can compress the next block while the kernel writes the previous one.
+  unique_ptr<IoUring> ring = IoUring::create(4);
+  vector<uint8_t> outputbufs[2];
+  outputbufs[0].resize(outputbuf_size);
+  struct PendingWrite {
+    bool active;
+    uint64_t offset;
+    size_t length;
+  } pending[2] = { { false, 0, 0 }, { false, 0, 0 } };
+  int buffer_count = 1;
+  bool fixed_buffers = false;
+  if (ring) {
+    outputbufs[1].resize(outputbuf_size);
+    buffer_count = 2;
+    vector<struct iovec> iovs;
+    for (auto& b : outputbufs) {
+      iovs.push_back({ b.data(), b.size() });
+    }
+    fixed_buffers = ring->register_buffers(iovs);
+  }
+  // Make sure the write from |index| has finished so it can be reused.
+  auto finish_write = [&](int index) {
+    PendingWrite& w = pending[index];
+    if (!w.active) {
+      return;
+    }
+    w.active = false;
+    int32_t ret = ring->wait(index);
+    size_t done = ret > 0 ? ret : 0;
+    if (done < w.length) {
+      // Short write or failure; finish synchronously.
+      write_block(fd, &outputbufs[index][done], w.length - done,
+                  w.offset + done);
+    }
+  };
+
   pthread_mutex_lock(&mutex);
 
   int thread_index;
@@ -157,26 +233,27 @@ void CompressedWriter::compression_thread() {
   for (thread_index = 0; threads[thread_index] != self; ++thread_index) {
   }
 
-  // Add slop for incompressible data
-  vector<uint8_t> outputbuf;
-  outputbuf.resize((size_t)(block_size * 1.1) + sizeof(BlockHeader));
-  BlockHeader* header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
-
+  int current = 0;
   while (true) {
     if (!write_error && next_thread_pos < next_thread_end_pos &&
         (closing || next_thread_pos + block_size <= next_thread_end_pos)) {
+      vector<uint8_t>& outputbuf = outputbufs[current];
+      BlockHeader* header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
       thread_pos[thread_index] = next_thread_pos;
       next_thread_pos = min(next_thread_end_pos, next_thread_pos + block_size);
       // header->uncompressed_length must be <= block_size,
       // therefore fits in a size_t.
-      header->uncompressed_length =
+      size_t uncompressed_length =
           (size_t)(next_thread_pos - thread_pos[thread_index]);
+      int block_level = adapt_level();
 
       pthread_mutex_unlock(&mutex);
+      finish_write(current);
+      header->uncompressed_length = uncompressed_length;
       header->compressed_length =
           do_compress(thread_pos[thread_index], header->uncompressed_length,
                       &outputbuf[sizeof(BlockHeader)],
-                      outputbuf.size() - sizeof(BlockHeader));
+                      outputbuf.size() - sizeof(BlockHeader), block_level);
       pthread_mutex_lock(&mutex);
 
       if (header->compressed_length == 0) {
@@ -198,9 +275,24 @@ void CompressedWriter::compression_thread() {
       }
 
       if (!write_error) {
+        // Claim our place in the output file. After that, the writes
+        // themselves can proceed in any order, so we don't hold up the
+        // next thread while ours is in progress.
+        size_t length = sizeof(BlockHeader) + header->compressed_length;
+        uint64_t offset = next_write_offset;
+        next_write_offset += length;
+        thread_pos[thread_index] = UINT64_MAX;
+        pthread_cond_broadcast(&cond);
         pthread_mutex_unlock(&mutex);
-        write_all(fd, &outputbuf[0],
-                  sizeof(BlockHeader) + header->compressed_length);
+        if (ring &&
+            ring->queue_write(fd, outputbuf.data(), length, offset,
+                              fixed_buffers ? current : -1, current) &&
+            ring->submit()) {
+          pending[current] = { true, offset, length };
+        } else {
+          write_block(fd, outputbuf.data(), length, offset);
+        }
+        current = (current + 1) % buffer_count;
         pthread_mutex_lock(&mutex);
       }
 
@@ -220,6 +312,10 @@ void CompressedWriter::compression_thread() {
   }
 
   pthread_mutex_unlock(&mutex);
+
+  for (int i = 0; i < buffer_count; ++i) {
+    finish_write(i);
+  }
 }
 
 void CompressedWriter::close(Sync sync) {
@@ -251,13 +347,43 @@ void CompressedWriter::close(Sync sync) {
   fd.close();
 }
 
+void CompressedWriter::set_thread_affinity(size_t index,
+                                           const cpu_set_t& mask) {
+  int err = pthread_setaffinity_np(threads[index], sizeof(mask), &mask);
+  if (err) {
+    LOG(warn) << "Couldn't set compression thread affinity: "
+              << errno_name(err);
+  }
+}
+
+int CompressedWriter::adapt_level() {
+  // Everything the producer has handed over that hasn't been compressed and
+  // written yet, including blocks other threads are still working on. This
+  // is what limits the producer's reservation in update_reservation.
+  uint64_t completed_pos = next_thread_pos;
+  for (uint32_t i = 0; i < thread_pos.size(); ++i) {
+    completed_pos = min(completed_pos, thread_pos[i]);
+  }
+  uint64_t backlog = next_thread_end_pos - completed_pos;
+  bool producer_blocked = producer_block_count_ != adapted_block_count;
+  adapted_block_count = producer_block_count_;
+  if (producer_blocked || backlog > buffer.size() * 3 / 4) {
+    level = max(BROTLI_MIN_LEVEL, level - 1);
+  } else if (backlog < buffer.size() / 4) {
+    level = min(BROTLI_MAX_LEVEL, level + 1);
+  }
+  min_level_ = min(min_level_, level);
+  return level;
+}
+
 size_t CompressedWriter::do_compress(uint64_t offset, size_t length,
-                                     uint8_t* outputbuf, size_t outputbuf_len) {
+                                     uint8_t* outputbuf, size_t outputbuf_len,
+                                     int quality) {
   BrotliEncoderState* state = BrotliEncoderCreateInstance(NULL, NULL, NULL);
   if (!state) {
     DEBUG_ASSERT(0 && "BrotliEncoderCreateInstance failed");
   }
-  if (!BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, BROTLI_LEVEL)) {
+  if (!BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, quality)) {
     DEBUG_ASSERT(0 && "Brotli initialization failed");
   }
 
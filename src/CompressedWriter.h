@@ -22,12 +22,14 @@ namespace rr {
  * and the size of the uncompressed data, in that order. See BlockHeader below.
  *
  * We use multiple threads to perform compression. The threads are
- * responsible for the actual data writes. The thread that creates the
+ * responsible for the actual data writes, which go through io_uring when
+ * --io-uring is given and the kernel supports it. The thread that creates the
  * CompressedWriter is the "producer" thread and must also be the caller of
  * 'write'. The producer thread may block in 'write' if 'buffer_size' bytes are
  * being compressed.
  *
- * Each data block is compressed independently using zlib.
+ * Each data block is compressed independently using brotli, at a quality
+ * that adapts to how far the compression threads are behind the producer.
  */
 class CompressedWriter {
 public:
@@ -41,6 +43,15 @@ public:
   enum Sync { DONT_SYNC, SYNC };
   // Call only on producer thread
   void close(Sync sync = DONT_SYNC);
+  size_t num_threads() const { return threads.size(); }
+  // Restrict compression thread |index| to the CPUs in |mask|.
+  void set_thread_affinity(size_t index, const cpu_set_t& mask);
+  // Total time the producer spent blocked waiting for compression threads
+  // to free up buffer space, and how many times it blocked.
+  double producer_blocked_sec() const { return producer_blocked_sec_; }
+  uint64_t producer_block_count() const { return producer_block_count_; }
+  // Lowest compression level used for any block. Call after close().
+  int min_level() const { return min_level_; }
 
   struct BlockHeader {
     uint32_t compressed_length;
@@ -53,8 +64,12 @@ protected:
 
   static void* compression_thread_callback(void* p);
   void compression_thread();
+  // Call with 'mutex' held. Returns the compression level for the block
+  // being dispatched, adjusted for how much written data is still waiting
+  // to be compressed and whether the producer has had to wait for us.
+  int adapt_level();
   size_t do_compress(uint64_t offset, size_t length, uint8_t* outputbuf,
-                     size_t outputbuf_len);
+                     size_t outputbuf_len, int quality);
 
   // Immutable while threads are running
   ScopedFd fd;
@@ -76,6 +91,13 @@ protected:
   uint64_t next_thread_end_pos;
   bool closing;
   bool write_error;
+  /* current brotli quality for newly dispatched blocks */
+  int level;
+  int min_level_;
+  /* producer_block_count_ when the level was last adapted */
+  uint64_t adapted_block_count;
+  /* file offset at which the next compressed block will be written */
+  uint64_t next_write_offset;
   // END protected by 'mutex'
 
   /* producer thread only */
@@ -83,6 +105,9 @@ protected:
   uint64_t producer_reserved_pos;
   uint64_t producer_reserved_write_pos;
   uint64_t producer_reserved_upto_pos;
+  double producer_blocked_sec_;
+  /* Also read by compression threads; only updated with 'mutex' held. */
+  uint64_t producer_block_count_;
   bool error;
 };
 
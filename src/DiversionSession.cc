@@ -2,7 +2,10 @@
 
 #include "DiversionSession.h"
 
+#include <fcntl.h>
+#include <limits.h>
 #include <linux/prctl.h>
+#include <unistd.h>
 
 #include "AutoRemoteSyscalls.h"
 #include "ReplaySession.h"
@@ -15,7 +18,8 @@ using namespace std;
 namespace rr {
 
 DiversionSession::DiversionSession(int cpu_binding) :
-  emu_fs(EmuFs::create()), fake_rdstc(uint64_t(1) << 60), cpu_binding_(cpu_binding) {}
+  emu_fs(EmuFs::create()), fake_rdstc(uint64_t(1) << 60), cpu_binding_(cpu_binding),
+  tracked_rdtsc(0), executed_syscall(false) {}
 
 DiversionSession::~DiversionSession() {
   // We won't permanently leak any OS resources by not ensuring
@@ -56,6 +60,174 @@ uint64_t DiversionSession::next_rdtsc_value() {
   return rdtsc_value;
 }
 
+#define PM_SOFT_DIRTY (1ULL << 55)
+
+static bool clear_soft_dirty(Task* t) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path) - 1, "/proc/%d/clear_refs", t->tid);
+  ScopedFd fd(path, O_WRONLY);
+  return fd.is_open() && write(fd, "4", 1) == 1;
+}
+
+static bool read_pagemap(Task* t, remote_ptr<void> start, size_t pages,
+                         vector<uint64_t>& entries) {
+  ScopedFd& fd = t->pagemap_fd();
+  if (!fd.is_open()) {
+    return false;
+  }
+  entries.resize(pages);
+  ssize_t bytes = pread(fd, entries.data(), pages * sizeof(uint64_t),
+                        start.as_int() / page_size() * sizeof(uint64_t));
+  return bytes == (ssize_t)(pages * sizeof(uint64_t));
+}
+
+/**
+ * Kernels without CONFIG_MEM_SOFT_DIRTY accept clear_refs but never set the
+ * bit, so check that rewriting a stack byte with its own value gets noticed.
+ */
+static bool soft_dirty_works(Task* t) {
+  remote_ptr<uint8_t> sp = t->regs().sp().cast<uint8_t>();
+  bool ok = true;
+  uint8_t b = t->read_mem(sp, &ok);
+  if (!ok) {
+    return false;
+  }
+  t->write_mem(sp, b, &ok);
+  vector<uint64_t> entry;
+  return ok && read_pagemap(t, floor_page_size(sp.cast<void>()), 1, entry) &&
+         (entry[0] & PM_SOFT_DIRTY);
+}
+
+static vector<KernelMapping> kernel_mappings(Task* t) {
+  vector<KernelMapping> result;
+  for (KernelMapIterator it(t); !it.at_end(); ++it) {
+    result.push_back(it.current());
+  }
+  return result;
+}
+
+static bool same_mappings(const vector<KernelMapping>& a,
+                          const vector<KernelMapping>& b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].start() != b[i].start() || a[i].end() != b[i].end() ||
+        a[i].prot() != b[i].prot() || a[i].flags() != b[i].flags() ||
+        a[i].inode() != b[i].inode() ||
+        a[i].file_offset_bytes() != b[i].file_offset_bytes()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DiversionSession::track_changes() {
+  tracked_tasks.clear();
+  tracked_mappings.clear();
+  for (auto& kv : tasks()) {
+    Task* t = kv.second;
+    tracked_tasks[t->tuid()] = TrackedTask{ t->regs(), t->extra_regs() };
+  }
+  for (AddressSpace* vm : vms()) {
+    Task* t = vm->first_running_task();
+    if (!t || !clear_soft_dirty(t) || !soft_dirty_works(t) ||
+        !clear_soft_dirty(t)) {
+      LOG(debug) << "Soft-dirty tracking unavailable; can't reuse diversion";
+      return false;
+    }
+    tracked_mappings[vm->uid()] = kernel_mappings(t);
+  }
+  tracked_rdtsc = fake_rdstc;
+  executed_syscall = false;
+  return true;
+}
+
+bool DiversionSession::reset_changes(ReplaySession& replay) {
+  if (executed_syscall) {
+    LOG(debug) << "Diversion executed syscalls; can't reset it";
+    return false;
+  }
+  if (tasks().size() != tracked_tasks.size() ||
+      vms().size() != tracked_mappings.size()) {
+    return false;
+  }
+  for (auto& kv : tracked_tasks) {
+    if (!find_task(kv.first)) {
+      return false;
+    }
+  }
+
+  const size_t max_pages = 65536;
+  vector<uint64_t> entries;
+  vector<uint8_t> ours;
+  vector<uint8_t> theirs;
+  size_t pages_restored = 0;
+  for (AddressSpace* vm : vms()) {
+    auto tracked = tracked_mappings.find(vm->uid());
+    AddressSpace* replay_vm = replay.find_address_space(vm->uid());
+    Task* t = vm->first_running_task();
+    Task* replay_t = replay_vm ? replay_vm->first_running_task() : nullptr;
+    if (tracked == tracked_mappings.end() || !t || !replay_t ||
+        !same_mappings(kernel_mappings(t), tracked->second)) {
+      return false;
+    }
+    for (auto& km : tracked->second) {
+      if (!(km.prot() & PROT_READ)) {
+        continue;
+      }
+      size_t total = km.size() / page_size();
+      for (size_t offset = 0; offset < total; offset += max_pages) {
+        size_t count = min(max_pages, total - offset);
+        remote_ptr<void> chunk = km.start() + offset * page_size();
+        if (!read_pagemap(t, chunk, count, entries)) {
+          return false;
+        }
+        for (size_t i = 0; i < count; ++i) {
+          if (!(entries[i] & PM_SOFT_DIRTY)) {
+            continue;
+          }
+          size_t end = i + 1;
+          while (end < count && (entries[end] & PM_SOFT_DIRTY)) {
+            ++end;
+          }
+          MemoryRange r(chunk + i * page_size(), (end - i) * page_size());
+          i = end - 1;
+          // Breakpoints are hidden from both reads.
+          ours.resize(r.size());
+          theirs.resize(r.size());
+          t->read_bytes_helper(r.start(), r.size(), ours.data());
+          replay_t->read_bytes_helper(r.start(), r.size(), theirs.data());
+          if (ours == theirs) {
+            continue;
+          }
+          if ((km.prot() & PROT_EXEC) || !(km.prot() & PROT_WRITE) ||
+              vm->has_breakpoint_in(r)) {
+            LOG(debug) << "Diversion modified " << r << "; can't reset it";
+            return false;
+          }
+          t->write_bytes_helper(r.start(), r.size(), theirs.data());
+          pages_restored += r.size() / page_size();
+        }
+      }
+    }
+  }
+
+  for (auto& kv : tracked_tasks) {
+    Task* t = find_task(kv.first);
+    t->set_regs(kv.second.regs);
+    t->set_extra_regs(kv.second.extra_regs);
+  }
+  fake_rdstc = tracked_rdtsc;
+  for (AddressSpace* vm : vms()) {
+    if (!clear_soft_dirty(vm->first_running_task())) {
+      return false;
+    }
+  }
+  LOG(debug) << "Reset diversion, restoring " << pages_restored << " pages";
+  return true;
+}
+
 template <typename Arch>
 static void process_syscall_arch(Task* t, int syscallno) {
   LOG(debug) << "Processing " << syscall_name(syscallno, Arch::arch());
@@ -150,6 +322,7 @@ static void process_syscall_arch(Task* t, int syscallno) {
   }
 
   LOG(debug) << "Executing syscall " << syscall_name(syscallno, t->arch());
+  static_cast<DiversionSession*>(&t->session())->note_executed_syscall();
   execute_syscall(t);
 }
 
@@ -61,12 +61,45 @@ public:
 
   uint64_t next_rdtsc_value();
 
+  /**
+   * Remember the tracees' current state so reset_changes() can return to it.
+   * Relies on the kernel's soft-dirty page tracking and returns false if
+   * that isn't available.
+   */
+  bool track_changes();
+  /**
+   * Undo what the tracees did since track_changes(): restore their registers
+   * and copy the pages they dirtied back from |replay|, which must still be
+   * in the state this session was cloned from. Returns false if they changed
+   * something we don't undo (the task set, mappings or code), in which case
+   * this session should be discarded.
+   * Kernel-side state such as fd offsets, signal handlers and masks, and
+   * EmuFs file contents can't be undone this way, so this also returns false
+   * if the tracees executed any syscall we didn't emulate.
+   */
+  bool reset_changes(ReplaySession& replay);
+  /**
+   * Called when a tracee syscall is passed through to the kernel.
+   */
+  void note_executed_syscall() { executed_syscall = true; }
+
 private:
   friend class ReplaySession;
 
+  struct TrackedTask {
+    Registers regs;
+    ExtraRegisters extra_regs;
+  };
+
   std::shared_ptr<EmuFs> emu_fs;
   uint64_t fake_rdstc;
   int cpu_binding_;
+  // State saved by track_changes().
+  std::map<TaskUid, TrackedTask> tracked_tasks;
+  std::map<AddressSpaceUid, std::vector<KernelMapping>> tracked_mappings;
+  uint64_t tracked_rdtsc;
+  // Whether a syscall has reached the kernel since track_changes().
+  bool executed_syscall;
 };
 
 } // namespace rr
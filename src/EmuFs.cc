@@ -2,7 +2,9 @@
 
 #include "EmuFs.h"
 
+#include <fcntl.h>
 #include <syscall.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <linux/fs.h>
 
@@ -15,6 +17,7 @@
 #include "core.h"
 #include "kernel_abi.h"
 #include "kernel_metadata.h"
+#include "kernel_supplement.h"
 #include "log.h"
 
 using namespace std;
@@ -27,11 +30,31 @@ EmuFile::~EmuFile() {
 }
 
 EmuFile::shr_ptr EmuFile::clone(EmuFs& owner) {
-  auto f = EmuFile::create(owner, orig_path.c_str(), device(), inode(), size_);
+  auto f = EmuFile::create(owner, orig_path.c_str(), device(), inode(), size_,
+                           backing_dir);
+
+  // tmpfs doesn't support FICLONE, so this only works when the files live
+  // in a backing directory on a filesystem with reflinks. Then the clone
+  // only costs a metadata update, and extents are only copied as either
+  // file is modified.
+  if (!backing_dir.empty()) {
+    if (ioctl(f->fd(), BTRFS_IOC_CLONE, file.get()) == 0) {
+      LOG(debug) << "reflinked emulated file " << orig_path;
+      return f;
+    }
+    static bool warned = false;
+    if (!warned) {
+      LOG(warn) << "Can't reflink emulated files in " << backing_dir << ": "
+                << errno_name(errno) << "; copying them instead";
+      warned = true;
+    }
+  }
 
-  // We could try using FICLONE but tmpfs doesn't support that yet so let's just
-  // not bother for now.
+  copy_data_to(*f);
+  return f;
+}
 
+void EmuFile::copy_data_to(EmuFile& dest) {
   // Avoid copying holes.
   vector<uint8_t> buf;
   uint64_t offset = 0;
@@ -50,7 +73,7 @@ EmuFile::shr_ptr EmuFile::clone(EmuFs& owner) {
       loff_t off_in = offset;
       loff_t off_out = offset;
       ssize_t ncopied = syscall(NativeArch::copy_file_range, file.get(), &off_in,
-                                f->fd().get(), &off_out, hole - offset, 0);
+                                dest.fd().get(), &off_out, hole - offset, 0);
       if (ncopied >= 0) {
         if (ncopied == 0) {
           FATAL() << "Didn't copy anything";
@@ -65,7 +88,7 @@ EmuFile::shr_ptr EmuFile::clone(EmuFs& owner) {
       if (ret <= 0) {
         FATAL() << "Couldn't read all the data";
       }
-      ssize_t written = pwrite_all_fallible(f->fd(), buf.data(), ret, offset);
+      ssize_t written = pwrite_all_fallible(dest.fd(), buf.data(), ret, offset);
       if (written < ret) {
         FATAL() << "Couldn't write all the data";
       }
@@ -87,8 +110,6 @@ EmuFile::shr_ptr EmuFile::clone(EmuFs& owner) {
       offset = ret;
     }
   }
-
-  return f;
 }
 
 string EmuFile::proc_path() const {
@@ -124,16 +145,28 @@ std::string make_temp_name(const string& orig_path, dev_t orig_device,
 /*static*/ EmuFile::shr_ptr EmuFile::create(EmuFs& owner,
                                             const string& orig_path,
                                             dev_t orig_device, ino_t orig_inode,
-                                            uint64_t orig_file_size) {
+                                            uint64_t orig_file_size,
+                                            const string& backing_dir) {
   string real_name = make_temp_name(orig_path, orig_device, orig_inode);
-  ScopedFd fd(open_memory_file(real_name));
-  if (!fd.is_open()) {
-    FATAL() << "Failed to create shmem segment for " << real_name;
+  ScopedFd fd;
+  if (!backing_dir.empty()) {
+    // O_TMPFILE so nothing needs to be cleaned up if we die.
+    fd = ScopedFd(backing_dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (!fd.is_open()) {
+      FATAL() << "Failed to create emulated file for " << real_name << " in "
+              << backing_dir;
+    }
+  } else {
+    fd = open_memory_file(real_name);
+    if (!fd.is_open()) {
+      FATAL() << "Failed to create shmem segment for " << real_name;
+    }
   }
   resize_shmem_segment(fd, orig_file_size);
 
   shr_ptr f(new EmuFile(owner, std::move(fd), orig_path, real_name, orig_device,
                         orig_inode, orig_file_size));
+  f->backing_dir = backing_dir;
 
   LOG(debug) << "created emulated file for " << orig_path << " as "
              << real_name;
@@ -177,7 +210,7 @@ EmuFile::shr_ptr EmuFs::get_or_create(const KernelMapping& recorded_km) {
     return it->second.lock();
   }
   auto vf = EmuFile::create(*this, recorded_km.fsname(), recorded_km.device(),
-                            recorded_km.inode(), min_file_size);
+                            recorded_km.inode(), min_file_size, backing_dir_);
   files[id] = vf;
   return vf;
 }
@@ -199,9 +232,11 @@ void EmuFs::log() const {
   }
 }
 
-/*static*/ EmuFs::shr_ptr EmuFs::create() { return shr_ptr(new EmuFs()); }
+/*static*/ EmuFs::shr_ptr EmuFs::create(const string& backing_dir) {
+  return shr_ptr(new EmuFs(backing_dir));
+}
 
-EmuFs::EmuFs() {}
+EmuFs::EmuFs(const string& backing_dir) : backing_dir_(backing_dir) {}
 
 FileId::FileId(const KernelMapping& recorded_map)
     : device(recorded_map.device()), inode(recorded_map.inode()) {}
@@ -114,10 +114,19 @@ private:
 
   /**
    * Return a copy of this file.  See |create()| for the meaning
-   * of |fs_tag|.
+   * of |fs_tag|.  If this file lives in a reflink-capable backing
+   * directory, the copy shares all data with this file until either
+   * is written to, so the cost is proportional to the number of
+   * extents, not the file size.
    */
   shr_ptr clone(EmuFs& owner);
 
+  /**
+   * Copy the data of this file into |dest| byte by byte, skipping
+   * holes.
+   */
+  void copy_data_to(EmuFile& dest);
+
   /**
    * Ensure that the emulated file is sized to match a later
    * stat() of it.
@@ -128,14 +137,18 @@ private:
    * Create a new emulated file for |orig_path| that will
    * emulate the recorded attributes |est|.  |tag| is used to
    * uniquely identify this file among multiple EmuFs's that
-   * might exist concurrently in this tracer process.
+   * might exist concurrently in this tracer process.  If
+   * |backing_dir| is nonempty, the file is created (unlinked) in
+   * that directory rather than in shared memory.
    */
   static shr_ptr create(EmuFs& owner, const std::string& orig_path,
                         dev_t orig_device, ino_t orig_inode,
-                        uint64_t orig_file_size);
+                        uint64_t orig_file_size,
+                        const std::string& backing_dir);
 
   std::string orig_path;
   std::string tmp_path;
+  std::string backing_dir;
   ScopedFd file;
   EmuFs& owner;
   uint64_t size_;
@@ -179,17 +192,25 @@ public:
 
   size_t size() const { return files.size(); }
 
-  /** Create and return a new emufs. */
-  static shr_ptr create();
+  /**
+   * Create and return a new emufs.  If |backing_dir| is nonempty,
+   * new emulated files are created there instead of in shared
+   * memory.  Pointing it at a filesystem that supports reflinks
+   * (btrfs, XFS) makes cloning files for checkpoints copy-on-write.
+   */
+  static shr_ptr create(const std::string& backing_dir = std::string());
+
+  const std::string& backing_dir() const { return backing_dir_; }
 
   void destroyed_file(EmuFile& emu_file) { files.erase(FileId(emu_file)); }
 
 private:
-  EmuFs();
+  EmuFs(const std::string& backing_dir);
 
   typedef std::map<FileId, std::weak_ptr<EmuFile>> FileMap;
 
   FileMap files;
+  std::string backing_dir_;
 
   EmuFs(const EmuFs&) = delete;
   EmuFs& operator=(const EmuFs&) = delete;
@@ -144,118 +144,155 @@ static void set_title(const vector<string>& args) {
   memset(arg0 + line.size(), 0, space - line.size());
 }
 
-CommandForCheckpoint export_checkpoints(ReplaySession::shr_ptr session, int count, ScopedFd& sock,
-    const std::string&) {
-  if (!session->can_clone()) {
-    FATAL() << "Can't create checkpoints at this time, aborting: " << session->current_frame_time();
+pid_t fork_checkpoint(ReplaySession& checkpoint,
+    const vector<ReplaySession*>& owned_sessions,
+    const function<void()>& prepare_child) {
+  int parent_to_child_fds[2];
+  int ret = pipe(parent_to_child_fds);
+  if (ret < 0) {
+    FATAL() << "Can't pipe";
   }
+  ScopedFd parent_to_child_read(parent_to_child_fds[0]);
+  ScopedFd parent_to_child_write(parent_to_child_fds[1]);
 
-  CommandForCheckpoint command_for_checkpoint;
+  checkpoint.prepare_to_detach_tasks();
 
-  vector<pid_t> children;
-  for (int i = 0; i < count; ++i) {
-    ScopedFd client = ScopedFd(accept4(sock, nullptr, nullptr, SOCK_CLOEXEC));
-    if (!client.is_open()) {
-      FATAL() << "Failed to accept client connection";
-    }
+  // We need to create a new control socket for the child, we can't use the shared control socket
+  // safely in multiple processes.
+  int sockets[2];
+  ret = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets);
+  if (ret < 0) {
+    FATAL() << "socketpair failed";
+  }
+  ScopedFd new_tracee_socket(sockets[0]);
+  ScopedFd new_tracee_socket_receiver(sockets[1]);
 
-    ssize_t priority;
-    recv_all(client, &priority, sizeof(priority));
-    ssize_t ret = setpriority(PRIO_PROCESS, 0, priority);
-    if (ret < 0) {
-      if (errno == EACCES) {
-        LOG(warn) << "Failed to increase priority";
-      } else {
-        FATAL() << "Failed setpriority";
-      }
+  pid_t child = fork();
+  if (!child) {
+    for (auto session : owned_sessions) {
+      session->forget_tasks();
     }
-
-    size_t fds_size;
-    recv_all(client, &fds_size, sizeof(fds_size));
-
-    // Do the SCM_RIGHTS dance to receive file descriptors
-    msghdr msg;
-    memset(&msg, 0, sizeof(msg));
-    char dummy_buf;
-    iovec iov = { &dummy_buf, 1 };
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    vector<uint8_t> cbuf;
-    size_t data_len = sizeof(int)*fds_size;
-    cbuf.resize(CMSG_SPACE(data_len));
-    msg.msg_control = cbuf.data();
-    msg.msg_controllen = cbuf.size();
-    ret = recvmsg(client, &msg, MSG_CMSG_CLOEXEC);
+    prepare_child();
+    char ch;
+    ret = read(parent_to_child_read, &ch, 1);
     if (ret != 1) {
-      FATAL() << "Failed to read fds";
-    }
-    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
-    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(data_len)) {
-      FATAL() << "Invalid cmsg metadata";
-    }
-    vector<int> fds_data;
-    fds_data.resize(fds_size);
-    memcpy(fds_data.data(), CMSG_DATA(cmsg), data_len);
-
-    size_t arg_count;
-    recv_all(client, &arg_count, sizeof(arg_count));
-    vector<string> args;
-    for (size_t i = 0; i < arg_count; ++i) {
-      size_t arg_size;
-      recv_all(client, &arg_size, sizeof(arg_size));
-      vector<char> arg;
-      arg.resize(arg_size);
-      recv_all(client, arg.data(), arg_size);
-      args.push_back(string(arg.data(), arg.size()));
+      FATAL() << "Failed to read parent notification";
     }
+    checkpoint.reattach_tasks(std::move(new_tracee_socket),
+      std::move(new_tracee_socket_receiver));
+    return 0;
+  }
 
-    ReplaySession::shr_ptr checkpoint = session->clone();
-    int parent_to_child_fds[2];
-    ret = pipe(parent_to_child_fds);
-    if (ret < 0) {
-      FATAL() << "Can't pipe";
-    }
-    ScopedFd parent_to_child_read(parent_to_child_fds[0]);
-    ScopedFd parent_to_child_write(parent_to_child_fds[1]);
+  checkpoint.detach_tasks(child, new_tracee_socket_receiver);
+  ret = write(parent_to_child_write, "x", 1);
+  if (ret != 1) {
+    FATAL() << "Failed to write parent notification";
+  }
+  return child;
+}
 
-    checkpoint->prepare_to_detach_tasks();
+/* Accept a client on `sock`, read its request and fork a child that takes over
+   the session `choose_checkpoint` returns for the client's args. `owned_sessions`
+   are the other sessions whose tasks belong to this process; the child forgets them.
+   Returns the child's pid in the parent. In the child, returns 0 with
+   `command_for_checkpoint` filled in.
+*/
+static pid_t export_checkpoint_to_client(ScopedFd& sock,
+    const vector<ReplaySession*>& owned_sessions,
+    const function<ReplaySession::shr_ptr(const vector<string>&)>& choose_checkpoint,
+    CommandForCheckpoint& command_for_checkpoint) {
+  ScopedFd client = ScopedFd(accept4(sock, nullptr, nullptr, SOCK_CLOEXEC));
+  if (!client.is_open()) {
+    FATAL() << "Failed to accept client connection";
+  }
 
-    // We need to create a new control socket for the child, we can't use the shared control socket
-    // safely in multiple processes.
-    int sockets[2];
-    ret = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets);
-    if (ret < 0) {
-      FATAL() << "socketpair failed";
+  ssize_t priority;
+  recv_all(client, &priority, sizeof(priority));
+  ssize_t ret = setpriority(PRIO_PROCESS, 0, priority);
+  if (ret < 0) {
+    if (errno == EACCES) {
+      LOG(warn) << "Failed to increase priority";
+    } else {
+      FATAL() << "Failed setpriority";
     }
-    ScopedFd new_tracee_socket(sockets[0]);
-    ScopedFd new_tracee_socket_receiver(sockets[1]);
+  }
+
+  size_t fds_size;
+  recv_all(client, &fds_size, sizeof(fds_size));
+
+  // Do the SCM_RIGHTS dance to receive file descriptors
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  char dummy_buf;
+  iovec iov = { &dummy_buf, 1 };
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  vector<uint8_t> cbuf;
+  size_t data_len = sizeof(int)*fds_size;
+  cbuf.resize(CMSG_SPACE(data_len));
+  msg.msg_control = cbuf.data();
+  msg.msg_controllen = cbuf.size();
+  ret = recvmsg(client, &msg, MSG_CMSG_CLOEXEC);
+  if (ret != 1) {
+    FATAL() << "Failed to read fds";
+  }
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(data_len)) {
+    FATAL() << "Invalid cmsg metadata";
+  }
+  vector<int> fds_data;
+  fds_data.resize(fds_size);
+  memcpy(fds_data.data(), CMSG_DATA(cmsg), data_len);
+
+  size_t arg_count;
+  recv_all(client, &arg_count, sizeof(arg_count));
+  vector<string> args;
+  for (size_t i = 0; i < arg_count; ++i) {
+    size_t arg_size;
+    recv_all(client, &arg_size, sizeof(arg_size));
+    vector<char> arg;
+    arg.resize(arg_size);
+    recv_all(client, arg.data(), arg_size);
+    args.push_back(string(arg.data(), arg.size()));
+  }
+
+  ReplaySession::shr_ptr checkpoint = choose_checkpoint(args);
+  pid_t child = fork_checkpoint(*checkpoint, owned_sessions, [&]() {
+    set_title(args);
+    command_for_checkpoint.args = std::move(args);
+    setup_child_fds(fds_data, command_for_checkpoint);
+  });
+  if (!child) {
+    command_for_checkpoint.session = std::move(checkpoint);
+    return 0;
+  }
 
-    pid_t child = fork();
+  for (auto d : fds_data) {
+    close(d);
+  }
+  return child;
+}
+
+CommandForCheckpoint export_checkpoints(ReplaySession::shr_ptr session, int count, ScopedFd& sock,
+    const std::string&) {
+  if (!session->can_clone()) {
+    FATAL() << "Can't create checkpoints at this time, aborting: " << session->current_frame_time();
+  }
+
+  CommandForCheckpoint command_for_checkpoint;
+
+  vector<pid_t> children;
+  vector<ReplaySession*> owned_sessions = { session.get() };
+  auto clone_session = [&session](const vector<string>&) {
+    return session->clone();
+  };
+  for (int i = 0; i < count; ++i) {
+    pid_t child = export_checkpoint_to_client(sock, owned_sessions, clone_session,
+                                              command_for_checkpoint);
     if (!child) {
-      set_title(args);
-      session->forget_tasks();
-      command_for_checkpoint.args = std::move(args);
-      command_for_checkpoint.session = std::move(checkpoint);
-      setup_child_fds(fds_data, command_for_checkpoint);
-      char ch;
-      ret = read(parent_to_child_read, &ch, 1);
-      if (ret != 1) {
-        FATAL() << "Failed to read parent notification";
-      }
-      command_for_checkpoint.session->reattach_tasks(std::move(new_tracee_socket),
-        std::move(new_tracee_socket_receiver));
       return command_for_checkpoint;
     }
     children.push_back(child);
-
-    checkpoint->detach_tasks(child, new_tracee_socket_receiver);
-    ret = write(parent_to_child_write, "x", 1);
-    if (ret != 1) {
-      FATAL() << "Failed to write parent notification";
-    }
-    for (auto d : fds_data) {
-      close(d);
-    }
   }
 
   // Wait for and reap all children
@@ -269,6 +306,33 @@ CommandForCheckpoint export_checkpoints(ReplaySession::shr_ptr session, int coun
   return command_for_checkpoint;
 }
 
+CommandForCheckpoint serve_checkpoints(ScopedFd& sock,
+    const vector<ReplaySession*>& owned_sessions,
+    const function<ReplaySession::shr_ptr(const vector<string>&)>& choose_checkpoint) {
+  CommandForCheckpoint command_for_checkpoint;
+  vector<pid_t> children;
+  while (true) {
+    pid_t child = export_checkpoint_to_client(sock, owned_sessions, choose_checkpoint,
+                                              command_for_checkpoint);
+    if (!child) {
+      return command_for_checkpoint;
+    }
+    children.push_back(child);
+
+    // Reap children that have finished, without blocking.
+    for (auto it = children.begin(); it != children.end();) {
+      WaitOptions options(*it);
+      options.block_seconds = 0;
+      WaitResult result = WaitManager::wait_exit(options);
+      if (result.code == WAIT_NO_STATUS) {
+        ++it;
+      } else {
+        it = children.erase(it);
+      }
+    }
+  }
+}
+
 void notify_normal_exit(ScopedFd& exit_notification_fd) {
   ssize_t ret = write(exit_notification_fd, "", 1);
   if (ret != 1) {
@@ -276,13 +340,16 @@ void notify_normal_exit(ScopedFd& exit_notification_fd) {
   }
 }
 
-int invoke_checkpoint_command(const string& socket_file_name,
-    vector<string> args, vector<ScopedFd> fds) {
+ScopedFd send_checkpoint_command(const string& socket_file_name,
+    vector<string> args, vector<ScopedFd> fds, bool wait_for_exporter) {
   ScopedFd sock = ScopedFd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
   if (!sock.is_open()) {
     FATAL() << "Can't create Unix socket " << socket_file_name;
   }
   if (socket_file_name.size() + 1 > sizeof(sockaddr_un::sun_path)) {
+    if (!wait_for_exporter) {
+      return ScopedFd();
+    }
     FATAL() << "Socket file name " << socket_file_name << " too long";
   }
   sockaddr_un addr;
@@ -293,6 +360,9 @@ int invoke_checkpoint_command(const string& socket_file_name,
     if (ret < 0) {
       // We might try to connect between the socket being bound and listen()ed on
       if (errno == ENOENT || errno == ECONNREFUSED) {
+        if (!wait_for_exporter) {
+          return ScopedFd();
+        }
         sleep(1);
         continue;
       }
@@ -311,10 +381,11 @@ int invoke_checkpoint_command(const string& socket_file_name,
   send_all(sock, &total_fds, sizeof(total_fds));
 
   int exit_notification_pipe_fds[2];
-  ret = pipe(exit_notification_pipe_fds);
+  ret = pipe2(exit_notification_pipe_fds, O_CLOEXEC);
   if (ret < 0) {
     FATAL() << "Failed pipe";
   }
+  ScopedFd exit_notification_read(exit_notification_pipe_fds[0]);
 
   // Do the SCM_RIGHTS dance to send file descriptors.
   msghdr msg;
@@ -347,8 +418,6 @@ int invoke_checkpoint_command(const string& socket_file_name,
     FATAL() << "Can't send file descriptors";
   }
   close(exit_notification_pipe_fds[1]);
-  // Close stdin but keep stdout/stderr open in case we need to print something ourselves.
-  close(0);
 
   size_t arg_count = args.size();
   send_all(sock, &arg_count, sizeof(arg_count));
@@ -357,8 +426,12 @@ int invoke_checkpoint_command(const string& socket_file_name,
     send_all(sock, &arg_size, sizeof(arg_size));
     send_all(sock, arg.data(), arg_size);
   }
+  return exit_notification_read;
+}
 
-  ret = read(exit_notification_pipe_fds[0], &ch, 1);
+int wait_for_checkpoint_command(ScopedFd& exit_notification_fd) {
+  char ch;
+  ssize_t ret = read(exit_notification_fd, &ch, 1);
   if (ret < 0) {
     FATAL() << "Can't read from notification pipe";
   }
@@ -369,4 +442,13 @@ int invoke_checkpoint_command(const string& socket_file_name,
   return 0;
 }
 
+int invoke_checkpoint_command(const string& socket_file_name,
+    vector<string> args, vector<ScopedFd> fds) {
+  ScopedFd exit_notification_fd =
+      send_checkpoint_command(socket_file_name, std::move(args), std::move(fds), true);
+  // Close stdin but keep stdout/stderr open in case we need to print something ourselves.
+  close(0);
+  return wait_for_checkpoint_command(exit_notification_fd);
+}
+
 } // namespace rr
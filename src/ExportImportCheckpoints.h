@@ -5,6 +5,7 @@
 
 #include "ReplaySession.h"
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -34,6 +35,25 @@ struct CommandForCheckpoint {
 CommandForCheckpoint export_checkpoints(ReplaySession::shr_ptr session, int count, ScopedFd& sock,
     const std::string& socket_file_name);
 
+/* Serve checkpoints to clients until we're killed. For each client, `choose_checkpoint`
+   is called with the client's args and returns the session to hand over (e.g. a clone
+   of a checkpoint). `owned_sessions` are all the sessions whose tasks this process
+   holds; children forget them. Only returns in forked children, as for
+   export_checkpoints.
+*/
+CommandForCheckpoint serve_checkpoints(ScopedFd& sock,
+    const std::vector<ReplaySession*>& owned_sessions,
+    const std::function<ReplaySession::shr_ptr(const std::vector<std::string>&)>& choose_checkpoint);
+
+/* Fork a child process that takes over the tasks of `checkpoint`. `owned_sessions`
+   are the other sessions whose tasks this process holds; the child forgets them.
+   `prepare_child` runs in the child before the tasks are handed over. Returns the
+   child's pid in the parent and 0 in the child, where `checkpoint` is usable.
+*/
+pid_t fork_checkpoint(ReplaySession& checkpoint,
+    const std::vector<ReplaySession*>& owned_sessions,
+    const std::function<void()>& prepare_child);
+
 /* After performing the CommandForCheckpoint, notify that we have exited normally. */
 void notify_normal_exit(ScopedFd& exit_notification_fd);
 
@@ -44,6 +64,18 @@ void notify_normal_exit(ScopedFd& exit_notification_fd);
 int invoke_checkpoint_command(const std::string& socket_file_name,
     std::vector<std::string> args, std::vector<ScopedFd> fds = std::vector<ScopedFd>());
 
+/* The first half of invoke_checkpoint_command: send the command and return the fd
+   to pass to wait_for_checkpoint_command. If `wait_for_exporter` is false and
+   nothing is listening on the socket, returns a closed fd instead of waiting for
+   an exporter to show up.
+*/
+ScopedFd send_checkpoint_command(const std::string& socket_file_name,
+    std::vector<std::string> args, std::vector<ScopedFd> fds, bool wait_for_exporter);
+
+/* Wait for a command sent by send_checkpoint_command to complete and return an
+   appropriate exit code. */
+int wait_for_checkpoint_command(ScopedFd& exit_notification_fd);
+
 } // namespace rr
 
 #endif /* RR_EXPORT_IMPORT_CHECKPOINTS_H_ */
@@ -73,6 +73,9 @@ struct Flags {
   // User override for the path to page files and other resources.
   std::string resource_path;
 
+  // Use io_uring for trace file I/O where the kernel supports it.
+  bool use_io_uring;
+
   Flags()
       : checksum(CHECKSUM_NONE),
         dump_on(DUMP_ON_NONE),
@@ -83,7 +86,8 @@ struct Flags {
         suppress_environment_warnings(false),
         fatal_errors_and_warnings(false),
         disable_cpuid_faulting(false),
-        disable_ptrace_exit_events(false) {}
+        disable_ptrace_exit_events(false),
+        use_io_uring(false) {}
 
   static const Flags& get() { return singleton; }
 
@@ -54,6 +54,60 @@ static SimpleGdbCommand when_tid(
       return string("Current tid: ") + to_string(t->tid);
     });
 
+static SimpleGdbCommand diversion_stats(
+    "diversion-stats",
+    "Print how many diversion sessions have been cloned, and how many clones"
+    " were avoided by reusing an earlier diversion.",
+    [](GdbServer& gdb_server, Task*, const vector<string>&) {
+      return string("Diversions cloned: ") +
+             to_string(gdb_server.diversions_created()) +
+             "\nClones avoided: " +
+             to_string(gdb_server.diversion_clones_avoided());
+    });
+
+static SimpleGdbCommand progress(
+    "progress",
+    "Report which event replay has reached, every second, during long\n"
+    "continues and reverse-continues. Usage: progress [on|off]",
+    [](GdbServer& gdb_server, Task*, const vector<string>& args) {
+      if (args.size() == 2 && (args[1] == "on" || args[1] == "off")) {
+        gdb_server.set_report_progress(args[1] == "on");
+      } else if (args.size() != 1) {
+        return string("Usage: progress [on|off]");
+      }
+      return string("Progress reports are ") +
+             (gdb_server.reports_progress() ? "on." : "off.");
+    });
+
+static SimpleGdbCommand tracepoint(
+    "tracepoint",
+    "Log values every time replay reaches a location, without stopping.\n"
+    "Usage: tracepoint <location>:<format>, e.g.\n"
+    "  tracepoint main+4:argc={rdi} argv[0]={rsi:8}",
+    [](GdbServer& gdb_server, Task* t, const vector<string>& args) {
+      if (!t->session().is_replaying()) {
+        return GdbCommandHandler::cmd_end_diversion();
+      }
+      if (args.size() < 2) {
+        return string("Usage: tracepoint <location>:<format>");
+      }
+      string spec = args[1];
+      for (size_t i = 2; i < args.size(); ++i) {
+        spec += " " + args[i];
+      }
+      return gdb_server.add_tracepoint(spec);
+    });
+
+static SimpleGdbCommand delete_tracepoints(
+    "delete-tracepoints", "Remove all rr tracepoints.",
+    [](GdbServer& gdb_server, Task* t, const vector<string>&) {
+      if (!t->session().is_replaying()) {
+        return GdbCommandHandler::cmd_end_diversion();
+      }
+      gdb_server.clear_tracepoints();
+      return string("Tracepoints deleted.");
+    });
+
 static std::vector<ReplayTimeline::Mark> back_stack;
 static ReplayTimeline::Mark current_history_cp;
 static std::vector<ReplayTimeline::Mark> forward_stack;
@@ -102,6 +156,47 @@ static SimpleGdbCommand forward(
       return string();
     });
 
+static SimpleGdbCommand rr_reverse_finish(
+    "rr-reverse-finish",
+    "Run backward to the call that entered the current frame, like\n"
+    "reverse-finish, but with a single forward replay. Breakpoints and\n"
+    "watchpoints are ignored.",
+    [](GdbServer& gdb_server, Task* t, const vector<string>&) {
+      if (!t->session().is_replaying()) {
+        return GdbCommandHandler::cmd_end_diversion();
+      }
+      ReplayTimeline::FrameStep step;
+      if (!gdb_server.get_timeline().reverse_frame_step(t->tuid(), step)) {
+        return string("Can't find the call that entered this frame.");
+      }
+      return string();
+    });
+
+static SimpleGdbCommand rr_reverse_next(
+    "rr-reverse-next",
+    "Run backward to the start of the previous line in the current frame,\n"
+    "like reverse-next, but with a single forward replay. Breakpoints and\n"
+    "watchpoints are ignored.",
+    [](GdbServer& gdb_server, Task* t, const vector<string>& args) {
+      if (!t->session().is_replaying()) {
+        return GdbCommandHandler::cmd_end_diversion();
+      }
+      ReplayTimeline::FrameStep step;
+      step.finish = false;
+      stringstream line_starts(args.size() > 1 ? args[1] : string());
+      string addr;
+      while (line_starts >> addr) {
+        step.line_starts.push_back(remote_code_ptr(stoull(addr, nullptr, 16)));
+      }
+      if (step.line_starts.size() < 2) {
+        return string("No line information for the current function.");
+      }
+      if (!gdb_server.get_timeline().reverse_frame_step(t->tuid(), step)) {
+        return string("Can't find the previous line.");
+      }
+      return string();
+    });
+
 static int gNextCheckpointId = 0;
 
 string invoke_checkpoint(GdbServer& gdb_server, Task*,
@@ -162,6 +257,7 @@ static SimpleGdbCommand info_checkpoints(
 
 /*static*/ void GdbCommand::init_auto_args() {
   checkpoint.add_auto_arg("rr-where");
+  rr_reverse_next.add_auto_arg("rr-line-starts");
 }
 
 } // namespace rr
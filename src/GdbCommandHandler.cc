@@ -85,6 +85,37 @@ class RRWhere(gdb.Command):
 
 RRWhere()
 
+class RRLineStarts(gdb.Command):
+    """Helper to get the line table of the current function. Used by auto-args"""
+    def __init__(self):
+        gdb.Command.__init__(self, 'rr-line-starts',
+                             gdb.COMMAND_USER, gdb.COMPLETE_NONE, False)
+
+    def invoke(self, arg, from_tty):
+# Print the addresses where the source line changes within the current
+# function, followed by the function's end, in hex.
+        try:
+            frame = gdb.selected_frame()
+            block = frame.block()
+            while block.function is None and block.superblock is not None:
+                block = block.superblock
+            entries = sorted((e.pc, e.line) for e in
+                             frame.find_sal().symtab.linetable()
+                             if block.start <= e.pc < block.end)
+        except:
+            entries = [] # No debug info
+        starts = []
+        last_line = None
+        for pc, line in entries:
+            if line != last_line and (not starts or starts[-1] != pc):
+                starts.append(pc)
+            last_line = line
+        if starts:
+            starts.append(block.end)
+        gdb.write(" ".join(format(pc, 'x') for pc in starts))
+
+RRLineStarts()
+
 class RRDenied(gdb.Command):
     """Helper to prevent use of breaking commands. Used by auto-args"""
     def __init__(self):
@@ -176,6 +207,16 @@ define hookpost-forward
 maintenance flush register-cache
 frame
 end
+
+define hookpost-rr-reverse-finish
+maintenance flush register-cache
+frame
+end
+
+define hookpost-rr-reverse-next
+maintenance flush register-cache
+frame
+end
 )Delimiter");
 
   return ss.str();
@@ -60,8 +60,10 @@ GdbConnection::GdbConnection(pid_t tgid, const Features& features)
     : tgid(tgid),
       cpu_features_(0),
       no_ack(false),
+      libraries_svr4_len(0),
       features_(features),
-      connection_alive_(true) {
+      connection_alive_(true),
+      binary_mem_reply(false) {
 #ifndef REVERSE_EXECUTION
   features_.reverse_execution = false;
 #endif
@@ -174,38 +176,41 @@ void GdbConnection::write_packet(const char* data) {
 
 void GdbConnection::write_binary_packet(const char* pfx, const uint8_t* data,
                                         ssize_t num_bytes) {
-  ssize_t pfx_num_chars = strlen(pfx);
-  vector<uint8_t> buf;
-  buf.resize(2 * num_bytes + pfx_num_chars);
-  ssize_t buf_num_bytes = 0;
-  int i;
-
-  memcpy((char*)buf.data(), pfx, pfx_num_chars);
-  buf_num_bytes += pfx_num_chars;
-
-  for (i = 0; i < num_bytes; ++i) {
+  // Escape straight into |outbuf|, checksumming as we go. Replies to
+  // vFile:pread and 'x' can be a megabyte, so avoid staging them in a
+  // temporary buffer first.
+  size_t pfx_num_chars = strlen(pfx);
+  uint8_t checksum = 0;
+  outbuf.reserve(outbuf.size() + pfx_num_chars + num_bytes + num_bytes / 32 +
+                 4);
+
+  outbuf.push_back('$');
+  for (size_t i = 0; i < pfx_num_chars; ++i) {
+    checksum += pfx[i];
+    outbuf.push_back(pfx[i]);
+  }
+  for (ssize_t i = 0; i < num_bytes; ++i) {
     uint8_t b = data[i];
-
-    if (buf_num_bytes + 2 > ssize_t(buf.size())) {
-      break;
-    }
     switch (b) {
       case '#':
       case '$':
       case '}':
       case '*':
-        buf.data()[buf_num_bytes++] = '}';
-        buf.data()[buf_num_bytes++] = b ^ 0x20;
+        checksum += '}';
+        outbuf.push_back('}');
+        b ^= 0x20;
         break;
       default:
-        buf.data()[buf_num_bytes++] = b;
         break;
     }
+    checksum += b;
+    outbuf.push_back(b);
   }
+  outbuf.push_back('#');
+  write_hex(checksum);
 
   LOG(debug) << " ***** NOTE: writing binary data, upcoming debug output may "
                 "be truncated";
-  return write_packet_bytes(buf.data(), buf_num_bytes);
 }
 
 void GdbConnection::write_hex_bytes_packet(const char* prefix,
@@ -512,6 +517,25 @@ bool GdbConnection::xfer(const char* name, char* args) {
     return true;
   }
 
+  if (!strcmp(name, "libraries-svr4")) {
+    if (strcmp(mode, "read")) {
+      write_packet("");
+      return false;
+    }
+    // gdb may pass start/prev hints in the annex to ask for only part of
+    // the list. Replying with the whole list is always allowed.
+    if (offset > 0) {
+      write_xfer_response(libraries_svr4.c_str(), libraries_svr4.size(),
+                          offset, len);
+      return false;
+    }
+
+    req = GdbRequest(DREQ_GET_LIBRARIES_SVR4);
+    req.target = query_thread;
+    libraries_svr4_len = len;
+    return true;
+  }
+
   if (!strcmp(name, "siginfo")) {
     if (strcmp(annex, "")) {
       write_packet("E00");
@@ -677,6 +701,8 @@ bool GdbConnection::query(char* payload) {
                  ";qXfer:features:read+"
                  ";qXfer:auxv:read+"
                  ";qXfer:exec-file:read+"
+                 ";qXfer:libraries-svr4:read+"
+                 ";binary-upload+"
                  ";qXfer:siginfo:read+"
                  ";qXfer:siginfo:write+"
                  ";multiprocess+"
@@ -1168,14 +1194,18 @@ bool GdbConnection::process_packet() {
       write_packet("OK");
       exit(0);
     case 'm':
+    case 'x':
       req = GdbRequest(DREQ_GET_MEM);
       req.target = query_thread;
       req.mem().addr = strtoul(payload, &payload, 16);
       parser_assert(',' == *payload++);
       req.mem().len = strtoul(payload, &payload, 16);
       parser_assert('\0' == *payload);
+      // 'x' is 'm' with the reply in binary, which halves its size.
+      binary_mem_reply = request == 'x';
 
-      LOG(debug) << "gdb requests memory (addr=" << HEX(req.mem().addr)
+      LOG(debug) << "gdb requests " << (binary_mem_reply ? "binary " : "")
+                 << "memory (addr=" << HEX(req.mem().addr)
                  << ", len=" << req.mem().len << ")";
 
       ret = true;
@@ -1499,25 +1529,36 @@ static int to_gdb_signum(int sig) {
   }
 }
 
-void GdbConnection::send_stop_reply_packet(GdbThreadId thread, int sig,
-                                           const char *reason) {
+void GdbConnection::send_stop_reply_packet(
+    GdbThreadId thread, int sig, const char *reason,
+    const vector<GdbRegisterValue>& expedited_regs) {
   if (sig < 0) {
     write_packet("E01");
     return;
   }
+  // Registers are sent as "nn:value;" pairs ahead of the thread id.
+  string regs;
+  for (const auto& reg : expedited_regs) {
+    char buf[1 + 2 * GdbRegisterValue::MAX_SIZE + 16];
+    int n = snprintf(buf, sizeof(buf), "%02x:", reg.name);
+    n += print_reg_value(reg, buf + n);
+    regs.append(buf, n);
+    regs.push_back(';');
+  }
   char buf[PATH_MAX];
   if (multiprocess_supported_) {
-    snprintf(buf, sizeof(buf) - 1, "T%02xthread:p%02x.%02x;%s",
-           to_gdb_signum(sig), thread.pid, thread.tid, reason);
+    snprintf(buf, sizeof(buf) - 1, "T%02x%sthread:p%02x.%02x;%s",
+           to_gdb_signum(sig), regs.c_str(), thread.pid, thread.tid, reason);
   } else {
-    snprintf(buf, sizeof(buf) - 1, "T%02xthread:%02x;%s",
-           to_gdb_signum(sig), thread.tid, reason);
+    snprintf(buf, sizeof(buf) - 1, "T%02x%sthread:%02x;%s",
+           to_gdb_signum(sig), regs.c_str(), thread.tid, reason);
   }
   write_packet(buf);
 }
 
 void GdbConnection::notify_stop(GdbThreadId thread, int sig,
-                                const char *reason) {
+                                const char *reason,
+                                const vector<GdbRegisterValue>& expedited_regs) {
   DEBUG_ASSERT(req.is_resume_request() || req.type == DREQ_INTERRUPT);
 
   // don't pass this signal to gdb if it is specified not to
@@ -1539,7 +1580,7 @@ void GdbConnection::notify_stop(GdbThreadId thread, int sig,
   if (!reason) {
     reason = "";
   }
-  send_stop_reply_packet(thread, sig, reason);
+  send_stop_reply_packet(thread, sig, reason, expedited_regs);
 
   // This isn't documented in the gdb remote protocol, but if we
   // don't do this, gdb will sometimes continue to send requests
@@ -1569,6 +1610,11 @@ void GdbConnection::notify_restart_failed() {
   consume_request();
 }
 
+void GdbConnection::notify_console_output(const std::string& text) {
+  write_hex_bytes_packet("O", (const uint8_t*)text.data(), text.size());
+  write_flush();
+}
+
 void GdbConnection::reply_get_current_thread(GdbThreadId thread) {
   DEBUG_ASSERT(DREQ_GET_CURRENT_THREAD == req.type);
 
@@ -1609,6 +1655,20 @@ void GdbConnection::reply_get_exec_file(const string& exec_file) {
   consume_request();
 }
 
+void GdbConnection::reply_get_libraries_svr4(const string& library_list) {
+  DEBUG_ASSERT(DREQ_GET_LIBRARIES_SVR4 == req.type);
+
+  libraries_svr4 = library_list;
+  if (!libraries_svr4.empty()) {
+    write_xfer_response(libraries_svr4.c_str(), libraries_svr4.size(), 0,
+                        libraries_svr4_len);
+  } else {
+    write_packet("E01");
+  }
+
+  consume_request();
+}
+
 void GdbConnection::reply_get_is_thread_alive(bool alive) {
   DEBUG_ASSERT(DREQ_GET_IS_THREAD_ALIVE == req.type);
 
@@ -1646,6 +1706,8 @@ void GdbConnection::reply_get_mem(const vector<uint8_t>& mem) {
 
   if (req.mem().len > 0 && mem.size() == 0) {
     write_packet("E01");
+  } else if (binary_mem_reply) {
+    write_binary_packet("b", mem.data(), mem.size());
   } else {
     write_hex_bytes_packet(mem.data(), mem.size());
   }
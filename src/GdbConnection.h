@@ -76,6 +76,9 @@ enum GdbRequestType {
   /* These use params.target. */
   DREQ_GET_AUXV,
   DREQ_GET_EXEC_FILE,
+  // qXfer:libraries-svr4 read starting at offset 0. Continuation reads
+  // are served from the reply to this request.
+  DREQ_GET_LIBRARIES_SVR4,
   DREQ_GET_IS_THREAD_ALIVE,
   DREQ_GET_THREAD_EXTRA_INFO,
   DREQ_SET_CONTINUE_THREAD,
@@ -398,12 +401,22 @@ public:
    * Notify the host that a resume request has "finished", i.e., the
    * target has stopped executing for some reason.  |sig| is the signal
    * that stopped execution, or 0 if execution stopped otherwise.
+   * |expedited_regs| are sent along with the stop so gdb doesn't have to
+   * ask for them.
    */
-  void notify_stop(GdbThreadId which, int sig, const char *reason=nullptr);
+  void notify_stop(GdbThreadId which, int sig, const char *reason=nullptr,
+                   const std::vector<GdbRegisterValue>& expedited_regs =
+                       std::vector<GdbRegisterValue>());
 
   /** Notify the debugger that a restart request failed. */
   void notify_restart_failed();
 
+  /**
+   * Print |text| on the debugger's console. Only valid while a resume
+   * request or an rr command is being processed.
+   */
+  void notify_console_output(const std::string& text);
+
   /**
    * Tell the host that |thread| is the current thread.
    */
@@ -420,6 +433,14 @@ public:
    */
   void reply_get_exec_file(const std::string& exec_file);
 
+  /**
+   * Reply with the target's shared library list, as a
+   * <library-list-svr4> document. |library_list.empty()| if the list
+   * couldn't be determined, in which case gdb walks the link_map chain
+   * itself.
+   */
+  void reply_get_libraries_svr4(const std::string& library_list);
+
   /**
    * |alive| is true if the requested thread is alive, false if dead.
    */
@@ -674,7 +695,10 @@ private:
   bool process_packet();
   void consume_request();
   void send_stop_reply_packet(GdbThreadId thread, int sig,
-                              const char *reason);
+                              const char *reason,
+                              const std::vector<GdbRegisterValue>&
+                                  expedited_regs =
+                                      std::vector<GdbRegisterValue>());
   void send_file_error_reply(int system_errno);
 
   // Current request to be processed.
@@ -695,6 +719,11 @@ private:
   // debuggee without gdb being informed, speeding up
   // reverse execution
   std::unordered_set<int> pass_signals;
+  // The last library list sent for qXfer:libraries-svr4, kept so that gdb
+  // can read it in pieces, and the length gdb asked for in the pending
+  // request.
+  std::string libraries_svr4;
+  uint64_t libraries_svr4_len;
   ScopedFd sock_fd;
   std::vector<uint8_t> inbuf;  /* buffered input from gdb */
   size_t packetend;            /* index of '#' character */
@@ -704,6 +733,9 @@ private:
   bool multiprocess_supported_; // client supports multiprocess extension
   bool hwbreak_supported_; // client supports hwbreak extension
   bool swbreak_supported_; // client supports swbreak extension
+  // The pending DREQ_GET_MEM came from an 'x' packet and wants a binary
+  // reply.
+  bool binary_mem_reply;
 };
 
 } // namespace rr
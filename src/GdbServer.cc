@@ -6,6 +6,8 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -47,7 +49,12 @@ GdbServer::GdbServer(std::unique_ptr<GdbConnection>& dbg, Task* t)
       interrupt_pending(false),
       exit_sigkill_pending(false),
       emergency_debug_session(&t->session()),
-      file_scope_pid(0) {
+      file_scope_pid(0),
+      diversions_created_(0),
+      diversion_clones_avoided_(0),
+      report_progress(false),
+      last_progress_report(0),
+      last_trace_event(0) {
   memset(&stop_siginfo, 0, sizeof(stop_siginfo));
 }
 
@@ -298,13 +305,10 @@ void GdbServer::dispatch_regs_request(const Registers& regs,
 
 class GdbBreakpointCondition : public BreakpointCondition {
 public:
-  GdbBreakpointCondition(const vector<vector<uint8_t>>& bytecodes) {
-    for (auto& b : bytecodes) {
-      expressions.push_back(GdbExpression(b.data(), b.size()));
-    }
-  }
+  GdbBreakpointCondition(shared_ptr<const vector<GdbExpression>> expressions)
+      : expressions(std::move(expressions)) {}
   virtual bool evaluate(Task* t) const override {
-    for (auto& e : expressions) {
+    for (auto& e : *expressions) {
       GdbExpression::Value v;
       // Break if evaluation fails or the result is nonzero
       if (!e.evaluate(t, &v) || v.i != 0) {
@@ -315,16 +319,34 @@ public:
   }
 
 private:
-  vector<GdbExpression> expressions;
+  shared_ptr<const vector<GdbExpression>> expressions;
 };
 
+// gdb reinserts its breakpoints, conditions included, every time it resumes.
+// Keep the decoded expressions so that doesn't redo the variant expansion in
+// GdbExpression's constructor each time.
+static const size_t MAX_CACHED_CONDITIONS = 256;
+
 static unique_ptr<BreakpointCondition> breakpoint_condition(
     const GdbRequest& request) {
-  if (request.watch().conditions.empty()) {
+  const vector<vector<uint8_t>>& bytecodes = request.watch().conditions;
+  if (bytecodes.empty()) {
     return nullptr;
   }
-  return unique_ptr<BreakpointCondition>(
-      new GdbBreakpointCondition(request.watch().conditions));
+  static map<vector<vector<uint8_t>>, shared_ptr<const vector<GdbExpression>>>
+      decoded;
+  auto it = decoded.find(bytecodes);
+  if (it == decoded.end()) {
+    if (decoded.size() >= MAX_CACHED_CONDITIONS) {
+      decoded.clear();
+    }
+    auto expressions = make_shared<vector<GdbExpression>>();
+    for (auto& b : bytecodes) {
+      expressions->push_back(GdbExpression(b.data(), b.size()));
+    }
+    it = decoded.insert(make_pair(bytecodes, std::move(expressions))).first;
+  }
+  return unique_ptr<BreakpointCondition>(new GdbBreakpointCondition(it->second));
 }
 
 static bool search_memory(Task* t, const MemoryRange& where,
@@ -384,6 +406,243 @@ void GdbServer::maybe_intercept_mem_request(Task* target, const GdbRequest& req,
   }
 }
 
+// Reads larger than this bypass the memory cache; they're bulk dumps rather
+// than the small reads the cache is for.
+static const size_t MAX_CACHED_READ_PAGES = 16;
+// How far past a stack page we read ahead. Unwinding walks toward higher
+// addresses, one frame at a time.
+static const size_t STACK_READ_AHEAD_PAGES = 16;
+
+size_t GdbServer::read_memory_cached(Task* t, remote_ptr<void> addr,
+                                     size_t len, uint8_t* buf) {
+  size_t page = page_size();
+  if (len > MAX_CACHED_READ_PAGES * page) {
+    return max<ssize_t>(0, t->read_bytes_fallible(addr, len, buf));
+  }
+  if (memory_cache.session != &t->session() ||
+      memory_cache.vm_uid != t->vm()->uid()) {
+    memory_cache.pages.clear();
+    memory_cache.session = &t->session();
+    memory_cache.vm_uid = t->vm()->uid();
+  }
+
+  size_t done = 0;
+  while (done < len) {
+    remote_ptr<void> a = addr + done;
+    remote_ptr<void> start = floor_page_size(a);
+    auto it = memory_cache.pages.find(start);
+    if (it == memory_cache.pages.end()) {
+      // Fill the cache from |start|, reading ahead through stack pages in
+      // a single read.
+      remote_ptr<void> end = start + page;
+      if (t->vm()->has_mapping(start)) {
+        const KernelMapping& m = t->vm()->mapping_of(start).map;
+        if (m.is_stack() || m.contains(t->regs().sp())) {
+          end = min(m.end(), start + STACK_READ_AHEAD_PAGES * page);
+          auto next = memory_cache.pages.lower_bound(start);
+          if (next != memory_cache.pages.end() && next->first < end) {
+            end = next->first;
+          }
+        }
+      }
+      vector<uint8_t> data(end - start);
+      ssize_t nread = t->read_bytes_fallible(start, data.size(), data.data());
+      size_t valid = max<ssize_t>(0, nread);
+      for (remote_ptr<void> p = start; p < end; p += page) {
+        size_t offset = p - start;
+        if (p > start && offset >= valid) {
+          break;
+        }
+        size_t n = offset < valid ? min(page, valid - offset) : 0;
+        memory_cache.pages[p].assign(data.begin() + offset,
+                                     data.begin() + offset + n);
+      }
+      it = memory_cache.pages.find(start);
+    }
+
+    const vector<uint8_t>& data = it->second;
+    size_t offset = a - start;
+    if (offset >= data.size()) {
+      break;
+    }
+    size_t n = min(len - done, data.size() - offset);
+    memcpy(buf + done, data.data() + offset, n);
+    done += n;
+  }
+  return done;
+}
+
+#ifdef PROC_SERVICE_H
+void GdbServer::ensure_thread_db() {
+  if (thread_db) {
+    return;
+  }
+  thread_db = std::unique_ptr<ThreadDb>(new ThreadDb(debuggee_tguid.tid()));
+  // libthread_db's small reads all happen while we're stopped, so the
+  // memory cache serves them.
+  thread_db->set_memory_reader(
+      [this](Task* t, remote_ptr<void> addr, size_t len, uint8_t* buf) {
+        return read_memory_cached(t, addr, len, buf);
+      });
+}
+#endif
+
+/**
+ * Returns true if |req| can't change tracee memory, so the memory cache
+ * stays valid across it.
+ */
+static bool keeps_memory_cache(const GdbRequest& req) {
+  switch (req.type) {
+    case DREQ_GET_CURRENT_THREAD:
+    case DREQ_GET_OFFSETS:
+    case DREQ_GET_REGS:
+    case DREQ_GET_STOP_REASON:
+    case DREQ_GET_THREAD_LIST:
+    case DREQ_GET_AUXV:
+    case DREQ_GET_EXEC_FILE:
+    case DREQ_GET_LIBRARIES_SVR4:
+    case DREQ_GET_IS_THREAD_ALIVE:
+    case DREQ_GET_THREAD_EXTRA_INFO:
+    case DREQ_SET_CONTINUE_THREAD:
+    case DREQ_SET_QUERY_THREAD:
+    case DREQ_TLS:
+    case DREQ_GET_MEM:
+    case DREQ_SEARCH_MEM:
+    case DREQ_GET_REG:
+    case DREQ_QSYMBOL:
+    case DREQ_FILE_SETFS:
+    case DREQ_FILE_OPEN:
+    case DREQ_FILE_PREAD:
+    case DREQ_FILE_CLOSE:
+      return true;
+    default:
+      // Breakpoint changes would be fine, since reads see the original
+      // bytes either way, but they're rare enough not to matter.
+      return false;
+  }
+}
+
+/**
+ * Locate ld.so's _r_debug in |t|'s address space, or return null if the
+ * interpreter isn't mapped (yet). The symbol's offset in each interpreter
+ * is only looked up once.
+ */
+static remote_ptr<void> find_r_debug(Task* t) {
+  static map<string, uintptr_t> r_debug_offsets;
+
+  remote_ptr<void> interpreter_base = t->vm()->saved_interpreter_base();
+  if (!interpreter_base || !t->vm()->has_mapping(interpreter_base)) {
+    return nullptr;
+  }
+  string ld_path = t->vm()->saved_ld_path();
+  if (ld_path.length() == 0) {
+    FATAL() << "Failed to retrieve interpreter name with interpreter_base=" << interpreter_base;
+  }
+  auto it = r_debug_offsets.find(ld_path);
+  if (it == r_debug_offsets.end()) {
+    ScopedFd ld(ld_path.c_str(), O_RDONLY);
+    if (ld < 0) {
+      FATAL() << "Open failed: " << ld_path;
+    }
+    ElfFileReader reader(ld);
+    auto syms = reader.read_symbols(".dynsym", ".dynstr");
+    static const char r_debug[] = "_r_debug";
+    uintptr_t r_debug_offset = 0;
+    for (size_t i = 0; i < syms.size(); ++i) {
+      if (syms.is_name(i, r_debug)) {
+        r_debug_offset = syms.addr(i);
+      }
+    }
+    it = r_debug_offsets.insert(make_pair(ld_path, r_debug_offset)).first;
+  }
+  if (!it->second) {
+    return nullptr;
+  }
+  return interpreter_base.as_int() + it->second;
+}
+
+static string xml_escape(const string& str) {
+  string result;
+  for (char c : str) {
+    switch (c) {
+      case '&':
+        result += "&amp;";
+        break;
+      case '<':
+        result += "&lt;";
+        break;
+      case '>':
+        result += "&gt;";
+        break;
+      case '"':
+        result += "&quot;";
+        break;
+      case '\'':
+        result += "&apos;";
+        break;
+      default:
+        result.push_back(c);
+        break;
+    }
+  }
+  return result;
+}
+
+template <typename Arch> static string libraries_svr4_arch(Task* t) {
+  auto r_debug_remote = find_r_debug(t).cast<typename Arch::r_debug>();
+  if (!r_debug_remote) {
+    return string();
+  }
+  bool ok = true;
+  remote_ptr<typename Arch::link_map> lm =
+      t->read_mem(REMOTE_PTR_FIELD(r_debug_remote, r_map), &ok);
+  if (!ok) {
+    return string();
+  }
+
+  stringstream doc;
+  doc << hex << "<library-list-svr4 version=\"1.0\"";
+  if (lm) {
+    doc << " main-lm=\"0x" << lm.as_int() << "\"";
+  }
+  doc << ">";
+  // Bound the walk in case the list is corrupt or circular.
+  for (size_t count = 0; lm && count < 100000; ++count) {
+    if (!t->vm()->has_mapping(lm)) {
+      LOG(warn) << "link_map entry " << lm << " is not mapped";
+      return string();
+    }
+    auto entry = t->read_mem(lm, &ok);
+    if (!ok) {
+      return string();
+    }
+    // As in gdbserver, the first entry is the main program, which gdb
+    // already knows about; it's only reported as main-lm.
+    if (count > 0) {
+      string name = t->read_c_str(entry.l_name.rptr(), &ok);
+      if (ok && !name.empty()) {
+        doc << "<library name=\"" << xml_escape(name) << "\" lm=\"0x"
+            << lm.as_int() << "\" l_addr=\"0x"
+            << entry.l_addr.rptr().as_int() << "\" l_ld=\"0x"
+            << entry.l_ld.rptr().as_int() << "\"/>";
+      }
+      ok = true;
+    }
+    lm = entry.l_next.rptr();
+  }
+  doc << "</library-list-svr4>";
+  return doc.str();
+}
+
+/**
+ * Build the qXfer:libraries-svr4 document for |t| from ld.so's link_map
+ * chain. That saves gdb from walking the chain itself with one memory
+ * read per field on every shared library event.
+ */
+static string libraries_svr4(Task* t) {
+  RR_ARCH_FUNCTION(libraries_svr4_arch, t->arch(), t);
+}
+
 void GdbServer::dispatch_debugger_request(Session& session,
                                           const GdbRequest& req,
                                           ReportState state) {
@@ -475,37 +734,12 @@ void GdbServer::dispatch_debugger_request(Session& session,
       }
       {
         auto it = memory_files.find(read_req.fd);
-        if (it != memory_files.end() && timeline.is_running()) {
-          // Search our mmap stream for a record that can satisfy this request
-          TraceReader tmp_reader(timeline.current_session().trace_reader());
-          tmp_reader.rewind();
-          while (true) {
-            TraceReader::MappedData data;
-            bool found;
-            KernelMapping km = tmp_reader.read_mapped_region(
-                &data, &found, TraceReader::DONT_VALIDATE, TraceReader::ANY_TIME);
-            if (!found)
-              break;
-            if (it->second == FileId(km)) {
-              if (data.source != TraceReader::SOURCE_FILE) {
-                LOG(warn) << "Not serving file because it is not a file source";
-                break;
-              }
-              ScopedFd fd(data.file_name.c_str(), O_RDONLY);
-              vector<uint8_t> data;
-              data.resize(read_req.size);
-              LOG(debug) << "Reading " << read_req.size << " bytes at offset " <<
-                read_req.offset;
-              ssize_t bytes =
-                  read_to_end(fd, read_req.offset, data.data(), read_req.size);
-              if (bytes < (ssize_t)read_req.size) {
-                LOG(warn) << "Requested " << read_req.size << " bytes but only got " << bytes;
-              }
-              dbg->reply_pread(data.data(), bytes, bytes >= 0 ? 0 : -errno);
-              return;
-            }
+        if (it != memory_files.end()) {
+          ServedFile* file = find_served_file(it->second);
+          if (file) {
+            reply_served_file_pread(*file, read_req.offset, read_req.size);
+            return;
           }
-          LOG(warn) << "No mapping found";
         }
       }
       LOG(warn) << "Unknown file descriptor requested";
@@ -581,12 +815,15 @@ void GdbServer::dispatch_debugger_request(Session& session,
       dbg->reply_get_auxv(target->vm()->saved_auxv());
       return;
     }
+    case DREQ_GET_LIBRARIES_SVR4: {
+      dbg->reply_get_libraries_svr4(libraries_svr4(target));
+      return;
+    }
     case DREQ_GET_MEM: {
       vector<uint8_t> mem;
       mem.resize(req.mem().len);
-      ssize_t nread = target->read_bytes_fallible(req.mem().addr, req.mem().len,
-                                                  mem.data());
-      mem.resize(max(ssize_t(0), nread));
+      mem.resize(read_memory_cached(target, req.mem().addr, req.mem().len,
+                                    mem.data()));
       target->vm()->replace_breakpoints_with_original_values(
           mem.data(), mem.size(), req.mem().addr);
       maybe_intercept_mem_request(target, req, &mem);
@@ -764,10 +1001,7 @@ void GdbServer::dispatch_debugger_request(Session& session,
       // copy.  When gdb sends a plain "qSymbol::" packet, because gdb
       // has detected some change in the inferior state that might
       // enable more symbol lookups, we restart the iterator.
-      if (!thread_db) {
-        thread_db =
-            std::unique_ptr<ThreadDb>(new ThreadDb(debuggee_tguid.tid()));
-      }
+      ensure_thread_db();
 
       const string& name = req.sym().name;
       if (req.sym().has_address) {
@@ -790,10 +1024,7 @@ void GdbServer::dispatch_debugger_request(Session& session,
       return;
     }
     case DREQ_TLS: {
-      if (!thread_db) {
-        thread_db =
-            std::unique_ptr<ThreadDb>(new ThreadDb(debuggee_tguid.tid()));
-      }
+      ensure_thread_db();
       remote_ptr<void> address;
       bool ok = thread_db->get_tls_address(target->thread_group().get(),
                                            target->rec_tid, req.tls().offset,
@@ -833,6 +1064,9 @@ bool GdbServer::diverter_process_debugger_requests(
     GdbRequest* req) {
   while (true) {
     *req = dbg->get_request();
+    if (!keeps_memory_cache(*req)) {
+      memory_cache.pages.clear();
+    }
 
     if (req->is_resume_request()) {
       const vector<GdbContAction>& actions = req->cont().actions;
@@ -942,8 +1176,42 @@ static Task* is_in_exec(ReplayTimeline& timeline) {
              : nullptr;
 }
 
+/**
+ * The registers gdb needs at every stop to find the current frame. Sending
+ * them with the stop saves a 'p' or 'g' round trip.
+ */
+static vector<GdbRegisterValue> expedited_regs(const Registers& regs) {
+  vector<GdbRegister> names;
+  switch (regs.arch()) {
+    case x86:
+      names = { DREG_EBP, DREG_ESP, DREG_EIP };
+      break;
+    case x86_64:
+      names = { DREG_RBP, DREG_RSP, DREG_RIP };
+      break;
+    case aarch64:
+      names = { DREG_X29, DREG_SP, DREG_PC };
+      break;
+    default:
+      FATAL() << "Unknown architecture";
+      break;
+  }
+  vector<GdbRegisterValue> result;
+  for (GdbRegister name : names) {
+    GdbRegisterValue reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.name = name;
+    reg.size = regs.read_register(&reg.value[0], name, &reg.defined);
+    if (reg.defined) {
+      result.push_back(reg);
+    }
+  }
+  return result;
+}
+
 void GdbServer::maybe_notify_stop(const GdbRequest& req,
-                                  const BreakStatus& break_status) {
+                                  const BreakStatus& break_status,
+                                  const Registers* stop_regs) {
   bool do_stop = false;
   remote_ptr<void> watch_addr;
   char watch[1024];
@@ -1024,8 +1292,8 @@ void GdbServer::maybe_notify_stop(const GdbRequest& req,
   if (do_stop && t->thread_group()->tguid() == debuggee_tguid) {
     /* Notify the debugger and process any new requests
      * that might have triggered before resuming. */
-    dbg->notify_stop(get_threadid(t), stop_siginfo.si_signo,
-                     watch);
+    dbg->notify_stop(get_threadid(t), stop_siginfo.si_signo, watch,
+                     expedited_regs(stop_regs ? *stop_regs : t->regs()));
     last_query_tuid = last_continue_tuid = t->tuid();
   }
 }
@@ -1099,8 +1367,19 @@ GdbRequest GdbServer::divert(ReplaySession& replay) {
     // diversion, to ensure the diversion is consistent with the timeline
     // breakpoint/watchpoint state.
     timeline.apply_breakpoints_and_watchpoints();
+    // Be conservative: a diversion is where the debugger changes state, so
+    // don't serve anything recorded before it.
+    timeline.invalidate_singlestep_history();
+  }
+  DiversionSession::shr_ptr diversion_session = reuse_cached_diversion(replay);
+  bool can_cache = true;
+  if (diversion_session) {
+    ++diversion_clones_avoided_;
+  } else {
+    diversion_session = replay.clone_diversion();
+    ++diversions_created_;
+    can_cache = diversion_session->track_changes();
   }
-  DiversionSession::shr_ptr diversion_session = replay.clone_diversion();
   uint32_t diversion_refcount = 1;
   TaskUid saved_query_tuid = last_query_tuid;
   TaskUid saved_continue_tuid = last_continue_tuid;
@@ -1147,13 +1426,80 @@ GdbRequest GdbServer::divert(ReplaySession& replay) {
   LOG(debug) << "... ending debugging diversion";
   DEBUG_ASSERT(diversion_refcount == 0);
 
-  diversion_session->kill_all_tasks();
+  if (can_cache && req.type != DREQ_NONE && !req.is_resume_request()) {
+    // The replay isn't going to move yet, so a following diversion can
+    // start from this one.
+    ReplayTask* t = replay.current_task();
+    cached_diversion.session = diversion_session;
+    cached_diversion.time = replay.current_frame_time();
+    cached_diversion.tuid = t ? t->tuid() : TaskUid();
+    cached_diversion.ticks = t ? t->tick_count() : 0;
+    cached_diversion.regs = t ? t->regs() : Registers();
+  } else {
+    diversion_session->kill_all_tasks();
+  }
 
   last_query_tuid = saved_query_tuid;
   last_continue_tuid = saved_continue_tuid;
   return req;
 }
 
+DiversionSession::shr_ptr GdbServer::reuse_cached_diversion(
+    ReplaySession& replay) {
+  DiversionSession::shr_ptr session = std::move(cached_diversion.session);
+  if (!session) {
+    return nullptr;
+  }
+  ReplayTask* t = replay.current_task();
+  if (replay.current_frame_time() != cached_diversion.time ||
+      (t ? t->tuid() : TaskUid()) != cached_diversion.tuid ||
+      (t && (t->tick_count() != cached_diversion.ticks ||
+             !(t->regs() == cached_diversion.regs)))) {
+    LOG(debug) << "Replay moved since the cached diversion was cloned";
+    return nullptr;
+  }
+  if (!session->reset_changes(replay)) {
+    return nullptr;
+  }
+  LOG(debug) << "Reusing cached diversion " << session.get();
+  return session;
+}
+
+/**
+ * Returns true if |req| can be handled in the replay session without making
+ * a cached diversion stale.
+ */
+static bool keeps_cached_diversion(const GdbRequest& req) {
+  switch (req.type) {
+    case DREQ_GET_CURRENT_THREAD:
+    case DREQ_GET_OFFSETS:
+    case DREQ_GET_REGS:
+    case DREQ_GET_STOP_REASON:
+    case DREQ_GET_THREAD_LIST:
+    case DREQ_GET_AUXV:
+    case DREQ_GET_EXEC_FILE:
+    case DREQ_GET_LIBRARIES_SVR4:
+    case DREQ_GET_IS_THREAD_ALIVE:
+    case DREQ_GET_THREAD_EXTRA_INFO:
+    case DREQ_SET_CONTINUE_THREAD:
+    case DREQ_SET_QUERY_THREAD:
+    case DREQ_TLS:
+    case DREQ_GET_MEM:
+    case DREQ_READ_SIGINFO:
+    case DREQ_SEARCH_MEM:
+    case DREQ_GET_REG:
+    case DREQ_RR_CMD:
+    case DREQ_QSYMBOL:
+    case DREQ_FILE_SETFS:
+    case DREQ_FILE_OPEN:
+    case DREQ_FILE_PREAD:
+    case DREQ_FILE_CLOSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
 /**
  * Reply to debugger requests until the debugger asks us to resume
  * execution, detach, restart, or interrupt.
@@ -1163,6 +1509,12 @@ GdbRequest GdbServer::process_debugger_requests(ReportState state) {
     GdbRequest req = dbg->get_request();
     req.suppress_debugger_stop = false;
     try_lazy_reverse_singlesteps(req);
+    if (!keeps_cached_diversion(req)) {
+      cached_diversion.session = nullptr;
+    }
+    if (!keeps_memory_cache(req)) {
+      memory_cache.pages.clear();
+    }
 
     if (req.type == DREQ_READ_SIGINFO) {
       vector<uint8_t> si_bytes;
@@ -1244,21 +1596,32 @@ void GdbServer::try_lazy_reverse_singlesteps(GdbRequest& req) {
     break_status.task_context = TaskContext(t);
     break_status.singlestep_complete = true;
     LOG(debug) << "  using lazy reverse-singlestep";
-    maybe_notify_stop(req, break_status);
+    maybe_notify_stop(req, break_status, &now.regs());
 
     while (true) {
       req = dbg->get_request();
       req.suppress_debugger_stop = false;
-      if (req.type != DREQ_GET_REGS) {
-        break;
+      if (req.type == DREQ_GET_REGS) {
+        LOG(debug) << "  using lazy reverse-singlestep registers";
+        dispatch_regs_request(now.regs(), now.extra_regs());
+        continue;
+      }
+      vector<uint8_t> mem;
+      if (req.type == DREQ_GET_MEM && matches_threadid(t, req.target) &&
+          !is_in_patch_stubs(t, now.regs().ip()) &&
+          timeline.lazy_read_memory(now, t, req.mem().addr, req.mem().len,
+                                    &mem)) {
+        LOG(debug) << "  using lazy reverse-singlestep memory";
+        dbg->reply_get_mem(mem);
+        continue;
       }
-      LOG(debug) << "  using lazy reverse-singlestep registers";
-      dispatch_regs_request(now.regs(), now.extra_regs());
+      break;
     }
   }
 
   if (need_seek) {
     timeline.seek_to_mark(now);
+    memory_cache.pages.clear();
   }
 }
 
@@ -1290,6 +1653,18 @@ GdbServer::ContinueOrStop GdbServer::handle_exited_state(
   return STOP_DEBUGGING;
 }
 
+/**
+ * Forward continues come back to check for an interrupt from gdb after
+ * roughly this many ticks (on the order of 100ms of execution) even when
+ * the replay reaches no event.
+ */
+static const Ticks INTERRUPT_POLL_TICKS = 50000000;
+
+/**
+ * Minimum time between progress messages.
+ */
+static const double PROGRESS_REPORT_INTERVAL_SEC = 1.0;
+
 GdbServer::ContinueOrStop GdbServer::debug_one_step(
     GdbRequest& last_resume_request) {
   ReplayResult result;
@@ -1367,8 +1742,10 @@ GdbServer::ContinueOrStop GdbServer::debug_one_step(
       int signal_to_deliver;
       RunCommand command = compute_run_command_from_actions(
           timeline.current_session().current_task(), req, &signal_to_deliver);
+      tracepoints.install(timeline, timeline.current_session().current_task());
       // Ignore gdb's |signal_to_deliver|; we just have to follow the replay.
-      result = timeline.replay_step_forward(command);
+      result = timeline.replay_step_forward(command, INTERRUPT_POLL_TICKS);
+      maybe_report_progress();
     }
     if (result.status == REPLAY_EXITED) {
       return handle_exited_state(last_resume_request);
@@ -1401,7 +1778,10 @@ GdbServer::ContinueOrStop GdbServer::debug_one_step(
       return false;
     };
 
-    auto interrupt_check = [&]() { return dbg->sniff_packet(); };
+    auto interrupt_check = [&]() {
+      maybe_report_progress();
+      return dbg->sniff_packet();
+    };
     switch (command) {
       case RUN_CONTINUE:
         result = timeline.reverse_continue(stop_filter, interrupt_check);
@@ -1432,6 +1812,40 @@ GdbServer::ContinueOrStop GdbServer::debug_one_step(
   return CONTINUE_DEBUGGING;
 }
 
+void GdbServer::set_report_progress(bool enable) {
+  report_progress = enable;
+  last_progress_report = monotonic_now_sec();
+}
+
+void GdbServer::maybe_report_progress() {
+  if (!report_progress) {
+    return;
+  }
+  double now = monotonic_now_sec();
+  if (now - last_progress_report < PROGRESS_REPORT_INTERVAL_SEC) {
+    return;
+  }
+  last_progress_report = now;
+  if (!last_trace_event) {
+    // Only find the end of the trace once a run has gone on long enough to
+    // need a report. If we've already replayed to the end, we know it.
+    if (final_event != UINT32_MAX) {
+      last_trace_event = final_event;
+    } else {
+      TraceReader reader(timeline.current_session().trace_reader().dir());
+      while (!reader.at_end()) {
+        last_trace_event = reader.read_frame().time();
+      }
+    }
+  }
+  FrameTime event = timeline.current_session().trace_reader().time();
+  char buf[100];
+  snprintf(buf, sizeof(buf), "rr: at event %lld of %lld (%d%%)\n",
+           (long long)event, (long long)last_trace_event,
+           last_trace_event ? int(100 * event / last_trace_event) : 0);
+  dbg->notify_console_output(buf);
+}
+
 static bool target_event_reached(const ReplayTimeline& timeline, const GdbServer::Target& target, const ReplayResult& result) {
   if (target.event == -1) {
     return is_last_thread_exit(result.break_status) &&
@@ -1775,9 +2189,32 @@ static void print_debugger_launch_command(Task* t, const string& host,
   fprintf(out, "%s\n", t->vm()->exe_image().c_str());
 }
 
+std::string GdbServer::add_tracepoint(const std::string& spec) {
+  string error = tracepoints.add(spec);
+  if (!error.empty()) {
+    return error;
+  }
+  tracepoints.install(timeline, timeline.current_session().current_task());
+  if (tracepoints.pending()) {
+    return "Tracepoint will be placed when its location is mapped.";
+  }
+  return "Tracepoint placed.";
+}
+
 void GdbServer::serve_replay(const ConnectionFlags& flags) {
+  if (!flags.tracepoint_output.empty()) {
+    tracepoints.set_output(flags.tracepoint_output);
+  }
+  for (auto& spec : flags.tracepoints) {
+    string error = tracepoints.add(spec);
+    if (!error.empty()) {
+      FATAL() << error << ": " << spec;
+    }
+  }
+
   ReplayResult result;
   do {
+    tracepoints.install(timeline, timeline.current_session().current_task());
     result = timeline.replay_step_forward(RUN_CONTINUE);
     if (result.status == REPLAY_EXITED) {
       LOG(info) << "Debugger was not launched before end of trace";
@@ -1832,8 +2269,11 @@ void GdbServer::serve_replay(const ConnectionFlags& flags) {
     }
 
     timeline.remove_breakpoints_and_watchpoints();
+    cached_diversion.session = nullptr;
   } while (flags.keep_listening);
 
+  LOG(info) << "Diversions cloned: " << diversions_created_
+            << ", clones avoided: " << diversion_clones_avoided_;
   LOG(debug) << "debugger server exiting ...";
 }
 
@@ -2057,35 +2497,11 @@ static bool is_likely_interp(string fsname) {
 
 static remote_ptr<void> base_addr_from_rendezvous(Task* t, string fname)
 {
-  remote_ptr<void> interpreter_base = t->vm()->saved_interpreter_base();
-  if (!interpreter_base || !t->vm()->has_mapping(interpreter_base)) {
-    return nullptr;
-  }
-  string ld_path = t->vm()->saved_ld_path();
-  if (ld_path.length() == 0) {
-    FATAL() << "Failed to retrieve interpreter name with interpreter_base=" << interpreter_base;
-  }
-  ScopedFd ld(ld_path.c_str(), O_RDONLY);
-  if (ld < 0) {
-    FATAL() << "Open failed: " << ld_path;
-  }
-  ElfFileReader reader(ld);
-  auto syms = reader.read_symbols(".dynsym", ".dynstr");
-  static const char r_debug[] = "_r_debug";
-  bool found = false;
-  uintptr_t r_debug_offset = 0;
-  for (size_t i = 0; i < syms.size(); ++i) {
-    if (!syms.is_name(i, r_debug)) {
-      continue;
-    }
-    r_debug_offset = syms.addr(i);
-    found = true;
-  }
-  if (!found) {
+  remote_ptr<NativeArch::r_debug> r_debug_remote = find_r_debug(t).cast<NativeArch::r_debug>();
+  if (!r_debug_remote) {
     return nullptr;
   }
   bool ok = true;
-  remote_ptr<NativeArch::r_debug> r_debug_remote = interpreter_base.as_int()+r_debug_offset;
   remote_ptr<NativeArch::link_map> link_map = t->read_mem(REMOTE_PTR_FIELD(r_debug_remote, r_map), &ok);
   while (ok && link_map != nullptr) {
     if (fname == t->read_c_str(t->read_mem(REMOTE_PTR_FIELD(link_map, l_name), &ok), &ok)) {
@@ -2097,6 +2513,116 @@ static remote_ptr<void> base_addr_from_rendezvous(Task* t, string fname)
   return nullptr;
 }
 
+/**
+ * Largest vFile:pread we answer. Matches the PacketSize we advertise.
+ */
+static const size_t MAX_PREAD_SIZE = 1024 * 1024;
+/**
+ * How far past a read we ask the kernel to read ahead (or read ourselves,
+ * for files we couldn't map). gdb walks debug info in packet-sized pieces.
+ */
+static const size_t FILE_READ_AHEAD_BYTES = 8 * 1024 * 1024;
+
+GdbServer::ServedFile::~ServedFile() {
+  if (data) {
+    munmap(const_cast<uint8_t*>(data), size);
+  }
+}
+
+GdbServer::ServedFile* GdbServer::find_served_file(const FileId& id) {
+  auto cached = served_files.find(id);
+  if (cached != served_files.end()) {
+    return cached->second.get();
+  }
+  if (!timeline.is_running()) {
+    return nullptr;
+  }
+  // Search our mmap stream for a record that can satisfy this request
+  TraceReader tmp_reader(timeline.current_session().trace_reader());
+  tmp_reader.rewind();
+  while (true) {
+    TraceReader::MappedData data;
+    bool found;
+    KernelMapping km = tmp_reader.read_mapped_region(
+        &data, &found, TraceReader::DONT_VALIDATE, TraceReader::ANY_TIME);
+    if (!found) {
+      break;
+    }
+    if (id == FileId(km)) {
+      if (data.source != TraceReader::SOURCE_FILE) {
+        LOG(warn) << "Not serving file because it is not a file source";
+        return nullptr;
+      }
+      unique_ptr<ServedFile> file(new ServedFile());
+      file->fd = ScopedFd(data.file_name.c_str(), O_RDONLY);
+      if (!file->fd.is_open()) {
+        LOG(warn) << "Can't open " << data.file_name;
+        return nullptr;
+      }
+      // Only map private copies in the trace. A file hard-linked into the
+      // trace, or referenced outside it, can be truncated under us (e.g. a
+      // library rebuilt in place), and touching a truncated mapping raises
+      // SIGBUS. Those are served with reads into the read-ahead buffer.
+      const string& trace_dir = tmp_reader.dir();
+      bool private_copy = data.file_name.compare(0, trace_dir.size(),
+                                                 trace_dir) == 0;
+      struct stat st;
+      if (private_copy && !fstat(file->fd, &st) && st.st_nlink == 1 &&
+          st.st_size > 0) {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+        if (p != MAP_FAILED) {
+          file->data = static_cast<const uint8_t*>(p);
+          file->size = st.st_size;
+        }
+      }
+      LOG(debug) << "Serving " << data.file_name
+                 << (file->data ? " from a mapping" : " with reads");
+      ServedFile* ret = file.get();
+      served_files[id] = std::move(file);
+      return ret;
+    }
+  }
+  LOG(warn) << "No mapping found";
+  return nullptr;
+}
+
+void GdbServer::reply_served_file_pread(ServedFile& file, uint64_t offset,
+                                        size_t size) {
+  size = min(size, MAX_PREAD_SIZE);
+  LOG(debug) << "Reading " << size << " bytes at offset " << offset;
+  if (file.data) {
+    if (offset >= file.size) {
+      dbg->reply_pread(nullptr, 0, 0);
+      return;
+    }
+    size = min<uint64_t>(size, file.size - offset);
+    uint64_t ahead_start = floor_page_size(offset);
+    uint64_t ahead_end = min<uint64_t>(file.size, offset + size +
+                                                      FILE_READ_AHEAD_BYTES);
+    madvise(const_cast<uint8_t*>(file.data) + ahead_start,
+            ahead_end - ahead_start, MADV_WILLNEED);
+    dbg->reply_pread(file.data + offset, size, 0);
+    return;
+  }
+
+  if (offset < file.readahead_offset ||
+      offset + size > file.readahead_offset + file.readahead.size()) {
+    file.readahead.resize(max(size, FILE_READ_AHEAD_BYTES));
+    ssize_t bytes = read_to_end(file.fd, offset, file.readahead.data(),
+                                file.readahead.size());
+    if (bytes < 0) {
+      file.readahead.clear();
+      dbg->reply_pread(nullptr, 0, errno);
+      return;
+    }
+    file.readahead.resize(bytes);
+    file.readahead_offset = offset;
+  }
+  uint64_t skip = offset - file.readahead_offset;
+  size = min<uint64_t>(size, file.readahead.size() - skip);
+  dbg->reply_pread(file.readahead.data() + skip, size, 0);
+}
+
 int GdbServer::open_file(Session& session, Task* continue_task, const std::string& file_name) {
   // XXX should we require file_scope_pid == 0 here?
   ScopedFd contents;
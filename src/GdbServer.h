@@ -16,6 +16,7 @@
 #include "ThreadDb.h"
 #endif
 #include "TraceFrame.h"
+#include "Tracepoint.h"
 
 namespace rr {
 
@@ -56,6 +57,10 @@ public:
     // Name of the debugger to suggest. Only used if debugger_params_write_pipe
     // is null.
     std::string debugger_name;
+    // Tracepoints to place as soon as their locations are mapped, and the
+    // file to append their records to (stdout if empty).
+    std::vector<std::string> tracepoints;
+    std::string tracepoint_output;
 
     ConnectionFlags()
         : dbg_port(-1),
@@ -76,7 +81,12 @@ public:
         interrupt_pending(false),
         exit_sigkill_pending(false),
         timeline(std::move(session)),
-        emergency_debug_session(nullptr) {
+        emergency_debug_session(nullptr),
+        diversions_created_(0),
+        diversion_clones_avoided_(0),
+        report_progress(false),
+        last_progress_report(0),
+        last_trace_event(0) {
     memset(&stop_siginfo, 0, sizeof(stop_siginfo));
   }
 
@@ -125,6 +135,29 @@ public:
 
   ReplayTimeline& get_timeline() { return timeline; }
 
+  /**
+   * Number of diversion sessions cloned from the replay for inferior calls,
+   * and number of diversions that reused a cached one instead.
+   */
+  uint64_t diversions_created() const { return diversions_created_; }
+  uint64_t diversion_clones_avoided() const {
+    return diversion_clones_avoided_;
+  }
+
+  /**
+   * Add an rr-side tracepoint, placing it now if its location is mapped.
+   * Returns a message for the user.
+   */
+  std::string add_tracepoint(const std::string& spec);
+  void clear_tracepoints() { tracepoints.clear(timeline); }
+
+  /**
+   * Turn on or off console messages about where replay has got to during
+   * long continues and reverse-continues.
+   */
+  void set_report_progress(bool enable);
+  bool reports_progress() const { return report_progress; }
+
 private:
   GdbServer(std::unique_ptr<GdbConnection>& dbg, Task* t);
 
@@ -138,6 +171,13 @@ private:
   enum ReportState { REPORT_NORMAL, REPORT_THREADS_DEAD };
   void maybe_intercept_mem_request(Task* target, const GdbRequest& req,
                                    std::vector<uint8_t>* result);
+  /**
+   * Read |len| bytes at |addr| in |t| into |buf|, going through
+   * |memory_cache|. Returns the number of bytes read, which is less than
+   * |len| if the end of readable memory was reached.
+   */
+  size_t read_memory_cached(Task* t, remote_ptr<void> addr, size_t len,
+                            uint8_t* buf);
   /**
    * Process the single debugger request |req| inside the session |session|.
    *
@@ -189,13 +229,26 @@ private:
    * resuming execution in that session.
    */
   GdbRequest divert(ReplaySession& replay);
+  /**
+   * Return the cached diversion, reset to the state of |replay|, if it was
+   * cloned from |replay| at its current stop.
+   */
+  DiversionSession::shr_ptr reuse_cached_diversion(ReplaySession& replay);
 
   /**
    * If |break_status| indicates a stop that we should report to gdb,
    * report it. |req| is the resume request that generated the stop.
+   * |stop_regs|, if set, are the registers to report instead of the
+   * stopped task's current registers.
    */
   void maybe_notify_stop(const GdbRequest& req,
-                         const BreakStatus& break_status);
+                         const BreakStatus& break_status,
+                         const Registers* stop_regs = nullptr);
+
+  /**
+   * Send a progress message to the debugger if one is due.
+   */
+  void maybe_report_progress();
 
   /**
    * Return the checkpoint stored as |checkpoint_id| or nullptr if there
@@ -214,6 +267,13 @@ private:
    * file descriptor.
    */
   int open_file(Session& session, Task *continue_task, const std::string& file_name);
+  /**
+   * Return the open trace copy of the mapped file |id|, opening it if
+   * necessary, or null if it can't be served.
+   */
+  struct ServedFile;
+  ServedFile* find_served_file(const FileId& id);
+  void reply_served_file_pread(ServedFile& file, uint64_t offset, size_t size);
 
   Target target;
   // dbg is initially null. Once the debugger connection is established, it
@@ -226,6 +286,7 @@ private:
   // ThreadDb for debuggee ThreadGroup
 #ifdef PROC_SERVICE_H
   std::unique_ptr<ThreadDb> thread_db;
+  void ensure_thread_db();
 #endif
   // The TaskUid of the last continued task.
   TaskUid last_continue_tuid;
@@ -280,8 +341,59 @@ private:
   // bad idea.
   std::map<int, ScopedFd> files;
   std::map<int, FileId> memory_files;
+  // Trace copies of mapped files that gdb has read. gdb reopens the same
+  // files often, so these stay open, and mapped if possible, until we exit.
+  struct ServedFile {
+    ServedFile() : data(nullptr), size(0), readahead_offset(0) {}
+    ~ServedFile();
+    ScopedFd fd;
+    // The whole file, or null if it couldn't be mapped or isn't a private
+    // copy in the trace.
+    const uint8_t* data;
+    size_t size;
+    // When |data| is null, the last large chunk read from |fd|.
+    std::vector<uint8_t> readahead;
+    uint64_t readahead_offset;
+  };
+  std::map<FileId, std::unique_ptr<ServedFile>> served_files;
   // The pid for gdb's last vFile:setfs
   pid_t file_scope_pid;
+
+  // A diversion that ended without the replay moving, kept so that the next
+  // diversion at the same stop can be reset and reused instead of cloning
+  // the replay session again.
+  struct CachedDiversion {
+    DiversionSession::shr_ptr session;
+    // The replay state it was cloned from.
+    FrameTime time;
+    TaskUid tuid;
+    Ticks ticks;
+    Registers regs;
+  };
+  CachedDiversion cached_diversion;
+
+  // Pages of tracee memory read while the debuggee is stopped. gdb makes
+  // bursts of small reads at each stop, e.g. while unwinding. Only valid
+  // for one session and address space, and cleared by any request that
+  // could change memory.
+  struct MemoryCache {
+    MemoryCache() : session(nullptr) {}
+    Session* session;
+    AddressSpaceUid vm_uid;
+    // Page start -> contents. Shorter than a page if the rest of the page
+    // couldn't be read.
+    std::map<remote_ptr<void>, std::vector<uint8_t>> pages;
+  };
+  MemoryCache memory_cache;
+
+  Tracepoints tracepoints;
+  uint64_t diversions_created_;
+  uint64_t diversion_clones_avoided_;
+
+  bool report_progress;
+  double last_progress_report;
+  // Event number of the last trace frame, or 0 if not computed yet.
+  FrameTime last_trace_event;
 };
 
 } // namespace rr
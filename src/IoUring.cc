@@ -0,0 +1,249 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "IoUring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "Flags.h"
+#include "kernel_metadata.h"
+#include "log.h"
+
+using namespace std;
+
+namespace rr {
+
+#ifdef IO_URING_H
+
+unique_ptr<IoUring> IoUring::create(uint32_t entries) {
+  if (!Flags::get().use_io_uring) {
+    return nullptr;
+  }
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    LOG(debug) << "io_uring_setup failed: " << errno_name(errno);
+    return nullptr;
+  }
+
+  unique_ptr<IoUring> ring(new IoUring());
+  ring->ring_fd = ScopedFd(fd);
+  ring->owner_ = getpid();
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    ring->sq_ring_size = ring->cq_ring_size =
+        max(ring->sq_ring_size, ring->cq_ring_size);
+  }
+
+  void* sq = mmap(nullptr, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    return nullptr;
+  }
+  ring->sq_ring = sq;
+  if (single_mmap) {
+    ring->cq_ring = sq;
+  } else {
+    void* cq = mmap(nullptr, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      return nullptr;
+    }
+    ring->cq_ring = cq;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return nullptr;
+  }
+  ring->sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+  char* sq_base = static_cast<char*>(ring->sq_ring);
+  ring->sq_head = reinterpret_cast<uint32_t*>(sq_base + params.sq_off.head);
+  ring->sq_tail = reinterpret_cast<uint32_t*>(sq_base + params.sq_off.tail);
+  ring->sq_mask = reinterpret_cast<uint32_t*>(sq_base + params.sq_off.ring_mask);
+  ring->sq_array = reinterpret_cast<uint32_t*>(sq_base + params.sq_off.array);
+  char* cq_base = static_cast<char*>(ring->cq_ring);
+  ring->cq_head = reinterpret_cast<uint32_t*>(cq_base + params.cq_off.head);
+  ring->cq_tail = reinterpret_cast<uint32_t*>(cq_base + params.cq_off.tail);
+  ring->cq_mask = reinterpret_cast<uint32_t*>(cq_base + params.cq_off.ring_mask);
+  ring->cqes = reinterpret_cast<struct io_uring_cqe*>(cq_base + params.cq_off.cqes);
+  return ring;
+}
+
+IoUring::~IoUring() {
+  // The kernel may still be writing into buffers we were given; don't let
+  // our callers free them until it's done.
+  if (sqes && owner_ == getpid()) {
+    submit();
+    while (in_flight_ > 0 && reap_one(true)) {
+    }
+  }
+  if (sqes) {
+    munmap(sqes, sqes_size);
+  }
+  if (cq_ring && cq_ring != sq_ring) {
+    munmap(cq_ring, cq_ring_size);
+  }
+  if (sq_ring) {
+    munmap(sq_ring, sq_ring_size);
+  }
+}
+
+bool IoUring::register_buffers(const vector<struct iovec>& buffers) {
+  return syscall(__NR_io_uring_register, ring_fd.get(), IORING_REGISTER_BUFFERS,
+                 buffers.data(), buffers.size()) == 0;
+}
+
+struct io_uring_sqe* IoUring::get_sqe() {
+  uint32_t head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  uint32_t tail = *sq_tail + to_submit;
+  if (tail - head > *sq_mask) {
+    return nullptr;
+  }
+  uint32_t index = tail & *sq_mask;
+  struct io_uring_sqe* sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  ++to_submit;
+  return sqe;
+}
+
+bool IoUring::queue_write(int fd, const void* buf, size_t len, uint64_t offset,
+                          int buf_index, uint64_t user_data) {
+  struct io_uring_sqe* sqe = get_sqe();
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = buf_index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(buf);
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->buf_index = buf_index >= 0 ? buf_index : 0;
+  sqe->user_data = user_data;
+  return true;
+}
+
+bool IoUring::queue_read(int fd, void* buf, size_t len, uint64_t offset,
+                         uint64_t user_data) {
+  struct io_uring_sqe* sqe = get_sqe();
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(buf);
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  return true;
+}
+
+bool IoUring::submit(uint32_t wait_nr) {
+  // Publish the new SQEs before the kernel can see the tail move.
+  __atomic_store_n(sq_tail, *sq_tail + to_submit, __ATOMIC_RELEASE);
+  to_enter += to_submit;
+  to_submit = 0;
+  while (to_enter || wait_nr) {
+    int ret = syscall(__NR_io_uring_enter, ring_fd.get(), to_enter, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(warn) << "io_uring_enter failed: " << errno_name(errno);
+      return false;
+    }
+    in_flight_ += ret;
+    to_enter -= ret;
+    // The kernel waited for us; don't ask it to again.
+    wait_nr = 0;
+    if (!ret) {
+      // Out of kernel resources; the rest goes in with the next call.
+      break;
+    }
+  }
+  return true;
+}
+
+bool IoUring::reap_one(bool wait) {
+  while (true) {
+    uint32_t head = *cq_head;
+    if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+      completed[cqe->user_data] = cqe->res;
+      __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+      --in_flight_;
+      return true;
+    }
+    if (!wait || !in_flight_) {
+      return false;
+    }
+    int ret = syscall(__NR_io_uring_enter, ring_fd.get(), 0, 1,
+                      IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (ret < 0 && errno != EINTR) {
+      FATAL() << "io_uring_enter failed";
+    }
+  }
+}
+
+int32_t IoUring::wait(uint64_t user_data) {
+  submit();
+  while (true) {
+    auto it = completed.find(user_data);
+    if (it != completed.end()) {
+      int32_t res = it->second;
+      completed.erase(it);
+      return res;
+    }
+    if (!reap_one(true)) {
+      FATAL() << "Waiting for io_uring operation that was never submitted";
+    }
+  }
+}
+
+#else
+
+unique_ptr<IoUring> IoUring::create(uint32_t) { return nullptr; }
+IoUring::~IoUring() {}
+bool IoUring::register_buffers(const vector<struct iovec>&) { return false; }
+bool IoUring::queue_write(int, const void*, size_t, uint64_t, int, uint64_t) {
+  return false;
+}
+bool IoUring::queue_read(int, void*, size_t, uint64_t, uint64_t) {
+  return false;
+}
+bool IoUring::submit(uint32_t) { return false; }
+int32_t IoUring::wait(uint64_t) { return -ENOSYS; }
+
+#endif
+
+IoUring* IoUring::for_thread() {
+  // Compression and background copy threads may do I/O concurrently with
+  // the main thread, and rings aren't thread-safe, so each gets its own.
+  static thread_local unique_ptr<IoUring> ring;
+  static thread_local pid_t created_for = 0;
+  if (created_for != getpid()) {
+    // Either we haven't tried yet or we've been forked. In the latter case,
+    // dropping the inherited ring doesn't disturb the parent.
+    created_for = getpid();
+    ring = create(64);
+  }
+  return ring.get();
+}
+
+} // namespace rr
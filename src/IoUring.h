@@ -0,0 +1,115 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_IO_URING_H_
+#define RR_IO_URING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "ScopedFd.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace rr {
+
+/**
+ * A minimal io_uring instance for rr's own trace I/O, driven through the raw
+ * syscalls so we don't depend on liburing. Only used when --io-uring is
+ * given; callers must fall back to ordinary read/write when create()
+ * fails. An IoUring is not thread-safe: each thread doing asynchronous I/O
+ * needs its own.
+ */
+class IoUring {
+public:
+  /**
+   * Returns null if io_uring isn't enabled or isn't available (old kernel,
+   * seccomp policy, sysctl kernel.io_uring_disabled etc).
+   */
+  static std::unique_ptr<IoUring> create(uint32_t entries);
+  /**
+   * A lazily created instance for the calling thread. Returns null if
+   * io_uring is unavailable. A forked child gets its own ring; any
+   * operations the parent had in flight are invisible to it.
+   */
+  static IoUring* for_thread();
+
+  ~IoUring();
+
+  /**
+   * Register |buffers| for use with queue_write()'s |buf_index|. Returns false
+   * on failure, in which case only unregistered buffers can be used.
+   */
+  bool register_buffers(const std::vector<struct iovec>& buffers);
+
+  /**
+   * Queue a write (or read) of |len| bytes at |offset| in |fd|. If |buf_index|
+   * is >= 0, |buf| must lie within that registered buffer. Nothing is
+   * submitted to the kernel until submit(). Returns false if the submission
+   * queue is full.
+   */
+  bool queue_write(int fd, const void* buf, size_t len, uint64_t offset,
+                   int buf_index, uint64_t user_data);
+  bool queue_read(int fd, void* buf, size_t len, uint64_t offset,
+                  uint64_t user_data);
+
+  /**
+   * Submit all queued operations in one io_uring_enter, optionally waiting
+   * for at least |wait_nr| completions in the same call.
+   */
+  bool submit(uint32_t wait_nr = 0);
+
+  /**
+   * Wait for the operation tagged |user_data| to complete and return its
+   * result (bytes transferred or -errno). Completions of other operations
+   * reaped along the way are kept for their own wait().
+   */
+  int32_t wait(uint64_t user_data);
+
+  /** Number of submitted operations whose result hasn't been consumed. */
+  size_t in_flight() const { return in_flight_; }
+
+  pid_t owner() const { return owner_; }
+
+private:
+  IoUring() : sq_ring(nullptr), cq_ring(nullptr), sqes(nullptr),
+              sq_ring_size(0), cq_ring_size(0), sqes_size(0),
+              to_submit(0), to_enter(0), in_flight_(0), owner_(0) {}
+
+  io_uring_sqe* get_sqe();
+  bool reap_one(bool wait);
+
+  ScopedFd ring_fd;
+  void* sq_ring;
+  void* cq_ring;
+  io_uring_sqe* sqes;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  uint32_t* sq_head;
+  uint32_t* sq_tail;
+  uint32_t* sq_mask;
+  uint32_t* sq_array;
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t* cq_mask;
+  io_uring_cqe* cqes;
+
+  // Queued SQEs not yet visible to the kernel
+  uint32_t to_submit;
+  // SQEs visible to the kernel but not yet consumed by io_uring_enter
+  uint32_t to_enter;
+  size_t in_flight_;
+  pid_t owner_;
+  std::unordered_map<uint64_t, int32_t> completed;
+};
+
+} // namespace rr
+
+#endif /* RR_IO_URING_H_ */
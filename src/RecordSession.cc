@@ -2462,6 +2462,9 @@ RecordSession::RecordSession(const std::string& exe_path,
   }
 
   trace_out.set_bound_cpu(choose_cpu(bind_cpu, cpu_lock));
+  trace_out.place_compression_threads(
+      trace_out.bound_to_cpu(),
+      choose_compression_cpu(trace_out.bound_to_cpu(), cpu_lock), cpu_lock);
   do_bind_cpu();
   ScopedFd error_fd = create_spawn_task_error_pipe();
   RecordTask* t = static_cast<RecordTask*>(
@@ -3,17 +3,26 @@
 #include "ReplayCommand.h"
 
 #include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <iomanip>
 #include <limits>
+#include <map>
+#include <sstream>
 
 #include "Command.h"
+#include "ExportImportCheckpoints.h"
 #include "Flags.h"
 #include "GdbServer.h"
+#include "RecordSession.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
+#include "Tracepoint.h"
 #include "WaitManager.h"
 #include "core.h"
 #include "kernel_metadata.h"
@@ -74,7 +83,43 @@ ReplayCommand ReplayCommand::singleton(
     "  --serve-files              Serve all files from the trace rather than\n"
     "                             assuming they exist on disk. Debugging will\n"
     "                             be slower, but be able to tolerate missing files\n"
-    "  --tty <file>               Redirect tracee replay output to <file>\n");
+    "  --tty <file>               Redirect tracee replay output to <file>\n"
+    "  --emufs-dir=<DIR>          keep the contents of files that were mapped\n"
+    "                             shared during recording in <DIR> instead of\n"
+    "                             in memory. If <DIR> is on a filesystem with\n"
+    "                             reflinks (e.g. btrfs or XFS), checkpoints\n"
+    "                             share unmodified file data.\n"
+    "  --checkpoint-memory=<SIZE> limit the memory used by checkpoints taken\n"
+    "                             to speed up reverse execution to <SIZE>\n"
+    "                             bytes. K, M, G and T suffixes are accepted.\n"
+    "  --server                   replay the whole trace without a debugger,\n"
+    "                             keeping checkpoints along the way, then keep\n"
+    "                             running to serve them. Until this is killed,\n"
+    "                             'rr replay' of the same trace (with -g, -p\n"
+    "                             or -f, or none of them) gets its own copy of\n"
+    "                             the nearest checkpoint instead of replaying\n"
+    "                             from the start. Checkpoints are live\n"
+    "                             processes; nothing is saved to disk.\n"
+    "                             Replays given -q, -u, --tty, --emufs-dir,\n"
+    "                             --share-private-mappings, --reverse-jobs or\n"
+    "                             --checkpoint-memory don't use the server.\n"
+    "  --verify-jobs=<N>          with -a, split the trace into <N> segments\n"
+    "                             and verify them concurrently. Each segment\n"
+    "                             is replayed from a checkpoint and checked\n"
+    "                             against the state the next one starts from.\n"
+    "                             Tracee output is not replayed. Most useful\n"
+    "                             with -C, since memory checksums are then\n"
+    "                             only validated in the segment replays.\n"
+    "  --reverse-jobs=<N>         let reverse-continue search up to <N>\n"
+    "                             checkpoint intervals concurrently.\n"
+    "  --tracepoint=<LOC>:<FMT>   every time replay reaches <LOC> (an address\n"
+    "                             or executable symbol, optionally +offset),\n"
+    "                             print <FMT> without stopping. {expr} in <FMT>\n"
+    "                             prints a sum of registers and constants,\n"
+    "                             {expr:N} the N bytes at that address. Can be\n"
+    "                             repeated, and works with -a.\n"
+    "  --tracepoint-output=<FILE> append tracepoint records to <FILE> instead\n"
+    "                             of stdout.\n");
 
 struct ReplayFlags {
   // Start a debug server for the task scheduled at the first
@@ -135,6 +180,25 @@ struct ReplayFlags {
 
   string tty;
 
+  // Directory to back emulated shared files with, if any.
+  string emufs_dir;
+
+  // When nonzero, memory budget for reverse-execution checkpoints.
+  uint64_t checkpoint_memory_limit;
+
+  // Number of trace segments to verify concurrently in autopilot mode.
+  int verify_jobs;
+
+  // Number of processes reverse-continue may use to search for stops.
+  int reverse_jobs;
+
+  // Serve checkpoints to debugger clients.
+  bool server;
+
+  // Tracepoint specs, and where to write their records.
+  vector<string> tracepoints;
+  string tracepoint_output;
+
   ReplayFlags()
       : goto_event(0),
         singlestep_to_event(0),
@@ -149,9 +213,46 @@ struct ReplayFlags {
         cpu_unbound(false),
         share_private_mappings(false),
         dump_interval(0),
-        serve_files(false) {}
+        serve_files(false),
+        checkpoint_memory_limit(0),
+        verify_jobs(1),
+        reverse_jobs(0),
+        server(false) {}
 };
 
+// Parse e.g. "8G" into a byte count.
+static bool parse_memory_size(const string& value, uint64_t* out) {
+  char* end;
+  errno = 0;
+  unsigned long long size = strtoull(value.c_str(), &end, 10);
+  if (errno || end == value.c_str()) {
+    return false;
+  }
+  int shift = 0;
+  switch (*end) {
+    case 'T':
+      shift += 10;
+      RR_FALLTHROUGH;
+    case 'G':
+      shift += 10;
+      RR_FALLTHROUGH;
+    case 'M':
+      shift += 10;
+      RR_FALLTHROUGH;
+    case 'K':
+      shift += 10;
+      ++end;
+      break;
+    default:
+      break;
+  }
+  if (*end || size == 0 || size > (UINT64_MAX >> shift)) {
+    return false;
+  }
+  *out = uint64_t(size) << shift;
+  return true;
+}
+
 static bool parse_replay_arg(vector<string>& args, ReplayFlags& flags) {
   if (parse_global_option(args)) {
     return true;
@@ -176,6 +277,13 @@ static bool parse_replay_arg(vector<string>& args, ReplayFlags& flags) {
     { 2, "stats", HAS_PARAMETER },
     { 3, "serve-files", NO_PARAMETER },
     { 4, "tty", HAS_PARAMETER },
+    { 5, "emufs-dir", HAS_PARAMETER },
+    { 6, "checkpoint-memory", HAS_PARAMETER },
+    { 7, "verify-jobs", HAS_PARAMETER },
+    { 8, "reverse-jobs", HAS_PARAMETER },
+    { 9, "server", NO_PARAMETER },
+    { 10, "tracepoint", HAS_PARAMETER },
+    { 11, "tracepoint-output", HAS_PARAMETER },
     { 'u', "cpu-unbound", NO_PARAMETER },
     { 'i', "interpreter", HAS_PARAMETER }
   };
@@ -267,6 +375,41 @@ static bool parse_replay_arg(vector<string>& args, ReplayFlags& flags) {
     case 4:
       flags.tty = opt.value;
       break;
+    case 5:
+      flags.emufs_dir = opt.value;
+      break;
+    case 6:
+      if (!parse_memory_size(opt.value, &flags.checkpoint_memory_limit)) {
+        return false;
+      }
+      break;
+    case 7:
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.verify_jobs = opt.int_value;
+      break;
+    case 8:
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.reverse_jobs = opt.int_value;
+      break;
+    case 9:
+      flags.server = true;
+      break;
+    case 10: {
+      string error = Tracepoints().add(opt.value);
+      if (!error.empty()) {
+        fprintf(stderr, "%s: %s\n", error.c_str(), opt.value.c_str());
+        return false;
+      }
+      flags.tracepoints.push_back(opt.value);
+      break;
+    }
+    case 11:
+      flags.tracepoint_output = opt.value;
+      break;
     case 'u':
       flags.cpu_unbound = true;
       break;
@@ -344,6 +487,9 @@ static ReplaySession::Flags session_flags(const ReplayFlags& flags) {
   result.redirect_stdio_file = flags.tty;
   result.share_private_mappings = flags.share_private_mappings;
   result.cpu_unbound = flags.cpu_unbound;
+  result.emufs_dir = flags.emufs_dir;
+  result.checkpoint_memory_limit = flags.checkpoint_memory_limit;
+  result.reverse_continue_jobs = flags.reverse_jobs;
   return result;
 }
 
@@ -415,6 +561,218 @@ static void serve_replay_no_debugger(const string& trace_dir,
   LOG(info) << "Replayer successfully finished";
 }
 
+/**
+ * Autopilot replay that logs tracepoints. Breakpoints need a ReplayTimeline,
+ * so this can't share serve_replay_no_debugger's bare session loop.
+ */
+static void serve_replay_tracepoints(const string& trace_dir,
+                                     const ReplayFlags& flags) {
+  ReplaySession::shr_ptr replay_session =
+    ReplaySession::create(trace_dir, session_flags(flags));
+  ReplayTimeline timeline(replay_session);
+  Tracepoints tracepoints;
+  if (!flags.tracepoint_output.empty()) {
+    tracepoints.set_output(flags.tracepoint_output);
+  }
+  for (auto& spec : flags.tracepoints) {
+    tracepoints.add(spec);
+  }
+
+  while (true) {
+    tracepoints.install(timeline, timeline.current_session().current_task());
+    auto result = timeline.replay_step_forward(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED) {
+      break;
+    }
+    DEBUG_ASSERT(!result.break_status.breakpoint_hit);
+  }
+  tracepoints.clear(timeline);
+
+  LOG(info) << "Replayer successfully finished";
+}
+
+/**
+ * The state the replay is in when it reaches a segment boundary. Sent from
+ * the session that starts the next segment to the one that ends here.
+ */
+struct SegmentBoundary {
+  FrameTime time;
+  pid_t rec_tid;
+  Ticks ticks;
+  SupportedArch arch;
+  uint32_t regs_size;
+};
+
+static FrameTime last_frame_time(const string& trace_dir) {
+  TraceReader reader(trace_dir);
+  FrameTime last = 0;
+  while (!reader.at_end()) {
+    last = reader.read_frame().time();
+  }
+  return last;
+}
+
+/**
+ * Segments start at the first stop at or after their planned event where we
+ * can clone. The same test ends the previous segment, and since replay is
+ * deterministic both sessions stop at the same place.
+ */
+static bool at_segment_boundary(ReplaySession& session, FrameTime planned) {
+  return session.current_trace_frame().time() >= planned &&
+         session.done_initial_exec() && session.can_clone() &&
+         session.current_task();
+}
+
+static void send_segment_boundary(ReplaySession& session, ScopedFd& pipe) {
+  ReplayTask* t = session.current_task();
+  Registers::InternalData regs = t->regs().get_regs_for_trace();
+  SegmentBoundary boundary;
+  memset(&boundary, 0, sizeof(boundary));
+  boundary.time = session.current_trace_frame().time();
+  boundary.rec_tid = t->rec_tid;
+  boundary.ticks = t->tick_count();
+  boundary.arch = t->arch();
+  boundary.regs_size = regs.size;
+  write_all(pipe, &boundary, sizeof(boundary));
+  write_all(pipe, regs.data, regs.size);
+  pipe.close();
+}
+
+static void read_exactly(ScopedFd& fd, void* buf, size_t size) {
+  uint8_t* p = static_cast<uint8_t*>(buf);
+  while (size > 0) {
+    ssize_t ret = read(fd, p, size);
+    if (ret <= 0) {
+      FATAL() << "Lost contact with the replay of the next segment";
+    }
+    p += ret;
+    size -= ret;
+  }
+}
+
+static void check_segment_boundary(ReplaySession& session, ScopedFd& pipe) {
+  SegmentBoundary boundary;
+  read_exactly(pipe, &boundary, sizeof(boundary));
+  vector<uint8_t> data;
+  data.resize(boundary.regs_size);
+  read_exactly(pipe, data.data(), data.size());
+  Registers expected(boundary.arch);
+  expected.set_from_trace(boundary.arch, data.data(), data.size());
+
+  ReplayTask* t = session.current_task();
+  FrameTime time = session.current_trace_frame().time();
+  if (time != boundary.time || t->rec_tid != boundary.rec_tid ||
+      t->tick_count() != boundary.ticks) {
+    FATAL() << "Segment ended at event " << time << " in " << t->rec_tid
+            << " with " << t->tick_count() << " ticks, but the next segment "
+            << "started at event " << boundary.time << " in "
+            << boundary.rec_tid << " with " << boundary.ticks << " ticks";
+  }
+  Registers::Comparison comparison = t->regs().compare_with(expected);
+  if (comparison.mismatch_count) {
+    FATAL() << "Registers at the end of the segment ending at event " << time
+            << " don't match the start of the next segment: " << comparison;
+  }
+}
+
+/**
+ * Replay up to the start of the last of |flags.verify_jobs| evenly spaced
+ * segments, without memory checksum validation, cloning the session at each
+ * segment start. A forked rr takes over each clone and does the full
+ * verification of its segment, so the segments are verified concurrently
+ * while we just wait for them. Returns in the forked children too, with
+ * their own exit code.
+ */
+static int verify_in_parallel(const string& trace_dir,
+                              const ReplayFlags& flags) {
+  FrameTime last_time = last_frame_time(trace_dir);
+  // Tracee output from the segments would be interleaved, so drop it.
+  ReplaySession::Flags leader_flags = session_flags(flags);
+  leader_flags.redirect_stdio = false;
+  leader_flags.redirect_stdio_file.clear();
+  ReplaySession::shr_ptr session =
+      ReplaySession::create(trace_dir, leader_flags);
+  FrameTime checksum = Flags::get().checksum;
+  Flags::get_for_init().checksum = Flags::CHECKSUM_NONE;
+
+  vector<pid_t> workers;
+  // Pipe to the worker verifying the current segment.
+  ScopedFd current_segment_end;
+  // Where the worker verifying the current segment stops.
+  FrameTime next_boundary = 0;
+  int segment = 0;
+  while (segment < flags.verify_jobs) {
+    if (at_segment_boundary(*session, next_boundary)) {
+      if (current_segment_end.is_open()) {
+        send_segment_boundary(*session, current_segment_end);
+      }
+      ++segment;
+      // The last segment runs to the end of the trace.
+      bool last_segment = segment == flags.verify_jobs;
+      FrameTime segment_end = last_time * segment / flags.verify_jobs;
+      ScopedFd read_end;
+      if (!last_segment) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC)) {
+          FATAL() << "Can't create pipe";
+        }
+        read_end = ScopedFd(fds[0]);
+        current_segment_end = ScopedFd(fds[1]);
+      }
+
+      ReplaySession::shr_ptr checkpoint = session->clone();
+      pid_t child = fork_checkpoint(*checkpoint, { session.get() }, [&]() {
+        current_segment_end.close();
+        Flags::get_for_init().checksum = checksum;
+      });
+      if (!child) {
+        session = nullptr;
+        LOG(info) << "Verifying segment from event "
+                  << checkpoint->current_trace_frame().time();
+        while (true) {
+          if (!last_segment && at_segment_boundary(*checkpoint, segment_end)) {
+            check_segment_boundary(*checkpoint, read_end);
+            return 0;
+          }
+          if (checkpoint->replay_step(RUN_CONTINUE).status == REPLAY_EXITED) {
+            if (!last_segment) {
+              FATAL() << "Replay exited before the end of the segment";
+            }
+            return 0;
+          }
+        }
+      }
+      workers.push_back(child);
+      next_boundary = segment_end;
+      continue;
+    }
+    if (session->replay_step(RUN_CONTINUE).status == REPLAY_EXITED) {
+      FATAL() << "Replay exited before event " << next_boundary;
+    }
+  }
+  // The workers replay the rest of the trace; we don't need to.
+  session->kill_all_tasks();
+  session = nullptr;
+
+  int ret = 0;
+  for (pid_t child : workers) {
+    WaitResult result = WaitManager::wait_exit(WaitOptions(child));
+    if (result.code != WAIT_OK) {
+      FATAL() << "Failed to wait for child " << child;
+    }
+    if (result.status.type() != WaitStatus::EXIT ||
+        result.status.exit_code() != 0) {
+      LOG(error) << "Segment verifier " << child << " failed: "
+                 << result.status;
+      ret = 1;
+    }
+  }
+  if (!ret) {
+    LOG(info) << "Verified " << workers.size() << " segments";
+  }
+  return ret;
+}
+
 /* Handling ctrl-C during replay:
  * We want the entire group of processes to remain a single process group
  * since that allows shell job control to work best.
@@ -442,7 +800,7 @@ static void handle_SIGINT_in_child(int sig) {
   }
 }
 
-static int replay(const string& trace_dir, const ReplayFlags& flags) {
+static GdbServer::Target target_for(const ReplayFlags& flags) {
   GdbServer::Target target;
   switch (flags.process_created_how) {
     case ReplayFlags::CREATED_EXEC:
@@ -457,12 +815,328 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
       break;
   }
   target.event = flags.goto_event;
+  return target;
+}
+
+/**
+ * Where a replay server for the trace with |uuid| listens. This lives in the
+ * temporary directory rather than the trace, which may be read-only.
+ */
+static string replay_server_socket(const TraceUuid& uuid) {
+  stringstream ss;
+  ss << tmp_dir() << "/rr-server-" << hex << setfill('0');
+  for (uint8_t b : uuid.bytes) {
+    ss << setw(2) << (int)b;
+  }
+  ss << ".sock";
+  return ss.str();
+}
+
+/**
+ * The options in |flags| that change how a ReplaySession is set up. Sessions
+ * a replay server hands out were created with the defaults, so it can't
+ * honour these.
+ */
+static string session_options_given(const ReplayFlags& flags) {
+  ReplayFlags defaults;
+  vector<string> given;
+  if (flags.redirect != defaults.redirect) {
+    given.push_back("-q");
+  }
+  if (flags.share_private_mappings != defaults.share_private_mappings) {
+    given.push_back("--share-private-mappings");
+  }
+  if (flags.cpu_unbound != defaults.cpu_unbound) {
+    given.push_back("-u");
+  }
+  if (flags.tty != defaults.tty) {
+    given.push_back("--tty");
+  }
+  if (flags.emufs_dir != defaults.emufs_dir) {
+    given.push_back("--emufs-dir");
+  }
+  if (flags.checkpoint_memory_limit != defaults.checkpoint_memory_limit) {
+    given.push_back("--checkpoint-memory");
+  }
+  if (flags.reverse_jobs != defaults.reverse_jobs) {
+    given.push_back("--reverse-jobs");
+  }
+  string ret;
+  for (auto& g : given) {
+    ret += (ret.empty() ? "" : ", ") + g;
+  }
+  return ret;
+}
+
+static bool parse_replay_args(vector<string>& args, ReplayFlags& flags,
+                              string* trace_dir) {
+  bool found_dir = false;
+  while (!args.empty()) {
+    if (parse_replay_arg(args, flags)) {
+      continue;
+    }
+    if (Command::parse_literal(args, "--")) {
+      flags.gdb_options.insert(flags.gdb_options.end(), args.begin(),
+                               args.end());
+      break;
+    }
+    if (!found_dir && Command::parse_optional_trace_dir(args, trace_dir)) {
+      found_dir = true;
+      continue;
+    }
+    return false;
+  }
+  return true;
+}
+
+// The socket a replay server is listening on, for its signal handlers.
+static char server_socket_file_name[sizeof(sockaddr_un::sun_path)];
+static ino_t server_socket_ino;
+
+static void handle_exit_signal_in_server(int sig) {
+  // Don't remove a socket some newer server for the trace has bound.
+  struct stat st;
+  if (lstat(server_socket_file_name, &st) == 0 &&
+      st.st_ino == server_socket_ino) {
+    unlink(server_socket_file_name);
+  }
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static const int server_exit_signals[] = { SIGHUP, SIGINT, SIGTERM };
+
+/**
+ * Returns true if a debug server for process |pid| would stop as soon as it
+ * started in |checkpoint|, because the process already exists (and has
+ * exec()d, if |require_exec|).
+ */
+static bool target_process_exists(const ReplaySession& checkpoint, pid_t pid,
+                                  bool require_exec) {
+  for (auto& kv : checkpoint.tasks()) {
+    Task* t = kv.second;
+    if (t->tgid() == pid && (!require_exec || t->execed())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Replay the whole trace, checkpointing every |interval| events, then serve
+ * those checkpoints until we're killed. Only returns in a forked child, with
+ * the session a client asked for.
+ */
+static CommandForCheckpoint run_replay_server(const string& trace_dir,
+                                              const ReplayFlags& flags,
+                                              FrameTime interval) {
+  ReplaySession::Flags fresh_flags = session_flags(flags);
+  ReplaySession::shr_ptr session = ReplaySession::create(trace_dir, fresh_flags);
+  string dir = session->trace_reader().dir();
+  string socket_file_name = replay_server_socket(session->trace_reader().uuid());
+  map<FrameTime, ReplaySession::shr_ptr> checkpoints;
+  // The first checkpoint is where a debug server with no target would
+  // stop, so clients without one get their first prompt right away.
+  FrameTime next_checkpoint = 0;
+  while (true) {
+    FrameTime now = session->current_trace_frame().time();
+    if (now >= next_checkpoint && session->done_initial_exec() &&
+        session->can_clone() && session->current_task() &&
+        !session->current_step_key().in_execution()) {
+      LOG(debug) << "Taking checkpoint at event " << now;
+      checkpoints[now] = session->clone();
+      next_checkpoint = now + interval;
+    }
+    auto result = session->replay_step(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED) {
+      break;
+    }
+  }
+  session = nullptr;
+
+  // Don't bind the socket until we're ready; clients that find nothing
+  // listening replay from the start instead of waiting for us.
+  ScopedFd sock = bind_export_checkpoints_socket(SOMAXCONN, socket_file_name);
+  // Remove the socket when we're killed, so it doesn't pile up in the
+  // temporary directory.
+  struct stat st;
+  if (stat(socket_file_name.c_str(), &st) == 0) {
+    strcpy(server_socket_file_name, socket_file_name.c_str());
+    server_socket_ino = st.st_ino;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_exit_signal_in_server;
+    for (int sig : server_exit_signals) {
+      if (sigaction(sig, &sa, nullptr)) {
+        FATAL() << "Couldn't set sigaction for " << signal_name(sig);
+      }
+    }
+  }
+  fprintf(stderr, "rr: Serving %zu checkpoints of %s at %s\n",
+          checkpoints.size(), dir.c_str(), socket_file_name.c_str());
+
+  vector<ReplaySession*> owned_sessions;
+  for (auto& c : checkpoints) {
+    owned_sessions.push_back(c.second.get());
+  }
+  auto choose_checkpoint =
+      [&](const vector<string>& client_args) -> ReplaySession::shr_ptr {
+    ReplayFlags client_flags;
+    string client_trace_dir;
+    vector<string> a = client_args;
+    parse_replay_args(a, client_flags, &client_trace_dir);
+    pid_t pid = 0;
+    if (client_flags.process_created_how != ReplayFlags::CREATED_NONE) {
+      pid = client_flags.target_command.empty()
+                ? client_flags.target_process
+                : find_pid_for_command(dir, client_flags.target_command);
+    }
+    bool require_exec =
+        client_flags.process_created_how == ReplayFlags::CREATED_EXEC;
+
+    // The latest checkpoint that isn't past the target event, and where the
+    // target process hasn't been created yet.
+    auto it = checkpoints.end();
+    if (client_flags.goto_event > 0) {
+      it = checkpoints.upper_bound(client_flags.goto_event);
+    } else if (!pid && !checkpoints.empty()) {
+      it = next(checkpoints.begin());
+    }
+    while (it != checkpoints.begin()) {
+      --it;
+      if (!pid || !target_process_exists(*it->second, pid, require_exec)) {
+        LOG(info) << "Serving replay from event " << it->first;
+        return it->second->clone();
+      }
+    }
+    LOG(info) << "Serving replay from the start";
+    return ReplaySession::create(dir, fresh_flags);
+  };
+  CommandForCheckpoint command =
+      serve_checkpoints(sock, owned_sessions, choose_checkpoint);
+  // We're a forked child serving one client; the socket isn't ours.
+  for (int sig : server_exit_signals) {
+    signal(sig, SIG_DFL);
+  }
+  return command;
+}
+
+/**
+ * If an `rr replay --server` for this trace is serving checkpoints, have it run this replay from its nearest checkpoint.
+ * Returns false if no such server is running.
+ */
+static bool replay_from_server_checkpoint(const string& trace_dir,
+                                         const ReplayFlags& flags,
+                                         const vector<string>& args,
+                                         int* exit_code) {
+  // Autopilot and -e targets aren't worth it; they would replay to the end
+  // anyway.
+  if (flags.goto_event < 0 ||
+      flags.goto_event == numeric_limits<decltype(flags.goto_event)>::max() ||
+      flags.singlestep_to_event > 0 || flags.server) {
+    return false;
+  }
+  TraceUuid uuid;
+  if (!TraceReader::read_uuid(trace_dir, &uuid)) {
+    return false;
+  }
+  string socket_file_name = replay_server_socket(uuid);
+  struct stat st;
+  if (stat(socket_file_name.c_str(), &st) < 0 || !S_ISSOCK(st.st_mode)) {
+    return false;
+  }
+  string options = session_options_given(flags);
+  if (!options.empty()) {
+    fprintf(stderr,
+            "rr: Not using the replay server at %s, which can't apply %s.\n",
+            socket_file_name.c_str(), options.c_str());
+    return false;
+  }
+
+  if (flags.dont_launch_debugger) {
+    ScopedFd exit_notification_fd = send_checkpoint_command(
+        socket_file_name, args, vector<ScopedFd>(), false);
+    if (!exit_notification_fd.is_open()) {
+      return false;
+    }
+    *exit_code = wait_for_checkpoint_command(exit_notification_fd);
+    return true;
+  }
+
+  // The checkpoint's rr serves the debugger, and we exec it here so it gets
+  // our terminal.
+  int debugger_params_pipe[2];
+  if (pipe2(debugger_params_pipe, O_CLOEXEC)) {
+    FATAL() << "Couldn't open debugger params pipe.";
+  }
+  ScopedFd params_pipe_read_fd(debugger_params_pipe[0]);
+  vector<ScopedFd> fds;
+  fds.push_back(ScopedFd(debugger_params_pipe[1]));
+  ScopedFd exit_notification_fd =
+      send_checkpoint_command(socket_file_name, args, std::move(fds), false);
+  if (!exit_notification_fd.is_open()) {
+    return false;
+  }
+  LOG(info) << "Replaying from checkpoint served at " << socket_file_name;
+  GdbServer::launch_gdb(params_pipe_read_fd, flags.gdb_binary_file_path,
+                        flags.gdb_options, flags.serve_files);
+  // The server died before it could give us the debugger parameters.
+  *exit_code = wait_for_checkpoint_command(exit_notification_fd);
+  return true;
+}
+
+/**
+ * Run a replay that a client handed us along with a checkpoint.
+ */
+static int replay_checkpoint(CommandForCheckpoint& command_for_checkpoint,
+                             const ReplayFlags& flags,
+                             ScopedFd& exit_notification_fd) {
+  ReplaySession::shr_ptr session = std::move(command_for_checkpoint.session);
+  GdbServer::ConnectionFlags conn_flags;
+  conn_flags.dbg_port = flags.dbg_port;
+  conn_flags.dbg_host = flags.dbg_host;
+  conn_flags.serve_files = flags.serve_files;
+  conn_flags.tracepoints = flags.tracepoints;
+  conn_flags.tracepoint_output = flags.tracepoint_output;
+  ScopedFd debugger_params_write_pipe;
+  if (flags.dont_launch_debugger) {
+    conn_flags.debugger_name = flags.gdb_binary_file_path;
+    conn_flags.keep_listening = flags.keep_listening;
+  } else {
+    // The client execs the debugger, so nobody is waiting for our exit
+    // notification.
+    exit_notification_fd.close();
+    if (command_for_checkpoint.fds.empty()) {
+      FATAL() << "Missing debugger params pipe";
+    }
+    debugger_params_write_pipe = std::move(command_for_checkpoint.fds.front());
+    conn_flags.debugger_params_write_pipe = &debugger_params_write_pipe;
+  }
+  GdbServer(session, target_for(flags)).serve_replay(conn_flags);
+  return 0;
+}
+
+static int replay(const string& trace_dir, const ReplayFlags& flags,
+                  const vector<string>& args) {
+  GdbServer::Target target = target_for(flags);
+
+  int exit_code;
+  if (replay_from_server_checkpoint(trace_dir, flags, args, &exit_code)) {
+    return exit_code;
+  }
 
   // If we're not going to autolaunch the debugger, don't go
   // through the rigamarole to set that up.  All it does is
   // complicate the process tree and confuse users.
   if (flags.dont_launch_debugger) {
-    if (target.event == numeric_limits<decltype(target.event)>::max()) {
+    if (target.event == numeric_limits<decltype(target.event)>::max() &&
+        flags.verify_jobs > 1 && flags.tracepoints.empty()) {
+      return verify_in_parallel(trace_dir, flags);
+    }
+    if (target.event == numeric_limits<decltype(target.event)>::max() &&
+        !flags.tracepoints.empty()) {
+      serve_replay_tracepoints(trace_dir, flags);
+    } else if (target.event == numeric_limits<decltype(target.event)>::max()) {
       serve_replay_no_debugger(trace_dir, flags);
     } else {
       auto session = ReplaySession::create(trace_dir, session_flags(flags));
@@ -472,6 +1146,8 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
       conn_flags.debugger_name = flags.gdb_binary_file_path;
       conn_flags.keep_listening = flags.keep_listening;
       conn_flags.serve_files = flags.serve_files;
+      conn_flags.tracepoints = flags.tracepoints;
+      conn_flags.tracepoint_output = flags.tracepoint_output;
       GdbServer(session, target).serve_replay(conn_flags);
     }
 
@@ -499,6 +1175,8 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
       conn_flags.dbg_host = flags.dbg_host;
       conn_flags.debugger_params_write_pipe = &debugger_params_write_pipe;
       conn_flags.serve_files = flags.serve_files;
+      conn_flags.tracepoints = flags.tracepoints;
+      conn_flags.tracepoint_output = flags.tracepoint_output;
       if (target.event == -1 && target.pid == 0) {
         // If `replay -e` is specified without a pid, go to the exit
         // of the first process (rather than the first exit of a process).
@@ -557,25 +1235,15 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
   return 0;
 }
 
-int ReplayCommand::run(vector<string>& args) {
-  bool found_dir = false;
+// command_for_checkpoint is an in and out parameter.
+static int run_internal(CommandForCheckpoint& command_for_checkpoint,
+                        ScopedFd& exit_notification_fd) {
   string trace_dir;
   ReplayFlags flags;
+  vector<string> args = command_for_checkpoint.args;
 
-  while (!args.empty()) {
-    if (parse_replay_arg(args, flags)) {
-      continue;
-    }
-    if (parse_literal(args, "--")) {
-      flags.gdb_options.insert(flags.gdb_options.end(), args.begin(),
-                               args.end());
-      break;
-    }
-    if (!found_dir && parse_optional_trace_dir(args, &trace_dir)) {
-      found_dir = true;
-      continue;
-    }
-    print_help(stderr);
+  if (!parse_replay_args(args, flags, &trace_dir)) {
+    ReplayCommand::get()->print_help(stderr);
     return 1;
   }
 
@@ -588,6 +1256,11 @@ int ReplayCommand::run(vector<string>& args) {
       return 2;
     }
   }
+
+  if (command_for_checkpoint.session) {
+    return replay_checkpoint(command_for_checkpoint, flags,
+                             exit_notification_fd);
+  }
   if (flags.process_created_how != ReplayFlags::CREATED_NONE) {
     if (!pid_exists(trace_dir, flags.target_process)) {
       fprintf(stderr, "No process %d found in trace. Try 'rr ps'.\n",
@@ -604,7 +1277,14 @@ int ReplayCommand::run(vector<string>& args) {
   }
   if (flags.dump_interval > 0 && !flags.dont_launch_debugger) {
     fprintf(stderr, "--stats requires -a\n");
-    print_help(stderr);
+    ReplayCommand::get()->print_help(stderr);
+    return 2;
+  }
+  if (flags.verify_jobs > 1 &&
+      (flags.goto_event != numeric_limits<decltype(flags.goto_event)>::max() ||
+       flags.singlestep_to_event > 0 || flags.dump_interval > 0)) {
+    fprintf(stderr, "--verify-jobs requires -a, and not -t or --stats\n");
+    ReplayCommand::get()->print_help(stderr);
     return 2;
   }
 
@@ -629,7 +1309,35 @@ int ReplayCommand::run(vector<string>& args) {
     return 4;
   }
 
-  return replay(trace_dir, flags);
+  if (flags.server && !session_options_given(flags).empty()) {
+    fprintf(stderr, "--server can't be combined with %s\n",
+            session_options_given(flags).c_str());
+    ReplayCommand::get()->print_help(stderr);
+    return 2;
+  }
+  if (flags.server) {
+    command_for_checkpoint = run_replay_server(
+        trace_dir, flags, max<FrameTime>(1, last_frame_time(trace_dir) / 32));
+    return 0;
+  }
+
+  return replay(trace_dir, flags, command_for_checkpoint.args);
+}
+
+int ReplayCommand::run(vector<string>& args) {
+  CommandForCheckpoint command_for_checkpoint;
+  command_for_checkpoint.args = std::move(args);
+  while (true) {
+    ScopedFd exit_notification_fd =
+        std::move(command_for_checkpoint.exit_notification_fd);
+    int ret = run_internal(command_for_checkpoint, exit_notification_fd);
+    if (!command_for_checkpoint.session) {
+      if (exit_notification_fd.is_open()) {
+        notify_normal_exit(exit_notification_fd);
+      }
+      return ret;
+    }
+  }
 }
 
 } // namespace rr
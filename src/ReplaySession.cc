@@ -156,7 +156,7 @@ static void check_xsave_compatibility(const TraceReader& trace_in) {
 }
 
 ReplaySession::ReplaySession(const std::string& dir, const Flags& flags)
-    : emu_fs(EmuFs::create()),
+    : emu_fs(EmuFs::create(flags.emufs_dir)),
       trace_in(dir),
       trace_frame(),
       current_step(),
@@ -175,6 +175,10 @@ ReplaySession::ReplaySession(const std::string& dir, const Flags& flags)
   rrcall_base_ = trace_in.rrcall_base();
   syscallbuf_fds_disabled_size_ = trace_in.syscallbuf_fds_disabled_size();
 
+  if (!flags.emufs_dir.empty()) {
+    ensure_dir(flags.emufs_dir, "emulated file directory", S_IRWXU);
+  }
+
   if (!flags.redirect_stdio_file.empty()) {
     tracee_output_fd_ = make_shared<ScopedFd>(flags.redirect_stdio_file.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
     if (!tracee_output_fd_->is_open()) {
@@ -213,7 +217,7 @@ ReplaySession::ReplaySession(const std::string& dir, const Flags& flags)
 
 ReplaySession::ReplaySession(const ReplaySession& other)
     : Session(other),
-      emu_fs(EmuFs::create()),
+      emu_fs(EmuFs::create(other.emu_fs->backing_dir())),
       tracee_output_fd_(other.tracee_output_fd_),
       trace_in(other.trace_in),
       trace_frame(other.trace_frame),
@@ -300,6 +304,14 @@ DiversionSession::shr_ptr ReplaySession::clone_diversion() {
 
   copy_state_to(*session, emufs(), session->emufs());
   session->finish_initializing();
+  // Diversions can't handle software watchpoint faults, so give the pages
+  // their original protection back.
+  for (AddressSpace* vm : session->vms()) {
+    Task* t = vm->first_running_task();
+    if (t) {
+      vm->clear_software_watchpoints(t);
+    }
+  }
 
   return session;
 }
@@ -465,6 +477,77 @@ bool ReplaySession::handle_unrecorded_cpuid_fault(
   return true;
 }
 
+static bool is_software_watchpoint_fault(ReplayTask* t) {
+  if (t->stop_sig() != SIGSEGV) {
+    return false;
+  }
+  const siginfo_t& si = t->get_siginfo();
+  return si.si_code == SEGV_ACCERR &&
+         t->vm()->is_software_watchpoint_page(
+             remote_ptr<void>((uintptr_t)si.si_addr));
+}
+
+/**
+ * The tracee wrote to a page we write-protected for software watchpoints.
+ * Step the write with the page(s) writable, then recheck only the watchpoints
+ * on those pages. If one changed, leave the SIGTRAP of the step as the status
+ * so it's diagnosed like a hardware watchpoint hit; otherwise the fault is
+ * invisible and the status is cleared (unless we were singlestepping anyway).
+ * If the task has already reached |constraints.ticks_target|, the write isn't
+ * stepped, since it could run past the target; the caller sees the ticks
+ * target as approaching and handles it like any other stop there.
+ */
+bool ReplaySession::handle_software_watchpoint_fault(
+    ReplayTask* t, const StepConstraints& constraints) {
+  if (!is_software_watchpoint_fault(t)) {
+    return false;
+  }
+
+  if (constraints.ticks_target > 0 &&
+      t->tick_count() >= constraints.ticks_target) {
+    LOG(debug) << "Software watchpoint fault at ticks target; not stepping";
+    t->set_status(constraints.is_singlestep()
+                      ? WaitStatus::for_stop_sig(SIGTRAP)
+                      : WaitStatus());
+    return true;
+  }
+
+  // An instruction can write across a page boundary, in which case the step
+  // faults again on the next page. Keep unprotecting until it completes.
+  vector<remote_ptr<void>> pages;
+  while (is_software_watchpoint_fault(t)) {
+    remote_ptr<void> page = floor_page_size(
+        remote_ptr<void>((uintptr_t)t->get_siginfo().si_addr));
+    if (find(pages.begin(), pages.end(), page) != pages.end()) {
+      break;
+    }
+    pages.push_back(page);
+    LOG(debug) << "Stepping write to software watchpoint page " << page;
+    t->vm()->unprotect_software_watchpoint_page(t, page);
+    bool ok = t->resume_execution(RESUME_SINGLESTEP, RESUME_WAIT_NO_EXIT,
+                                  RESUME_UNLIMITED_TICKS);
+    ASSERT(t, ok) << "Tracee died unexpectedly";
+  }
+  bool fired = false;
+  for (auto page : pages) {
+    t->vm()->protect_software_watchpoint_page(t, page);
+    fired |= t->vm()->notify_software_watchpoint_write(page);
+  }
+
+  if (t->stop_sig() != SIGTRAP) {
+    // The step raised a real signal; let the caller deal with it.
+    return false;
+  }
+  if (is_x86ish(t->arch()) && (t->x86_debug_status() & DS_WATCHPOINT_ANY)) {
+    // A hardware watchpoint fired in the same instruction.
+    fired = true;
+  }
+  if (!fired && !constraints.is_singlestep()) {
+    t->set_status(WaitStatus());
+  }
+  return true;
+}
+
 /**
  * Continue until reaching either the "entry" of an emulated syscall,
  * or the entry or exit of an executed syscall.  |emu| is nonzero when
@@ -484,6 +567,7 @@ Completion ReplaySession::cont_syscall_boundary(
     }
   }
 
+  t->vm()->refresh_software_watchpoints(t);
   if (constraints.command == RUN_SINGLESTEP_FAST_FORWARD) {
     // ignore ticks_period. We can't add more than one tick during a
     // fast_forward so it doesn't matter.
@@ -507,6 +591,9 @@ Completion ReplaySession::cont_syscall_boundary(
       if (handle_unrecorded_cpuid_fault(t, constraints)) {
         return INCOMPLETE;
       }
+      if (handle_software_watchpoint_fault(t, constraints)) {
+        return INCOMPLETE;
+      }
       break;
     case SIGTRAP:
       return INCOMPLETE;
@@ -716,14 +803,19 @@ Completion ReplaySession::continue_or_step(ReplayTask* t,
                                            const StepConstraints& constraints,
                                            TicksRequest tick_request,
                                            ResumeRequest resume_how) {
+  t->vm()->refresh_software_watchpoints(t);
   if (constraints.command == RUN_SINGLESTEP) {
     bool ok = t->resume_execution(RESUME_SINGLESTEP, RESUME_WAIT_NO_EXIT, tick_request);
     ASSERT(t, ok) << "Tracee died unexpectedly";
-    handle_unrecorded_cpuid_fault(t, constraints);
+    if (!handle_unrecorded_cpuid_fault(t, constraints)) {
+      handle_software_watchpoint_fault(t, constraints);
+    }
   } else if (constraints.command == RUN_SINGLESTEP_FAST_FORWARD) {
     fast_forward_status |= fast_forward_through_instruction(
         t, RESUME_SINGLESTEP, constraints.stop_before_states);
-    handle_unrecorded_cpuid_fault(t, constraints);
+    if (!handle_unrecorded_cpuid_fault(t, constraints)) {
+      handle_software_watchpoint_fault(t, constraints);
+    }
   } else {
     bool ok = t->resume_execution(resume_how, RESUME_WAIT_NO_EXIT, tick_request);
     ASSERT(t, ok) << "Tracee died unexpectedly";
@@ -757,6 +849,9 @@ Completion ReplaySession::continue_or_step(ReplayTask* t,
       }
     } else if (handle_unrecorded_cpuid_fault(t, constraints)) {
       return INCOMPLETE;
+    } else if (handle_software_watchpoint_fault(t, constraints) &&
+               !t->stop_sig()) {
+      return INCOMPLETE;
     }
   }
   check_pending_sig(t);
@@ -1882,6 +1977,45 @@ bool ReplaySession::next_step_is_successful_exec_syscall_exit() {
          !trace_frame.regs().syscall_failed();
 }
 
+/**
+ * If |constraints.breakpoint_filter| rejects the breakpoint stop described
+ * by |break_status|, step over the breakpoint and resume the current trace
+ * step. Returns true if that happened, with |*completion| set to the step's
+ * new status. Returns false if the caller must report |break_status|; that
+ * may be a watchpoint hit by the stepped-over instruction.
+ */
+bool ReplaySession::resume_past_filtered_breakpoint(
+    ReplayTask* t, const StepConstraints& constraints, BreakStatus& break_status,
+    Completion* completion) {
+  if (!constraints.breakpoint_filter || constraints.command != RUN_CONTINUE ||
+      !break_status.breakpoint_hit || !break_status.watchpoints_hit.empty() ||
+      break_status.approaching_ticks_target || break_status.task_exit ||
+      constraints.breakpoint_filter(t)) {
+    return false;
+  }
+
+  LOG(debug) << "  breakpoint at " << t->ip() << " filtered; resuming";
+  remote_code_ptr addr = t->ip();
+  t->vm()->suspend_breakpoint_at(addr);
+  Completion stepped = try_one_trace_step(t, StepConstraints(RUN_SINGLESTEP));
+  t->vm()->restore_breakpoint_at(addr);
+
+  break_status = BreakStatus();
+  break_status.task_context = TaskContext(t);
+  if (stepped == INCOMPLETE &&
+      EV_TRACE_TERMINATION != trace_frame.event().type()) {
+    break_status = diagnose_debugger_trap(t, RUN_SINGLESTEP);
+    // Our singlestep is an implementation detail.
+    break_status.singlestep_complete = false;
+    if (break_status.any_break()) {
+      return false;
+    }
+    stepped = try_one_trace_step(t, constraints);
+  }
+  *completion = stepped;
+  return true;
+}
+
 ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
   finish_initializing();
 
@@ -1916,7 +2050,8 @@ ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
   result.break_status.task_context = TaskContext(t);
 
   /* Advance towards fulfilling |current_step|. */
-  if (try_one_trace_step(t, constraints) == INCOMPLETE) {
+  Completion completion = try_one_trace_step(t, constraints);
+  while (completion == INCOMPLETE) {
     if (EV_TRACE_TERMINATION == trace_frame.event().type()) {
       // An irregular trace step had to read the
       // next trace frame, and that frame was an
@@ -1937,6 +2072,10 @@ ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
                constraints.is_singlestep());
 
     check_approaching_ticks_target(t, constraints, result.break_status);
+    if (resume_past_filtered_breakpoint(t, constraints, result.break_status,
+                                        &completion)) {
+      continue;
+    }
     result.did_fast_forward = fast_forward_status.did_fast_forward;
     result.incomplete_fast_forward = fast_forward_status.incomplete_fast_forward;
     return result;
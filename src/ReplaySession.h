@@ -3,6 +3,7 @@
 #ifndef RR_REPLAY_SESSION_H_
 #define RR_REPLAY_SESSION_H_
 
+#include <functional>
 #include <memory>
 #include <set>
 
@@ -241,13 +242,24 @@ public:
       : redirect_stdio(false)
       , share_private_mappings(false)
       , replay_stops_at_first_execve(false)
-      , cpu_unbound(false) {}
+      , cpu_unbound(false)
+      , checkpoint_memory_limit(0)
+      , reverse_continue_jobs(0) {}
     Flags(const Flags&) = default;
     bool redirect_stdio;
     std::string redirect_stdio_file;
     bool share_private_mappings;
     bool replay_stops_at_first_execve;
     bool cpu_unbound;
+    // If nonempty, emulated shared files are backed by files in this
+    // directory rather than by shared memory.
+    std::string emufs_dir;
+    // If nonzero, the number of bytes of memory that automatic reverse-exec
+    // checkpoints may pin.
+    uint64_t checkpoint_memory_limit;
+    // If greater than 1, the number of processes reverse-continue may use
+    // to search for stops.
+    int reverse_continue_jobs;
   };
 
   /**
@@ -266,6 +278,11 @@ public:
     // RUN_SINGLESTEP_FAST_FORWARD will always singlestep at least once
     // regardless.
     std::vector<const Registers*> stop_before_states;
+    // When the RunCommand is RUN_CONTINUE and the step stops only because
+    // the task hit a software breakpoint, this is called at the trap. If it
+    // returns false, replay steps over the breakpoint and carries on without
+    // returning, so false conditions don't cost a full stop.
+    std::function<bool(ReplayTask* t)> breakpoint_filter;
 
     bool is_singlestep() const {
       return command == RUN_SINGLESTEP ||
@@ -367,6 +384,8 @@ private:
   Completion exit_task(ReplayTask* t);
   bool handle_unrecorded_cpuid_fault(ReplayTask* t,
                                      const StepConstraints& constraints);
+  bool handle_software_watchpoint_fault(ReplayTask* t,
+                                        const StepConstraints& constraints);
   void check_ticks_consistency(ReplayTask* t, const Event& ev);
   void check_pending_sig(ReplayTask* t);
   Completion continue_or_step(ReplayTask* t, const StepConstraints& constraints,
@@ -391,6 +410,10 @@ private:
   void check_approaching_ticks_target(ReplayTask* t,
                                       const StepConstraints& constraints,
                                       BreakStatus& break_status);
+  bool resume_past_filtered_breakpoint(ReplayTask* t,
+                                       const StepConstraints& constraints,
+                                       BreakStatus& break_status,
+                                       Completion* completion);
 
   void clear_syscall_bp();
 
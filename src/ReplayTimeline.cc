@@ -2,12 +2,21 @@
 
 #include "ReplayTimeline.h"
 
+#include <fcntl.h>
 #include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <sstream>
 
+#include "ExportImportCheckpoints.h"
+#include "WaitManager.h"
 #include "core.h"
 #include "fast_forward.h"
 #include "log.h"
+#include "util.h"
 
 using namespace std;
 
@@ -80,7 +89,10 @@ bool ReplayTimeline::less_than(const Mark& m1, const Mark& m2) {
 ReplayTimeline::ReplayTimeline(std::shared_ptr<ReplaySession> session)
     : current(std::move(session)),
       breakpoints_applied(false),
-      reverse_execution_barrier_event_(0) {
+      reverse_execution_barrier_event_(0),
+      replay_seconds_sample(0),
+      replay_progress_sample(0),
+      reverse_continue_span(1) {
   current->set_visible_execution(false);
 }
 
@@ -280,6 +292,13 @@ ReplayTimeline::Mark ReplayTimeline::lazy_reverse_singlestep(const Mark& from,
     return Mark();
   }
   Mark m = find_singlestep_before(from);
+  if (!m) {
+    // Steps that changed the MarkKey aren't adjacent in the mark vectors.
+    auto it = singlestep_history.find(from.ptr.get());
+    if (it != singlestep_history.end() && it->second.tuid == t->tuid()) {
+      m = it->second.previous;
+    }
+  }
   if (m && m >= no_watchpoints_hit_interval_start &&
       m < no_watchpoints_hit_interval_end &&
       !has_breakpoint_at_address(t, from.ptr->proto.regs.ip())) {
@@ -288,6 +307,90 @@ ReplayTimeline::Mark ReplayTimeline::lazy_reverse_singlestep(const Mark& from,
   return Mark();
 }
 
+/**
+ * How much of the stack to snapshot for each singlestep history entry:
+ * the x86-64 red zone below the stack pointer and the start of the frame
+ * above it, which is what a debugger reads to identify the frame.
+ */
+static const size_t stack_snapshot_below_sp = 128;
+static const size_t stack_snapshot_above_sp = 1024;
+/**
+ * Drop the singlestep history when it grows beyond this many states.
+ */
+static const size_t singlestep_history_limit = 4096;
+/**
+ * reverse_singlestep singlesteps through roughly this many ticks before the
+ * destination, recording each state, so that a run of reverse-singlesteps
+ * can mostly be served from the history.
+ */
+static const Ticks singlestep_history_ticks = 16;
+
+void ReplayTimeline::record_singlestep_state(const Mark& m, ReplayTask* t) {
+  if (singlestep_history.size() >= singlestep_history_limit &&
+      !singlestep_history.count(m.ptr.get())) {
+    singlestep_history.clear();
+  }
+  SinglestepHistoryEntry& entry = singlestep_history[m.ptr.get()];
+  remote_ptr<void> sp = t->regs().sp();
+  if (entry.stack_start || !t->vm()->has_mapping(sp)) {
+    return;
+  }
+  const KernelMapping& map = t->vm()->mapping_of(sp).map;
+  remote_ptr<void> start = sp - min<uintptr_t>(stack_snapshot_below_sp,
+                                               sp - map.start());
+  remote_ptr<void> end = sp + min<uintptr_t>(stack_snapshot_above_sp,
+                                             map.end() - sp);
+  entry.stack.resize(end - start);
+  ssize_t nread = t->read_bytes_fallible(start, entry.stack.size(),
+                                         entry.stack.data());
+  entry.stack.resize(max<ssize_t>(0, nread));
+  entry.stack_start = start;
+}
+
+void ReplayTimeline::record_singlestep(const Mark& from, const Mark& to,
+                                       ReplayTask* t) {
+  record_singlestep_state(to, t);
+  SinglestepHistoryEntry& entry = singlestep_history[to.ptr.get()];
+  entry.previous = from;
+  entry.tuid = t->tuid();
+}
+
+bool ReplayTimeline::lazy_read_memory(const Mark& m, ReplayTask* t,
+                                      remote_ptr<void> addr, size_t len,
+                                      vector<uint8_t>* out) {
+  auto it = singlestep_history.find(m.ptr.get());
+  if (it != singlestep_history.end() && it->second.stack_start &&
+      addr >= it->second.stack_start &&
+      addr + len <= it->second.stack_start + it->second.stack.size()) {
+    const uint8_t* p = it->second.stack.data() + (addr - it->second.stack_start);
+    out->assign(p, p + len);
+  } else {
+    // Mappings and their protections only change at events, so within
+    // the same event, memory that isn't writable is the same as now.
+    if (m.ptr->proto.key.trace_time != current->trace_reader().time()) {
+      return false;
+    }
+    remote_ptr<void> p = addr;
+    while (p < addr + len) {
+      if (!t->vm()->has_mapping(p)) {
+        return false;
+      }
+      const KernelMapping& map = t->vm()->mapping_of(p).map;
+      if (map.prot() & PROT_WRITE) {
+        return false;
+      }
+      p = map.end();
+    }
+    out->resize(len);
+    if (t->read_bytes_fallible(addr, len, out->data()) != ssize_t(len)) {
+      return false;
+    }
+  }
+  t->vm()->replace_breakpoints_with_original_values(out->data(), out->size(),
+                                                    addr.cast<uint8_t>());
+  return true;
+}
+
 ReplayTimeline::Mark ReplayTimeline::add_explicit_checkpoint() {
   DEBUG_ASSERT(current->can_clone());
 
@@ -726,6 +829,29 @@ bool ReplayTimeline::has_watchpoint_at_address(ReplayTask* t,
          get<1>(*it) == addr && get<2>(*it) == num_bytes && get<3>(*it) == type;
 }
 
+bool ReplayTimeline::add_tracepoint(
+    ReplayTask* t, remote_code_ptr addr,
+    std::unique_ptr<BreakpointCondition> tracepoint) {
+  apply_breakpoints_and_watchpoints();
+  if (!t->vm()->add_breakpoint(addr, BKPT_USER)) {
+    return false;
+  }
+  tracepoints.insert(make_tuple(t->vm()->uid(), addr, std::move(tracepoint)));
+  return true;
+}
+
+void ReplayTimeline::remove_tracepoints() {
+  if (breakpoints_applied) {
+    for (auto& tp : tracepoints) {
+      AddressSpace* vm = current->find_address_space(get<0>(tp));
+      if (vm) {
+        vm->remove_breakpoint(get<1>(tp), BKPT_USER);
+      }
+    }
+  }
+  tracepoints.clear();
+}
+
 void ReplayTimeline::remove_breakpoints_and_watchpoints() {
   unapply_breakpoints_and_watchpoints();
   breakpoints.clear();
@@ -742,6 +868,12 @@ void ReplayTimeline::apply_breakpoints_internal() {
       vm->add_breakpoint(get<1>(bp), BKPT_USER);
     }
   }
+  for (auto& tp : tracepoints) {
+    AddressSpace* vm = current->find_address_space(get<0>(tp));
+    if (vm) {
+      vm->add_breakpoint(get<1>(tp), BKPT_USER);
+    }
+  }
   for (auto& wp : watchpoints) {
     AddressSpace* vm = current->find_address_space(get<0>(wp));
     if (vm && get<3>(wp) == WATCH_EXEC) {
@@ -770,6 +902,12 @@ void ReplayTimeline::apply_breakpoints_and_watchpoints() {
 }
 
 void ReplayTimeline::unapply_breakpoints_internal() {
+  for (auto& tp : tracepoints) {
+    AddressSpace* vm = current->find_address_space(get<0>(tp));
+    if (vm) {
+      vm->remove_breakpoint(get<1>(tp), BKPT_USER);
+    }
+  }
   for (auto& bp : breakpoints) {
     AddressSpace* vm = current->find_address_space(get<0>(bp));
     if (vm) {
@@ -940,6 +1078,207 @@ static bool arch_watch_fires_before_instr(SupportedArch arch) {
   }
 }
 
+/**
+ * Never let a parallel reverse-continue job search more than this many
+ * checkpoint intervals.
+ */
+static const int max_reverse_continue_span = 16;
+
+bool ReplayTimeline::interval_has_stop(
+    const Mark& end,
+    const std::function<bool(ReplayTask* t, const BreakStatus &)>& stop_filter,
+    const std::function<bool()>& interrupt_check) {
+  bool at_breakpoint = false;
+  ReplayStepToMarkStrategy strategy;
+  while (true) {
+    ReplayResult result;
+    if (at_breakpoint) {
+      result = singlestep_with_breakpoints_disabled();
+    } else {
+      apply_breakpoints_and_watchpoints();
+      result = replay_step_to_mark(end, strategy);
+    }
+    at_breakpoint = result.break_status.hardware_or_software_breakpoint_hit();
+    evaluate_conditions(result);
+    if (result.break_status.any_break() &&
+        !stop_filter(to_replay_task(result.break_status), result.break_status)) {
+      result.break_status = BreakStatus();
+    }
+    // These mirror the stops reverse_continue looks for.
+    if (!result.break_status.data_watchpoints_hit().empty() ||
+        result.break_status.signal ||
+        is_start_of_reverse_execution_barrier_event()) {
+      return true;
+    }
+    if (at_mark(end)) {
+      return false;
+    }
+    if (result.break_status.hardware_or_software_breakpoint_hit()) {
+      return true;
+    }
+    if (interrupt_check()) {
+      return false;
+    }
+  }
+}
+
+/**
+ * While waiting for parallel reverse-continue searches, check for an
+ * interrupt this often.
+ */
+static const int interrupt_poll_ms = 20;
+
+bool ReplayTimeline::seek_to_latest_interval_with_stop(
+    Mark& end,
+    const std::function<bool(ReplayTask* t, const BreakStatus &)>& stop_filter,
+    const std::function<bool()>& interrupt_check, bool* interrupted) {
+  int jobs = current->flags().reverse_continue_jobs;
+  if (jobs <= 1) {
+    return false;
+  }
+
+  while (true) {
+    // Interval i runs from starts[i] to starts[i - 1] (or |end|).
+    vector<Mark> starts;
+    int skipped = 0;
+    for (auto it = reverse_exec_checkpoints.rbegin();
+         it != reverse_exec_checkpoints.rend() && int(starts.size()) < jobs;
+         ++it) {
+      if (!(it->first < end) || !it->first.ptr->checkpoint) {
+        continue;
+      }
+      if (++skipped == reverse_continue_span) {
+        starts.push_back(it->first);
+        skipped = 0;
+      }
+    }
+    if (starts.size() < 2) {
+      // Not worth forking for; search serially.
+      return false;
+    }
+
+    LOG(info) << "Searching " << starts.size()
+              << " intervals in parallel back from " << end;
+    // Closing our end of this pipe tells the searches to give up.
+    int cancel_fds[2];
+    if (pipe2(cancel_fds, O_CLOEXEC)) {
+      FATAL() << "Can't create pipe";
+    }
+    ScopedFd cancel_read(cancel_fds[0]);
+    ScopedFd cancel_write(cancel_fds[1]);
+    vector<pid_t> children;
+    vector<ScopedFd> results;
+    for (size_t i = 0; i < starts.size(); ++i) {
+      Mark interval_end = i ? starts[i - 1] : end;
+      int fds[2];
+      if (pipe2(fds, O_CLOEXEC)) {
+        FATAL() << "Can't create pipe";
+      }
+      ScopedFd read_end(fds[0]);
+      ScopedFd write_end(fds[1]);
+      ReplaySession::shr_ptr session = starts[i].ptr->checkpoint->clone();
+      pid_t child = fork_checkpoint(*session, vector<ReplaySession*>(), [&]() {
+        results.clear();
+        read_end.close();
+        cancel_write.close();
+      });
+      if (!child) {
+        // Our copies of the parent's sessions belong to the parent. We _exit
+        // so their destructors never run, and we make sure seeking only ever
+        // uses our own checkpoint at the start of the interval.
+        vector<ReplaySession::shr_ptr> parents_sessions;
+        parents_sessions.push_back(std::move(current));
+        const MarkKey& start_key = starts[i].ptr->proto.key;
+        for (auto& m : marks[start_key]) {
+          if (m->checkpoint) {
+            parents_sessions.push_back(std::move(m->checkpoint));
+          }
+        }
+        marks_with_checkpoints.clear();
+        marks_with_checkpoints[start_key] = 1;
+        starts[i].ptr->checkpoint = session->clone();
+        current = session;
+        breakpoints_applied = false;
+        // Tracepoints never stop, so they can't affect the search. Drop them
+        // so the search doesn't write records the parent doesn't know about.
+        tracepoints.clear();
+        current_at_or_after_mark = starts[i].ptr;
+        auto cancelled = [&]() {
+          struct pollfd pfd = { cancel_read, POLLIN, 0 };
+          return poll(&pfd, 1, 0) > 0;
+        };
+        char found = interval_has_stop(interval_end, stop_filter, cancelled);
+        write_all(write_end, &found, 1);
+        current->kill_all_tasks();
+        _exit(0);
+      }
+      children.push_back(child);
+      results.push_back(std::move(read_end));
+    }
+
+    cancel_read.close();
+
+    // Collect results latest interval first. The first interval with a stop
+    // is the answer, whatever the earlier intervals' searches find.
+    ssize_t found_interval = -1;
+    bool was_interrupted = false;
+    for (size_t i = 0; i < children.size(); ++i) {
+      char found = 0;
+      while (!was_interrupted) {
+        struct pollfd pfd = { results[i], POLLIN, 0 };
+        if (poll(&pfd, 1, interrupt_poll_ms) > 0) {
+          break;
+        }
+        if (interrupt_check()) {
+          LOG(debug) << "Interrupted parallel reverse-continue search";
+          was_interrupted = true;
+          cancel_write.close();
+        }
+      }
+      if (read(results[i], &found, 1) != 1) {
+        FATAL() << "Reverse-continue search process " << children[i]
+                << " failed";
+      }
+      if (found) {
+        found_interval = i;
+        break;
+      }
+    }
+    if (found_interval >= 0) {
+      // Don't wait for the searches of earlier intervals to finish. Their
+      // tracees die with them (PTRACE_O_EXITKILL).
+      for (size_t i = found_interval + 1; i < children.size(); ++i) {
+        kill(children[i], SIGKILL);
+      }
+    }
+    for (pid_t child : children) {
+      WaitResult result = WaitManager::wait_exit(WaitOptions(child));
+      if (result.code != WAIT_OK) {
+        FATAL() << "Failed to wait for child " << child;
+      }
+    }
+
+    if (was_interrupted) {
+      *interrupted = true;
+      return false;
+    }
+    if (found_interval >= 0) {
+      reverse_continue_span = max(1, reverse_continue_span / 2);
+      if (found_interval > 0) {
+        end = starts[found_interval - 1];
+      }
+      seek_to_mark(starts[found_interval]);
+      LOG(debug) << "Found stop in interval from " << starts[found_interval]
+                 << " to " << end;
+      return true;
+    }
+    // Nothing in any of them. Look further back, in longer intervals.
+    reverse_continue_span =
+        min(max_reverse_continue_span, reverse_continue_span * 2);
+    end = starts.back();
+  }
+}
+
 ReplayResult ReplayTimeline::reverse_continue(
     const std::function<bool(ReplayTask* t, const BreakStatus &)>& stop_filter,
     const std::function<bool()>& interrupt_check) {
@@ -960,6 +1299,21 @@ ReplayResult ReplayTimeline::reverse_continue(
     if (start >= end) {
       checkpoint_at_first_break = true;
       if (restart_points.empty()) {
+        bool interrupted = false;
+        if (seek_to_latest_interval_with_stop(end, stop_filter,
+                                              interrupt_check, &interrupted)) {
+          start = mark();
+          LOG(debug) << "Parallel search sent us back from " << end << " to "
+                     << start;
+          continue;
+        }
+        if (interrupted) {
+          seek_to_mark(end);
+          final_result = ReplayResult();
+          final_result.break_status.task_context =
+              TaskContext(current->current_task());
+          return final_result;
+        }
         seek_to_before_key(end.ptr->proto.key);
         start = mark();
         if (start >= end) {
@@ -1179,7 +1533,9 @@ ReplayResult ReplayTimeline::reverse_singlestep(
   LOG(debug) << "ReplayTimeline::reverse_singlestep from " << origin;
 
   Mark outer = origin;
-  Ticks ticks_target = step_ticks - 1;
+  Ticks ticks_target = step_ticks > singlestep_history_ticks
+                           ? step_ticks - singlestep_history_ticks
+                           : 0;
 
   while (true) {
     Mark end = outer;
@@ -1296,6 +1652,7 @@ ReplayResult ReplayTimeline::reverse_singlestep(
         apply_breakpoints_and_watchpoints();
         if (current->current_task()->tuid() == step_tuid) {
           Mark before_step = mark();
+          record_singlestep_state(before_step, current->current_task());
           ReplaySession::StepConstraints constraints(
               RUN_SINGLESTEP_FAST_FORWARD);
           constraints.stop_before_states.push_back(&end.ptr->proto.regs);
@@ -1312,6 +1669,9 @@ ReplayResult ReplayTimeline::reverse_singlestep(
           }
           if (result.break_status.singlestep_complete) {
             mark_after_singlestep(before_step, result);
+            if (!result.did_fast_forward && !result.break_status.signal) {
+              record_singlestep(before_step, now, current->current_task());
+            }
             if (now > end) {
               // This last step is not usable.
               LOG(debug) << "   not usable, stopping now";
@@ -1399,30 +1759,415 @@ ReplayResult ReplayTimeline::reverse_singlestep(
   }
 }
 
-void ReplayTimeline::evaluate_conditions(ReplayResult& result) {
-  ReplayTask* t = to_replay_task(result.break_status);
-  if (!t) {
-    return;
+/**
+ * If 't' just executed a call instruction, starting in state 'before',
+ * returns the call's return address. Otherwise returns null.
+ */
+static remote_code_ptr return_address_of_call(ReplayTask* t,
+                                              const Registers& before) {
+  const Registers& regs = t->regs();
+  if (t->arch() == aarch64) {
+    // BL and BLR set the link register to the next instruction.
+    remote_code_ptr next = before.ip() + 4;
+    if (regs.xlr() == next.register_value() && regs.ip() != next) {
+      return next;
+    }
+    return nullptr;
+  }
+  // A call pushes the address of the next instruction, which is at most
+  // 15 bytes further on.
+  if (regs.sp() != before.sp() - word_size(t->arch())) {
+    return nullptr;
+  }
+  remote_code_ptr next(ReturnAddressList(t).addresses[0].as_int());
+  if (next > before.ip() && next - before.ip() <= 15 && regs.ip() != next) {
+    return next;
   }
+  return nullptr;
+}
 
-  auto auid = t->vm()->uid();
+namespace {
 
-  if (result.break_status.breakpoint_hit) {
-    auto addr = t->ip();
-    auto it = breakpoints.lower_bound(make_tuple(auid, addr, nullptr));
-    bool hit = false;
-    while (it != breakpoints.end() && get<0>(*it) == auid &&
-           get<1>(*it) == addr) {
-      const unique_ptr<BreakpointCondition>& cond = get<2>(*it);
-      if (!cond || cond->evaluate(t)) {
-        hit = true;
+struct FrameStepState {
+  ReplayTimeline::Mark mark;
+  remote_code_ptr ip;
+};
+
+/**
+ * A frame entered by a call we saw while replaying forward.
+ */
+struct ShadowFrame {
+  ShadowFrame() {}
+  ShadowFrame(const ReplayTimeline::Mark& call, remote_code_ptr return_address,
+              remote_ptr<void> call_sp)
+      : call(call), return_address(return_address), call_sp(call_sp) {}
+  // Null for the frame we started in.
+  ReplayTimeline::Mark call;
+  remote_code_ptr return_address;
+  remote_ptr<void> call_sp;
+  // The task's states in this frame, excluding any frames it called.
+  vector<FrameStepState> states;
+};
+
+} // namespace
+
+/**
+ * Returns true if 't' just executed a return instruction, starting in state
+ * 'before' with 'word_at_sp' on top of the stack.
+ */
+static bool returned_from_call(ReplayTask* t, const Registers& before,
+                               remote_ptr<void> word_at_sp) {
+  const Registers& regs = t->regs();
+  if (t->arch() == aarch64) {
+    return regs.ip().register_value() == before.xlr() &&
+           regs.ip() != before.ip() + 4;
+  }
+  return regs.sp() >= before.sp() + word_size(t->arch()) &&
+         regs.ip().register_value() == word_at_sp.as_int();
+}
+
+static bool frame_returned(const ShadowFrame& frame, const Registers& regs) {
+  // A stack pointer above the call's means the frame was unwound (e.g. by
+  // longjmp) even if we didn't see it return.
+  return regs.sp() > frame.call_sp ||
+         (regs.ip() == frame.return_address && regs.sp() >= frame.call_sp);
+}
+
+static int line_index(const vector<remote_code_ptr>& line_starts,
+                      remote_code_ptr ip) {
+  if (line_starts.size() < 2 || ip < line_starts.front() ||
+      ip >= line_starts.back()) {
+    return -1;
+  }
+  return upper_bound(line_starts.begin(), line_starts.end(), ip) -
+         line_starts.begin() - 1;
+}
+
+/**
+ * Find the destination of a reverse-next from a state at 'ip' in the
+ * innermost of 'frames'. Sets 'undetermined' if the destination is before
+ * the states we have.
+ */
+static ReplayTimeline::Mark reverse_next_destination(
+    const vector<ShadowFrame>& frames,
+    const vector<remote_code_ptr>& line_starts, remote_code_ptr ip,
+    bool* undetermined) {
+  const ShadowFrame& frame = frames.back();
+  const vector<FrameStepState>& states = frame.states;
+  bool entered_in_interval = frames.size() > 1;
+  size_t i = states.size();
+  int line = line_index(line_starts, ip);
+  if (line >= 0 && ip != line_starts[line]) {
+    // In the middle of a line: go back to where execution of it started.
+    size_t run_start = i;
+    while (run_start > 0 &&
+           line_index(line_starts, states[run_start - 1].ip) == line) {
+      --run_start;
+      if (states[run_start].ip == line_starts[line]) {
+        return states[run_start].mark;
+      }
+    }
+    if (run_start == 0 && !entered_in_interval) {
+      *undetermined = true;
+      return ReplayTimeline::Mark();
+    }
+    if (run_start < i) {
+      return states[run_start].mark;
+    }
+  }
+  // Go back to the start of the previous line.
+  if (i == 0) {
+    if (!entered_in_interval) {
+      *undetermined = true;
+      return ReplayTimeline::Mark();
+    }
+    return frame.call;
+  }
+  --i;
+  line = line_index(line_starts, states[i].ip);
+  if (line < 0) {
+    return states[i].mark;
+  }
+  while (states[i].ip != line_starts[line]) {
+    if (i == 0) {
+      if (!entered_in_interval) {
+        *undetermined = true;
+        return ReplayTimeline::Mark();
+      }
+      break;
+    }
+    if (line_index(line_starts, states[i - 1].ip) != line) {
+      break;
+    }
+    --i;
+  }
+  return states[i].mark;
+}
+
+// The number of ticks before the current mark we replay step by step at
+// first. Each retry quadruples it.
+static const Ticks frame_step_initial_window = 4096;
+
+bool ReplayTimeline::run_to_return(const TaskUid& tuid,
+                                   remote_code_ptr return_address,
+                                   remote_ptr<void> call_sp,
+                                   const Mark& limit) {
+  Ticks limit_ticks = limit.ptr->proto.key.ticks;
+  AddressSpace::shr_ptr vm = current->find_task(tuid)->vm();
+  bool near_limit = current->find_task(tuid)->tick_count() >= limit_ticks;
+  bool breakpoint_added =
+      !near_limit && vm->add_breakpoint(return_address, BKPT_USER);
+  bool returned = false;
+  while (breakpoint_added) {
+    ReplaySession::StepConstraints constraints(RUN_CONTINUE);
+    if (current->current_task()->tuid() == tuid) {
+      constraints.ticks_target = limit_ticks;
+    }
+    ReplayResult result = current->replay_step(constraints);
+    if (result.break_status.approaching_ticks_target) {
+      near_limit = true;
+      break;
+    }
+    if (result.status == REPLAY_EXITED ||
+        is_start_of_reverse_execution_barrier_event() ||
+        !current->find_task(tuid)) {
+      break;
+    }
+    ReplayTask* break_task = to_replay_task(result.break_status);
+    if (!result.break_status.breakpoint_hit || !break_task) {
+      continue;
+    }
+    if (break_task->tuid() == tuid &&
+        break_task->regs().sp() >= call_sp) {
+      returned = true;
+      break;
+    }
+    // Another task, or a recursive call, got there. Step past it.
+    vm->remove_breakpoint(return_address, BKPT_USER);
+    current->replay_step(RUN_SINGLESTEP_FAST_FORWARD);
+    vm->add_breakpoint(return_address, BKPT_USER);
+  }
+  if (breakpoint_added && !vm->task_set().empty()) {
+    vm->remove_breakpoint(return_address, BKPT_USER);
+  }
+  // Close to 'limit', singlestep the rest of the way: the call may return
+  // right at 'limit'.
+  while (near_limit) {
+    ReplayTask* t = current->find_task(tuid);
+    if (!t) {
+      break;
+    }
+    if (t->ip() == return_address && t->regs().sp() >= call_sp) {
+      returned = true;
+      break;
+    }
+    if (mark() >= limit) {
+      break;
+    }
+    current->replay_step(RUN_SINGLESTEP_FAST_FORWARD);
+  }
+  return returned;
+}
+
+bool ReplayTimeline::reverse_frame_step(const TaskUid& tuid,
+                                        const FrameStep& step) {
+  Mark origin = mark();
+  LOG(debug) << "ReplayTimeline::reverse_frame_step from " << origin;
+  ReplayTask* origin_task = current->current_task();
+  if (!origin_task || origin_task->tuid() != tuid) {
+    return false;
+  }
+  Ticks origin_ticks = origin_task->tick_count();
+  remote_code_ptr origin_ip = origin_task->ip();
+  unapply_breakpoints_and_watchpoints();
+
+  // A call the task was in when a search interval started, and which
+  // returned into the frame containing 'origin'. Next time we find the task
+  // below that call's stack pointer we run to its return at full speed.
+  remote_code_ptr known_return_address;
+  remote_ptr<void> known_call_sp;
+
+  Ticks window = frame_step_initial_window;
+  while (true) {
+    Ticks ticks_target = origin_ticks > window ? origin_ticks - window : 0;
+    // Find a checkpoint from which the task has at least 'window' ticks to
+    // run before reaching 'origin'.
+    MarkKey key = origin.ptr->proto.key;
+    bool at_start = false;
+    while (true) {
+      seek_to_before_key(key);
+      if (current_mark_key() == key) {
+        at_start = true;
+        break;
+      }
+      key = current_mark_key();
+      ReplayTask* t = current->find_task(tuid);
+      if (!t || t->tick_count() <= ticks_target) {
         break;
       }
-      ++it;
     }
-    if (!hit) {
-      result.break_status.breakpoint_hit = false;
+    LOG(debug) << "Searching forward from " << current_mark_key()
+               << " with window " << window;
+
+    // Run at full speed until the task gets close to 'ticks_target'.
+    bool seen_barrier = false;
+    while (!at_mark(origin)) {
+      ReplayTask* t = current->current_task();
+      ReplaySession::StepConstraints constraints(RUN_CONTINUE);
+      if (t->tuid() == tuid) {
+        if (t->tick_count() >= ticks_target) {
+          break;
+        }
+        constraints.ticks_target = ticks_target;
+      }
+      ReplayResult result = current->replay_step(constraints);
+      if (is_start_of_reverse_execution_barrier_event()) {
+        seen_barrier = true;
+      }
+      maybe_add_reverse_exec_checkpoint(EXPECT_SHORT_REVERSE_EXECUTION);
+      if (result.break_status.approaching_ticks_target) {
+        break;
+      }
     }
+
+    // Step the task to 'origin', tracking its calls and returns. Calls that
+    // return before 'origin' are run at full speed.
+    vector<ShadowFrame> frames(1);
+    Mark step_into;
+    bool reached_origin = false;
+    bool tried_known_return = false;
+    while (true) {
+      Mark now = mark();
+      if (now >= origin) {
+        reached_origin = now == origin;
+        break;
+      }
+      ReplayTask* t = current->current_task();
+      if (t->tuid() != tuid) {
+        current->replay_step(RUN_CONTINUE);
+      } else {
+        Registers before = t->regs();
+        if (frames.size() == 1 && !known_return_address.is_null() &&
+            !tried_known_return && before.sp() < known_call_sp) {
+          // We're in a call that started before this interval.
+          tried_known_return = true;
+          if (run_to_return(tuid, known_return_address, known_call_sp,
+                            origin)) {
+            frames[0].states.clear();
+            continue;
+          }
+        }
+        frames.back().states.push_back({ now, before.ip() });
+        ReplaySession::StepConstraints constraints(RUN_SINGLESTEP_FAST_FORWARD);
+        constraints.stop_before_states.push_back(&origin.ptr->proto.regs);
+        current->replay_step(constraints);
+        t = current->find_task(tuid);
+        if (t) {
+          size_t depth = frames.size();
+          while (frames.size() > 1 && frame_returned(frames.back(), t->regs())) {
+            frames.pop_back();
+          }
+          if (depth == 1 &&
+              returned_from_call(t, before,
+                                 now.ptr->proto.return_addresses.addresses[0])) {
+            // The interval started inside a call, which has now returned.
+            // Its states aren't in the frame we're in now.
+            frames[0].states.clear();
+            known_return_address = t->ip();
+            known_call_sp = t->regs().sp();
+          }
+          remote_code_ptr return_address = return_address_of_call(t, before);
+          if (!return_address.is_null()) {
+            if (now != step_into) {
+              if (run_to_return(tuid, return_address, before.sp(), origin)) {
+                continue;
+              }
+              // 'origin' is inside the callee. Step through it.
+              LOG(debug) << "Stepping into call at " << now;
+              frames.back().states.pop_back();
+              step_into = now;
+              seek_to_mark(now);
+              continue;
+            }
+            frames.push_back(ShadowFrame(now, return_address, before.sp()));
+          }
+        }
+      }
+      if (is_start_of_reverse_execution_barrier_event()) {
+        // We can't go back past this.
+        seen_barrier = true;
+        frames.clear();
+        frames.resize(1);
+      }
+      maybe_add_reverse_exec_checkpoint(EXPECT_SHORT_REVERSE_EXECUTION);
+    }
+    if (!reached_origin) {
+      LOG(debug) << "Stepped past " << origin << ", giving up";
+      break;
+    }
+
+    bool undetermined = false;
+    Mark destination;
+    if (step.finish) {
+      if (frames.size() > 1) {
+        destination = frames.back().call;
+      } else {
+        undetermined = true;
+      }
+    } else {
+      destination = reverse_next_destination(frames, step.line_starts,
+                                             origin_ip, &undetermined);
+    }
+    if (destination) {
+      LOG(debug) << "Found destination " << destination;
+      seek_to_mark(destination);
+      return true;
+    }
+    if (!undetermined || at_start || seen_barrier) {
+      break;
+    }
+    window *= 4;
+  }
+  seek_to_mark(origin);
+  return false;
+}
+
+bool ReplayTimeline::breakpoint_condition_holds(ReplayTask* t) {
+  auto auid = t->vm()->uid();
+  auto addr = t->ip();
+  bool hit = false;
+  // Every tracepoint here gets to log, whether or not anything stops.
+  for (auto it = tracepoints.lower_bound(make_tuple(auid, addr, nullptr));
+       it != tracepoints.end() && get<0>(*it) == auid && get<1>(*it) == addr;
+       ++it) {
+    if (get<2>(*it)->evaluate(t)) {
+      hit = true;
+    }
+  }
+  auto it = breakpoints.lower_bound(make_tuple(auid, addr, nullptr));
+  while (it != breakpoints.end() && get<0>(*it) == auid &&
+         get<1>(*it) == addr) {
+    const unique_ptr<BreakpointCondition>& cond = get<2>(*it);
+    if (!cond || cond->evaluate(t)) {
+      return true;
+    }
+    ++it;
+  }
+  return hit;
+}
+
+void ReplayTimeline::evaluate_conditions(ReplayResult& result,
+                                         bool breakpoint_checked) {
+  ReplayTask* t = to_replay_task(result.break_status);
+  if (!t) {
+    return;
+  }
+
+  auto auid = t->vm()->uid();
+
+  if (result.break_status.breakpoint_hit && !breakpoint_checked &&
+      !breakpoint_condition_holds(t)) {
+    result.break_status.breakpoint_hit = false;
   }
 
   for (auto i = result.break_status.watchpoints_hit.begin();
@@ -1449,7 +2194,8 @@ void ReplayTimeline::evaluate_conditions(ReplayResult& result) {
   }
 }
 
-ReplayResult ReplayTimeline::replay_step_forward(RunCommand command) {
+ReplayResult ReplayTimeline::replay_step_forward(RunCommand command,
+                                                 Ticks ticks_budget) {
   DEBUG_ASSERT(command != RUN_SINGLESTEP_FAST_FORWARD);
 
   ReplayResult result;
@@ -1457,7 +2203,23 @@ ReplayResult ReplayTimeline::replay_step_forward(RunCommand command) {
   ProtoMark before = proto_mark();
   current->set_visible_execution(true);
   ReplaySession::StepConstraints constraints(command);
+  ReplayTask* t = current->current_task();
+  if (command == RUN_CONTINUE && ticks_budget > 0 && t) {
+    constraints.ticks_target = t->tick_count() + ticks_budget;
+  }
+  // Evaluate breakpoint conditions at the trap, so hits whose conditions
+  // are false never surface as stops.
+  bool breakpoint_checked = false;
+  if (command == RUN_CONTINUE) {
+    constraints.breakpoint_filter = [&](ReplayTask* t) {
+      breakpoint_checked = breakpoint_condition_holds(t);
+      return breakpoint_checked;
+    };
+  }
+  Progress start_progress = estimate_progress();
+  double start_time = monotonic_now_sec();
   result = current->replay_step(constraints);
+  update_replay_speed(start_progress, start_time);
   current->set_visible_execution(false);
   if (command == RUN_CONTINUE) {
     // Since it's easy for us to fix the coalescing quirk for forward
@@ -1466,12 +2228,15 @@ ReplayResult ReplayTimeline::replay_step_forward(RunCommand command) {
     fix_watchpoint_coalescing_quirk(result, before);
     // Hide any singlestepping we did
     result.break_status.singlestep_complete = false;
+    // Running out of |ticks_budget| isn't a stop.
+    result.break_status.approaching_ticks_target = false;
   }
   maybe_add_reverse_exec_checkpoint(LOW_OVERHEAD);
 
   bool did_hit_breakpoint =
       result.break_status.hardware_or_software_breakpoint_hit();
-  evaluate_conditions(result);
+  evaluate_conditions(result,
+                      breakpoint_checked && result.break_status.breakpoint_hit);
   if (did_hit_breakpoint && !result.break_status.any_break()) {
     // Singlestep past the breakpoint
     current->set_visible_execution(true);
@@ -1577,7 +2342,7 @@ void ReplayTimeline::maybe_add_reverse_exec_checkpoint(
   Progress now = estimate_progress();
   auto it = reverse_exec_checkpoints.rbegin();
   if (it != reverse_exec_checkpoints.rend() &&
-      it->second >= now - inter_checkpoint_interval(strategy)) {
+      it->second.progress >= now - inter_checkpoint_interval(strategy)) {
     // Latest checkpoint is close enough; we don't need to do anything.
     return;
   }
@@ -1593,20 +2358,47 @@ void ReplayTimeline::maybe_add_reverse_exec_checkpoint(
 
   Mark m = add_explicit_checkpoint();
   LOG(debug) << "Creating reverse-exec checkpoint at " << m;
-  reverse_exec_checkpoints[m] = now;
+  ReverseExecCheckpoint& checkpoint = reverse_exec_checkpoints[m];
+  checkpoint.progress = now;
+  checkpoint.seconds_per_progress = seconds_per_progress();
+  // The previous latest checkpoint's cost was measured while it was still
+  // accumulating pages, which it stops doing now that |m| shares the
+  // current state.
+  auto prev = reverse_exec_checkpoints.find(m);
+  if (prev != reverse_exec_checkpoints.begin()) {
+    (--prev)->second.memory_measured = false;
+  }
+
+  enforce_checkpoint_memory_limit(m);
+}
+
+void ReplayTimeline::remove_reverse_exec_checkpoint(const Mark& m) {
+  // Pages the checkpoint shared with only one neighbour are now private to
+  // that neighbour.
+  auto it = reverse_exec_checkpoints.find(m);
+  DEBUG_ASSERT(it != reverse_exec_checkpoints.end());
+  auto next = it;
+  if (++next != reverse_exec_checkpoints.end()) {
+    next->second.memory_measured = false;
+  }
+  if (it != reverse_exec_checkpoints.begin()) {
+    auto prev = it;
+    (--prev)->second.memory_measured = false;
+  }
+  remove_explicit_checkpoint(m);
+  reverse_exec_checkpoints.erase(it);
 }
 
 void ReplayTimeline::discard_future_reverse_exec_checkpoints() {
   Progress now = estimate_progress();
   while (true) {
     auto it = reverse_exec_checkpoints.rbegin();
-    if (it == reverse_exec_checkpoints.rend() || it->second <= now) {
+    if (it == reverse_exec_checkpoints.rend() || it->second.progress <= now) {
       break;
     }
     LOG(debug) << "Discarding reverse-exec future checkpoint at "
                << *it->first.ptr;
-    remove_explicit_checkpoint(it->first);
-    reverse_exec_checkpoints.erase(it->first);
+    remove_reverse_exec_checkpoint(it->first);
   }
 }
 
@@ -1626,7 +2418,7 @@ void ReplayTimeline::discard_past_reverse_exec_checkpoints(
     // checkpoint entry < start in 'tmp_it'.
     auto tmp_it = it;
     while (tmp_it != reverse_exec_checkpoints.rend() &&
-           tmp_it->second >= start) {
+           tmp_it->second.progress >= start) {
       ++checkpoints_in_range;
       ++tmp_it;
     }
@@ -1645,8 +2437,128 @@ void ReplayTimeline::discard_past_reverse_exec_checkpoints(
 
   for (auto& m : checkpoints_to_delete) {
     LOG(debug) << "Discarding reverse-exec checkpoint at " << m;
-    remove_explicit_checkpoint(m);
-    reverse_exec_checkpoints.erase(m);
+    remove_reverse_exec_checkpoint(m);
+  }
+}
+
+void ReplayTimeline::update_replay_speed(Progress start_progress,
+                                         double start_time) {
+  Progress progress = estimate_progress() - start_progress;
+  if (progress <= 0) {
+    return;
+  }
+  // Decay old samples so the estimate follows changes in the program's
+  // behavior, without letting a single short step dominate.
+  static const double decay = 0.9;
+  replay_seconds_sample =
+      replay_seconds_sample * decay + (monotonic_now_sec() - start_time);
+  replay_progress_sample = replay_progress_sample * decay + progress;
+}
+
+double ReplayTimeline::seconds_per_progress() const {
+  if (replay_progress_sample <= 0) {
+    // Progress is meant to approximate microseconds.
+    return 1e-6;
+  }
+  return replay_seconds_sample / replay_progress_sample;
+}
+
+static int64_t checkpoint_private_memory(ReplaySession& session) {
+  int64_t total = 0;
+  for (AddressSpace* vm : session.vms()) {
+    if (vm->task_set().empty()) {
+      continue;
+    }
+    int64_t bytes = read_private_memory_bytes((*vm->task_set().begin())->tid);
+    if (bytes < 0) {
+      return -1;
+    }
+    total += bytes;
+  }
+  return total;
+}
+
+/*
+ * Memory budget:
+ *
+ * A checkpoint's cost is the memory that only its processes map: pages the
+ * current session has written since the fork (and vice versa), plus any
+ * emulated file pages it maps. Once a later checkpoint exists, pages the
+ * current session writes are shared by that checkpoint and this one, so
+ * the cost only changes when a neighbouring checkpoint goes away. So each
+ * checkpoint is measured when it's added, again when the next one is
+ * added, and again after a neighbour is discarded; reading smaps_rollup
+ * for every checkpoint each time would make adding a checkpoint O(n).
+ *
+ * If a reverse-execution destination is uniformly distributed over the
+ * replay so far, the expected time to reach it is proportional to the sum
+ * of the squares of the replay times between consecutive checkpoints
+ * (including the start of the replay and the current position). Removing
+ * a checkpoint with gaps of a and b seconds before and after it increases
+ * that sum by 2ab, so we repeatedly discard the checkpoint with the
+ * smallest ab per byte freed.
+ */
+void ReplayTimeline::enforce_checkpoint_memory_limit(const Mark& added) {
+  uint64_t limit = current->flags().checkpoint_memory_limit;
+  if (!limit) {
+    return;
+  }
+
+  Progress now = estimate_progress();
+  while (true) {
+    uint64_t total = 0;
+    for (auto& it : reverse_exec_checkpoints) {
+      if (!it.second.memory_measured) {
+        int64_t bytes = checkpoint_private_memory(*it.first.ptr->checkpoint);
+        if (bytes < 0) {
+          static bool warned = false;
+          if (!warned) {
+            LOG(warn) << "Can't read smaps_rollup; ignoring checkpoint memory limit";
+            warned = true;
+          }
+          return;
+        }
+        it.second.memory_bytes = bytes;
+        it.second.memory_measured = true;
+      }
+      total += it.second.memory_bytes;
+    }
+    if (total <= limit) {
+      return;
+    }
+
+    // Never evict the checkpoint we just made; it's the one nearest to
+    // where the user is, and it has barely started to cost anything.
+    auto victim = reverse_exec_checkpoints.end();
+    double victim_score = 0;
+    Progress prev = 0;
+    for (auto it = reverse_exec_checkpoints.begin();
+         it != reverse_exec_checkpoints.end(); ++it) {
+      auto next = it;
+      ++next;
+      if (it->first == added) {
+        prev = it->second.progress;
+        continue;
+      }
+      double before = (it->second.progress - prev) * it->second.seconds_per_progress;
+      double after = next == reverse_exec_checkpoints.end()
+          ? (now - it->second.progress) * seconds_per_progress()
+          : (next->second.progress - it->second.progress) *
+                next->second.seconds_per_progress;
+      double score = before * after /
+          max<uint64_t>(it->second.memory_bytes, page_size());
+      if (victim == reverse_exec_checkpoints.end() || score < victim_score) {
+        victim = it;
+        victim_score = score;
+      }
+      prev = it->second.progress;
+    }
+    if (victim == reverse_exec_checkpoints.end()) {
+      return;
+    }
+    LOG(info) << "Evicting reverse-exec checkpoint at " << victim->first
+              << " to free " << victim->second.memory_bytes << " bytes";
+    remove_reverse_exec_checkpoint(victim->first);
   }
 }
 
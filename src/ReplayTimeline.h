@@ -7,6 +7,7 @@
 #include <map>
 #include <memory>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include "BreakpointCondition.h"
@@ -31,7 +32,11 @@ private:
 
 public:
   ReplayTimeline(std::shared_ptr<ReplaySession> session);
-  ReplayTimeline() : breakpoints_applied(false) {}
+  ReplayTimeline()
+      : breakpoints_applied(false),
+        replay_seconds_sample(0),
+        replay_progress_sample(0),
+        reverse_continue_span(1) {}
   ~ReplayTimeline();
 
   bool is_running() const { return current != nullptr; }
@@ -151,6 +156,13 @@ public:
                          WatchType type);
   void remove_breakpoints_and_watchpoints();
   bool has_breakpoint_at_address(ReplayTask* t, remote_code_ptr addr);
+  // Tracepoints are breakpoints whose condition logs something and never
+  // stops. They're kept apart from the debugger's breakpoints so that the
+  // debugger can't replace or remove them, and
+  // remove_breakpoints_and_watchpoints() leaves them alone.
+  bool add_tracepoint(ReplayTask* t, remote_code_ptr addr,
+                      std::unique_ptr<BreakpointCondition> tracepoint);
+  void remove_tracepoints();
   bool has_watchpoint_at_address(ReplayTask* t, remote_ptr<void> addr,
                                  size_t num_bytes, WatchType type);
 
@@ -208,8 +220,12 @@ public:
    *
    * replay_step_forward only does one replay step. That means we'll only
    * execute code in current_session().current_task().
+   *
+   * If |ticks_budget| is nonzero, a RUN_CONTINUE also returns, with no break
+   * reported, once the task has run for about that many ticks. That lets
+   * callers notice interrupts during long stretches without events.
    */
-  ReplayResult replay_step_forward(RunCommand command);
+  ReplayResult replay_step_forward(RunCommand command, Ticks ticks_budget = 0);
 
   ReplayResult reverse_continue(
       const std::function<bool(ReplayTask* t, const BreakStatus &)>& stop_filter,
@@ -219,6 +235,34 @@ public:
       const std::function<bool(ReplayTask* t, const BreakStatus &)>& stop_filter,
       const std::function<bool()>& interrupt_check);
 
+  /**
+   * What reverse_frame_step looks for.
+   */
+  struct FrameStep {
+    FrameStep() : finish(true) {}
+    // When true, find the call that entered the current frame, as
+    // reverse-finish does. Otherwise find the start of the line executed
+    // before the current one in the current frame, as reverse-next does
+    // (or the start of the current line, when stopped in the middle of it).
+    bool finish;
+    // For reverse-next: the sorted addresses at which a new source line
+    // starts in the current function, followed by the function's end.
+    std::vector<remote_code_ptr> line_starts;
+  };
+
+  /**
+   * Move backward to the destination of a reverse-finish or reverse-next of
+   * task 'tuid', which must be the current task. Rather than reverse-stepping
+   * and reverse-continuing piecemeal the way gdb does, we replay forward once
+   * over an interval ending at the current mark, tracking the task's calls
+   * and returns by their return addresses and stack pointers, and running
+   * over calls that return before the current mark at full speed. If the
+   * destination is before the interval we retry with a longer one.
+   * Breakpoints and watchpoints are ignored. Returns false, leaving the
+   * timeline where it was, if there is no such destination.
+   */
+  bool reverse_frame_step(const TaskUid& tuid, const FrameStep& step);
+
   /**
    * Try to identify an existing Mark which is known to be one singlestep
    * before 'from', and for which we know singlestepping to 'from' would
@@ -229,6 +273,21 @@ public:
    */
   Mark lazy_reverse_singlestep(const Mark& from, ReplayTask* t);
 
+  /**
+   * Read memory of 't' as it was at 'm', a Mark returned by
+   * lazy_reverse_singlestep, without seeking there. This only works for
+   * memory near the stack pointer, which reverse_singlestep snapshots, and
+   * memory in mappings that can't have been written since 'm'. Returns
+   * false if we can't serve the read this way.
+   */
+  bool lazy_read_memory(const Mark& m, ReplayTask* t, remote_ptr<void> addr,
+                        size_t len, std::vector<uint8_t>* out);
+
+  /**
+   * Forget the states recorded for lazy reverse-singlestepping.
+   */
+  void invalidate_singlestep_history() { singlestep_history.clear(); }
+
   /**
    * Different strategies for placing automatic checkpoints.
    */
@@ -421,6 +480,37 @@ private:
   Mark find_singlestep_before(const Mark& mark);
   bool is_start_of_reverse_execution_barrier_event();
 
+  /**
+   * Run until task 'tuid', which has just called a function that returns to
+   * 'return_address' with the stack pointer at 'call_sp', returns from it.
+   * Returns false if it doesn't return before 'limit', a mark where 'tuid'
+   * is the current task.
+   */
+  bool run_to_return(const TaskUid& tuid, remote_code_ptr return_address,
+                     remote_ptr<void> call_sp, const Mark& limit);
+
+  // Run forward from the current position to |end| and return true if we
+  // stop anywhere reverse_continue would. Gives up and returns false if
+  // |interrupt_check| returns true.
+  bool interval_has_stop(
+      const Mark& end,
+      const std::function<bool(ReplayTask* t, const BreakStatus &)>& stop_filter,
+      const std::function<bool()>& interrupt_check);
+  // Search the intervals between reverse-exec checkpoints before |end| for
+  // the latest one where reverse_continue would stop, up to
+  // reverse_continue_jobs intervals at a time in parallel forked processes.
+  // If no window has a stop, search the window before it, and so on. Once
+  // a stop is found, seek to the start of its interval, set |end| to its
+  // end and return true. Returns false, with |end| moved back to the
+  // earliest checkpoint searched, when fewer than two intervals are left
+  // to search in parallel. If |interrupt_check| returns true while the
+  // searches run, they are abandoned, *interrupted is set and we return
+  // false without moving.
+  bool seek_to_latest_interval_with_stop(
+      Mark& end,
+      const std::function<bool(ReplayTask* t, const BreakStatus &)>& stop_filter,
+      const std::function<bool()>& interrupt_check, bool* interrupted);
+
   void update_observable_break_status(ReplayTimeline::Mark& now,
                                       const ReplayResult& result);
   ReplayResult reverse_singlestep(
@@ -451,14 +541,41 @@ private:
    * useless).
    */
   void discard_future_reverse_exec_checkpoints();
+  /**
+   * If the user set a memory budget for checkpoints, measure how much memory
+   * each reverse-exec checkpoint pins and discard checkpoints other than
+   * the just-added |added| until we're within the budget, choosing the
+   * ones whose loss least increases the expected cost of reverse execution.
+   */
+  void enforce_checkpoint_memory_limit(const Mark& added);
+  /**
+   * Remove the reverse-exec checkpoint |m|, marking its neighbours' memory
+   * costs for remeasurement.
+   */
+  void remove_reverse_exec_checkpoint(const Mark& m);
+  /**
+   * Update our estimate of how long replay takes per unit of Progress
+   * after replaying from |start_progress|, which began at |start_time|.
+   */
+  void update_replay_speed(Progress start_progress, double start_time);
+  /** Seconds of replay per unit of Progress. */
+  double seconds_per_progress() const;
 
   Mark set_short_checkpoint();
 
   /**
    * If result.break_status hit watchpoints or breakpoints, evaluate their
    * conditions and clear the break_status flags if the conditions don't hold.
+   * If |breakpoint_checked|, the breakpoint's conditions already held when
+   * replay stopped there.
    */
-  void evaluate_conditions(ReplayResult& result);
+  void evaluate_conditions(ReplayResult& result,
+                           bool breakpoint_checked = false);
+  /**
+   * Run the tracepoints at |t|'s ip and return true if any breakpoint there
+   * is unconditional or has a condition that holds.
+   */
+  bool breakpoint_condition_holds(ReplayTask* t);
 
   ReplaySession::shr_ptr current;
   // current is known to be at or after this mark
@@ -503,6 +620,9 @@ private:
   std::set<std::tuple<AddressSpaceUid, remote_code_ptr,
                       std::unique_ptr<BreakpointCondition>>>
       breakpoints;
+  std::set<std::tuple<AddressSpaceUid, remote_code_ptr,
+                      std::unique_ptr<BreakpointCondition>>>
+      tracepoints;
   std::set<std::tuple<AddressSpaceUid, remote_ptr<void>, size_t, WatchType,
                       std::unique_ptr<BreakpointCondition>>>
       watchpoints;
@@ -510,10 +630,38 @@ private:
 
   FrameTime reverse_execution_barrier_event_;
 
+  struct ReverseExecCheckpoint {
+    ReverseExecCheckpoint()
+        : progress(0), seconds_per_progress(0), memory_bytes(0),
+          memory_measured(false) {}
+    Progress progress;
+    // Our replay speed estimate when the checkpoint was made, i.e. for the
+    // execution leading up to it.
+    double seconds_per_progress;
+    // Private memory pinned by the checkpoint when we last measured it.
+    uint64_t memory_bytes;
+    // False if |memory_bytes| is out of date.
+    bool memory_measured;
+  };
+
   /**
    * Checkpoints used to accelerate reverse execution.
    */
-  std::map<Mark, Progress> reverse_exec_checkpoints;
+  std::map<Mark, ReverseExecCheckpoint> reverse_exec_checkpoints;
+
+  /**
+   * Exponentially decaying totals of wall-clock replay time and Progress
+   * made, used to measure replay speed.
+   */
+  double replay_seconds_sample;
+  double replay_progress_sample;
+
+  /**
+   * How many reverse-exec checkpoint intervals each parallel
+   * reverse-continue job searches. Grows while searches come up empty and
+   * shrinks when they find something.
+   */
+  int reverse_continue_span;
 
   /**
    * When these are non-null, then when singlestepping from
@@ -528,6 +676,24 @@ private:
    * accelerate a sequence of reverse singlestep operations.
    */
   Mark reverse_exec_short_checkpoint;
+
+  /**
+   * What we know about a state reverse_singlestep singlestepped through,
+   * so later reverse-singlesteps to it can be served without seeking.
+   */
+  struct SinglestepHistoryEntry {
+    // The state one singlestep of |tuid| earlier, if known.
+    Mark previous;
+    TaskUid tuid;
+    // Copy of the memory around the stack pointer in this state.
+    remote_ptr<void> stack_start;
+    std::vector<uint8_t> stack;
+  };
+  void record_singlestep_state(const Mark& m, ReplayTask* t);
+  void record_singlestep(const Mark& from, const Mark& to, ReplayTask* t);
+  // InternalMarks live as long as the timeline, so their addresses are
+  // stable keys.
+  std::unordered_map<InternalMark*, SinglestepHistoryEntry> singlestep_history;
 };
 
 std::ostream& operator<<(std::ostream& s, const ReplayTimeline::Mark& o);
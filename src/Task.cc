@@ -3685,16 +3685,23 @@ static bool file_was_deleted(string s) {
   return s.find(deleted) == size_t(find_deleted);
 }
 
-static void create_mapping(Task *t, AutoRemoteSyscalls &remote, const KernelMapping &km) {
+/**
+ * Returns true if the new mapping is backed by the same file as |km|, so
+ * that pages of |km| which were never written already have the right
+ * contents.
+ */
+static bool create_mapping(Task *t, AutoRemoteSyscalls &remote, const KernelMapping &km) {
   string real_file_name;
   dev_t device = KernelMapping::NO_DEVICE;
   ino_t inode = KernelMapping::NO_INODE;
+  bool same_file = false;
   if (km.is_real_device() && !file_was_deleted(km.fsname())) {
     struct stat real_file;
     string real_file_name;
     remote.finish_direct_mmap(km.start(), km.size(), km.prot(), km.flags(),
       km.fsname(), O_RDONLY, km.file_offset_bytes(),
       real_file, real_file_name);
+    same_file = real_file.st_dev == km.device() && real_file.st_ino == km.inode();
   } else {
     auto ret = remote.infallible_mmap_syscall_if_alive(km.start(), km.size(), km.prot(),
                                                        km.flags() | MAP_FIXED | MAP_ANONYMOUS, -1,
@@ -3704,6 +3711,7 @@ static void create_mapping(Task *t, AutoRemoteSyscalls &remote, const KernelMapp
   }
   t->vm()->map(t, km.start(), km.size(), km.prot(), km.flags(), km.file_offset_bytes(),
                real_file_name, device, inode, nullptr, &km);
+  return same_file;
 }
 
 static void apply_mm_map(AutoRemoteSyscalls& remote, const NativeArch::prctl_mm_map& map)
@@ -3758,27 +3766,79 @@ static void apply_mm_map(AutoRemoteSyscalls& remote, const NativeArch::prctl_mm_
   }
 }
 
-static void copy_mem_mapping(Task* from, Task* to, const KernelMapping& km) {
-  vector<char> buf;
-  buf.resize(km.size());
-  ssize_t bytes = from->read_bytes_fallible(km.start(), km.size(), buf.data());
-  // There can be mappings of files where the mapping starts beyond the end-of-file
-  // so no bytes will be read.
-  if (bytes > 0) {
-    // We may have a short read here if there are beyond-end-of-mapped-file pages
-    // in the mapping.
+// Copy through a bounded buffer so that copying a huge mapping doesn't
+// need a buffer the size of the mapping. /proc/<pid>/mem doesn't support
+// splice, and process_vm_writev can't write to read-only pages, so a
+// bounce buffer is the best we can do.
+static const size_t COPY_MEM_CHUNK_SIZE = 4 * 1024 * 1024;
+
+/**
+ * Copy [start, start + size) from |from| to |to| using |buf|. Returns false
+ * if we hit the end of readable memory (e.g. beyond the end of a mapped
+ * file) before |size| bytes were copied.
+ */
+static bool copy_mem_range(Task* from, Task* to, remote_ptr<void> start,
+                           size_t size, vector<uint8_t>& buf) {
+  buf.resize(min(size, COPY_MEM_CHUNK_SIZE));
+  size_t offset = 0;
+  while (offset < size) {
+    size_t amount = min(size - offset, buf.size());
+    ssize_t bytes = from->read_bytes_fallible(start + offset, amount, buf.data());
+    if (bytes <= 0) {
+      return false;
+    }
     bool ok = true;
-    to->write_bytes_helper(km.start(), bytes, buf.data(), &ok);
+    to->write_bytes_helper(start + offset, bytes, buf.data(), &ok);
     ASSERT(to, ok);
+    if (size_t(bytes) < amount) {
+      return false;
+    }
+    offset += bytes;
   }
+  return true;
+}
+
+static void copy_mem_mapping(Task* from, Task* to, const KernelMapping& km) {
+  vector<uint8_t> buf;
+  // There can be mappings of files where the mapping starts beyond the
+  // end-of-file so no bytes will be read, or we may have a short read if
+  // there are beyond-end-of-mapped-file pages in the mapping.
+  copy_mem_range(from, to, km.start(), km.size(), buf);
 }
 
 // https://git.kernel.org/pub/scm/linux/kernel/git/stable/linux.git/tree/fs/proc/task_mmu.c?h=v6.3#n1352
 #define PM_PRESENT (1ULL << 63)
 #define PM_SWAP    (1ULL << 62)
+#define PM_FILE    (1ULL << 61)
 
-static bool copy_mem_mapping_just_used(Task* from, Task* to, const KernelMapping& km)
+/**
+ * Copy only the pages of |km| that |from| has populated. If |same_file| is
+ * true, |km| is a private file mapping and |to| maps the same file, so
+ * pages still shared with the page cache don't need to be copied either.
+ * Returns false if pagemap isn't available or can't tell us which pages
+ * need copying.
+ */
+static bool copy_mem_mapping_just_used(Task* from, Task* to, const KernelMapping& km,
+                                       bool same_file)
 {
+  const KernelMapping& source = from->vm()->mapping_of(km.start()).map;
+  if (source.flags() & MAP_SHARED) {
+    // Pages of a shared mapping that we haven't touched can still have
+    // contents (e.g. rr's shared buffers, which |to| gets as anonymous
+    // memory), so we have to copy everything.
+    return false;
+  }
+  bool is_anonymous = !source.is_real_device();
+  if (!is_anonymous && !same_file) {
+    // Unpopulated pages have the file's contents, which |to| doesn't.
+    return false;
+  }
+  // Pages we must copy: anonymous pages, either in memory or in swap. For
+  // private file mappings, present pages that are still page-cache pages
+  // are unmodified.
+  uint64_t copy_mask = PM_PRESENT | PM_SWAP;
+  uint64_t skip_mask = is_anonymous ? 0 : PM_FILE;
+
   ScopedFd& fd = from->pagemap_fd();
   if (!fd.is_open()) {
     LOG(debug) << "Failed to open " << from->proc_pagemap_path();
@@ -3790,6 +3850,7 @@ static bool copy_mem_mapping_just_used(Task* from, Task* to, const KernelMapping
 
   const int max_buf_size = 65536;
   vector<uint64_t> buf;
+  vector<uint8_t> copy_buf;
 
   for (uintptr_t page_offset = 0; page_offset < km.size() / pagesize; page_offset += max_buf_size) {
     auto page_read_offset = (km.start().as_int() / pagesize + page_offset);
@@ -3804,9 +3865,12 @@ static bool copy_mem_mapping_just_used(Task* from, Task* to, const KernelMapping
     // Also try to find consecutive pages to copy them in one operation.
     // The file /proc/PID/pagemap consists of 64-bit values, each describing
     // the state of one page. See https://www.kernel.org/doc/Documentation/vm/pagemap.txt
+    auto needs_copy = [&](uint64_t entry) -> bool {
+      return (entry & copy_mask) && !((entry & PM_PRESENT) && (entry & skip_mask));
+    };
 
     for (size_t page = 0; page < page_read_count; ++page) {
-      if (buf[page] & (PM_PRESENT | PM_SWAP)) {
+      if (needs_copy(buf[page])) {
         auto start = km.start() + (page_offset + page) * pagesize;
         if (start >= km.end()) {
           break;
@@ -3814,9 +3878,7 @@ static bool copy_mem_mapping_just_used(Task* from, Task* to, const KernelMapping
         ++pages_present;
 
         // Check for consecutive used pages
-        while (page + 1 < page_read_count &&
-               buf[page + 1] & (PM_PRESENT | PM_SWAP))
-        {
+        while (page + 1 < page_read_count && needs_copy(buf[page + 1])) {
           ++page;
           ++pages_present;
         }
@@ -3824,8 +3886,7 @@ static bool copy_mem_mapping_just_used(Task* from, Task* to, const KernelMapping
         auto end = km.start() + (page_offset + page + 1) * pagesize;
         LOG(debug) << km << " copying start: 0x" << hex << start << " end: 0x" << end
                    << dec << " pages: " << (end - start) / pagesize;
-        auto pages = km.subrange(start, end);
-        copy_mem_mapping(from, to, pages);
+        copy_mem_range(from, to, start, end - start, copy_buf);
       }
     }
   }
@@ -3963,27 +4024,23 @@ void Task::dup_from(Task *other) {
     options.exclude_vdso_vvar = true;
     this->vm()->unmap_all_but_rr_mappings(remote, options);
     LOG(debug) << "Creating stack mapping " << stack_mapping << " for " << tid;
-    create_mapping(this, remote, stack_mapping);
+    bool same_file = create_mapping(this, remote, stack_mapping);
     LOG(debug) << "Copying stack into " << tid;
-    copy_mem_mapping(other, this, stack_mapping);
+    if (!copy_mem_mapping_just_used(other, this, stack_mapping, same_file)) {
+      copy_mem_mapping(other, this, stack_mapping);
+    }
   }
   {
     AutoRemoteSyscalls remote_this(this);
     for (auto &km : mappings) {
       LOG(debug) << "Creating mapping " << km << " for " << tid;
-      create_mapping(this, remote_this, km);
+      bool same_file = create_mapping(this, remote_this, km);
       LOG(debug) << "Copying mapping into " << tid;
       if (!(km.flags() & MAP_SHARED)) {
-        // Make the effort just for bigger mappings, copy smaller as a whole.
-        if ((km.flags() & MAP_ANONYMOUS) &&
-            km.size() >= 0x400000/*4MB*/)
-        {
-          LOG(debug) << "Using copy_mem_mapping_just_used";
-          if (copy_mem_mapping_just_used(other, this, km)) {
-            continue;
-          }
-          LOG(debug) << "Fallback to copy_mem_mapping";
+        if (copy_mem_mapping_just_used(other, this, km, same_file)) {
+          continue;
         }
+        LOG(debug) << "Fallback to copy_mem_mapping";
         copy_mem_mapping(other, this, km);
       }
     }
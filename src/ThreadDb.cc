@@ -50,7 +50,7 @@ ps_err_e ps_pdread(struct ps_prochandle* h, psaddr_t addr, void* buffer,
   if (!task) {
     return PS_ERR;
   }
-  task->read_bytes_helper(uaddr, len, buffer, &ok);
+  ok = h->db->read_memory(task, uaddr, len, buffer);
   LOG(debug) << "ps_pdread " << ok;
   return ok ? PS_OK : PS_ERR;
 }
@@ -152,7 +152,8 @@ rr::ThreadDb::ThreadDb(pid_t tgid)
       thread_db_library(nullptr),
       td_ta_delete_fn(nullptr),
       td_thr_tls_get_addr_fn(nullptr),
-      td_ta_map_lwp2thr_fn(nullptr) {
+      td_ta_map_lwp2thr_fn(nullptr),
+      cache_signature(0) {
   prochandle.thread_group = nullptr;
   prochandle.db = this;
   prochandle.tgid = tgid;
@@ -175,6 +176,9 @@ const std::set<std::string> rr::ThreadDb::get_symbols_and_clear_map(
     td_ta_delete_fn(internal_handle);
     internal_handle = nullptr;
   }
+  // Thread handles point at the agent we just deleted.
+  thread_handles.clear();
+  tls_blocks.clear();
 
   prochandle.thread_group = thread_group;
   symbols.clear();
@@ -201,29 +205,85 @@ bool rr::ThreadDb::query_symbol(const char* name, remote_ptr<void>* address) {
 bool rr::ThreadDb::get_tls_address(ThreadGroup* thread_group, pid_t rec_tid,
                                    size_t offset, remote_ptr<void> load_module,
                                    remote_ptr<void>* result) {
+  validate_caches(thread_group);
+  auto block_key = std::make_pair(rec_tid, load_module.as_int());
+  auto block = tls_blocks.find(block_key);
+  if (block != tls_blocks.end()) {
+    *result = remote_ptr<void>(block->second + offset);
+    return true;
+  }
+
   prochandle.thread_group = thread_group;
   if (!initialize()) {
     prochandle.thread_group = nullptr;
     return false;
   }
 
-  td_thrhandle_t th;
-  if (td_ta_map_lwp2thr_fn(internal_handle, rec_tid, &th) != TD_OK) {
-    prochandle.thread_group = nullptr;
-    return false;
+  auto handle = thread_handles.find(rec_tid);
+  if (handle == thread_handles.end()) {
+    td_thrhandle_t th;
+    if (td_ta_map_lwp2thr_fn(internal_handle, rec_tid, &th) != TD_OK) {
+      prochandle.thread_group = nullptr;
+      return false;
+    }
+    handle = thread_handles.insert(std::make_pair(rec_tid, th)).first;
   }
 
   psaddr_t load_module_addr = reinterpret_cast<psaddr_t>(load_module.as_int());
   psaddr_t addr;
-  if (td_thr_tls_get_addr_fn(&th, load_module_addr, offset, &addr) != TD_OK) {
+  if (td_thr_tls_get_addr_fn(&handle->second, load_module_addr, offset,
+                             &addr) != TD_OK) {
+    // Possibly TD_TLSDEFER: the block isn't allocated yet. Don't cache.
     prochandle.thread_group = nullptr;
     return false;
   }
   prochandle.thread_group = nullptr;
-  *result = remote_ptr<void>(reinterpret_cast<uintptr_t>(addr));
+  uintptr_t uaddr = reinterpret_cast<uintptr_t>(addr);
+  tls_blocks[block_key] = uaddr - offset;
+  *result = remote_ptr<void>(uaddr);
   return true;
 }
 
+bool rr::ThreadDb::read_memory(Task* t, remote_ptr<void> addr, size_t len,
+                               void* buf) {
+  if (memory_reader) {
+    return memory_reader(t, addr, len, static_cast<uint8_t*>(buf)) == len;
+  }
+  bool ok = true;
+  t->read_bytes_helper(addr, len, buf, &ok);
+  return ok;
+}
+
+static void mix(uint64_t* h, uint64_t v) {
+  *h = (*h ^ v) * 0x100000001b3ULL;
+}
+
+void rr::ThreadDb::validate_caches(ThreadGroup* thread_group) {
+  uint64_t signature = 0xcbf29ce484222325ULL;
+  for (Task* t : thread_group->task_set()) {
+    mix(&signature, t->tuid().tid());
+    mix(&signature, t->tuid().serial());
+  }
+  Task* t = thread_group->first_running_task();
+  if (t) {
+    AddressSpaceUid vm = t->vm()->uid();
+    mix(&signature, vm.tid());
+    mix(&signature, vm.serial());
+    mix(&signature, vm.exec_count());
+    for (const auto& m : t->vm()->maps()) {
+      mix(&signature, m.map.start().as_int());
+      mix(&signature, m.map.end().as_int());
+      mix(&signature, m.map.inode());
+    }
+  }
+  if (signature != cache_signature) {
+    LOG(debug) << "ThreadDb caches invalidated";
+    cache_signature = signature;
+    thread_handles.clear();
+    tls_blocks.clear();
+  }
+}
+
 bool rr::ThreadDb::initialize() {
   if (internal_handle) {
     return true;
@@ -4,15 +4,18 @@
 #define RR_THREADDB_H_
 
 #include "remote_ptr.h"
+#include <functional>
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
 
 extern "C" {
 #include <thread_db.h>
 }
 
 namespace rr {
+class Task;
 class ThreadGroup;
 class ThreadDb;
 }
@@ -45,6 +48,11 @@ namespace rr {
  *
  * ThreadDb works on a callback model, using symbols provided by the
  * hosting application.  These are all defined in ThreadDb.cc.
+ *
+ * libthread_db reads tracee memory a few bytes at a time, so thread handles
+ * and TLS block addresses are cached. The caches are dropped when the
+ * thread group's tasks, its exec count or its mappings change (the latter
+ * covers dlopen/dlclose).
  */
 class ThreadDb {
 public:
@@ -79,9 +87,28 @@ public:
   bool get_tls_address(ThreadGroup* thread_group, pid_t rec_tid, size_t offset,
                        remote_ptr<void> load_module, remote_ptr<void>* result);
 
+  /**
+   * Reads on behalf of libthread_db go through |reader|, which returns the
+   * number of bytes read. GdbServer uses this to serve them from its
+   * memory cache.
+   */
+  typedef std::function<size_t(Task* t, remote_ptr<void> addr, size_t len,
+                               uint8_t* buf)>
+      MemoryReader;
+  void set_memory_reader(const MemoryReader& reader) { memory_reader = reader; }
+
+  /**
+   * Read |len| bytes at |addr| in |t|'s address space. Returns false if
+   * not all of them could be read.
+   */
+  bool read_memory(Task* t, remote_ptr<void> addr, size_t len, void* buf);
+
 private:
   bool load_library();
   bool initialize();
+  // Drop cached handles and TLS blocks if |thread_group| has changed in a
+  // way that could invalidate them.
+  void validate_caches(ThreadGroup* thread_group);
 
   ThreadDb(ThreadDb&) = delete;
   ThreadDb operator=(ThreadDb&) = delete;
@@ -109,6 +136,16 @@ private:
 
   // Map from symbol names to addresses.
   std::map<std::string, remote_ptr<void>> symbols;
+
+  MemoryReader memory_reader;
+
+  // Summary of the thread group state the caches below are valid for.
+  uint64_t cache_signature;
+  // rec_tid -> libthread_db handle.
+  std::map<pid_t, td_thrhandle_t> thread_handles;
+  // (rec_tid, load module) -> address of the thread's TLS block for the
+  // module. A TLS address is the block address plus the variable's offset.
+  std::map<std::pair<pid_t, uintptr_t>, uintptr_t> tls_blocks;
 };
 
 } // namespace rr
@@ -61,6 +61,23 @@ static int dump_trace_info(const string& trace_dir, FILE* out) {
 
   fprintf(out, "  \"bindToCpu\":%d,\n", trace.bound_to_cpu());
 
+  fprintf(out, "  \"compressionCpu\":%d,\n", trace.compression_cpu());
+
+  fputs("  \"compressionStats\":[", out);
+  auto& stats = trace.compression_stats();
+  for (size_t i = 0; i < stats.size(); ++i) {
+    if (i > 0) {
+      fputc(',', out);
+    }
+    fprintf(out,
+            "\n    { \"substream\":\"%s\", \"producerBlockCount\":%llu, "
+            "\"producerBlockedSec\":%f, \"minLevel\":%d }",
+            stats[i].substream.c_str(),
+            (unsigned long long)stats[i].producer_block_count,
+            stats[i].producer_blocked_sec, stats[i].min_level);
+  }
+  fputs("\n  ],\n", out);
+
   fprintf(out, "  \"cpuidFaulting\":%s,\n", trace.uses_cpuid_faulting() ? "true" : "false");
 
   fprintf(out, "  \"requiredForwardCompatibilityVersion\":%d,\n", trace.required_forward_compatibility_version());
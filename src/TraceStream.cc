@@ -191,6 +191,7 @@ private:
 TraceStream::TraceStream(const string& trace_dir, FrameTime initial_time)
     : trace_dir(real_path(trace_dir)),
       bind_to_cpu(-1),
+      compression_cpu_(-1),
       global_time(initial_time)
    {}
 
@@ -899,9 +900,17 @@ bool TraceWriter::copy_file(const std::string& real_file_name,
     return false;
   }
 
+  // try_clone_file has already tried a reflink, so copy on the helper thread
+  // so the tracee isn't stopped while we copy a potentially huge file. The
+  // copy is finished before the trace is closed; if it fails after being
+  // queued (e.g. the file was modified in the meantime), the trace header
+  // says so and replay warns.
+  if (!copier.copy(std::move(src), std::move(dest), path)) {
+    unlink(dest_path.c_str());
+    return false;
+  }
   *new_name = path;
-
-  return rr::copy_file(dest, src);
+  return true;
 }
 
 static bool starts_with(const string& s, const string& with) {
@@ -1381,6 +1390,26 @@ TraceWriter::TraceWriter(const std::string& file_name,
   }
 }
 
+void TraceWriter::place_compression_threads(int tracee_cpu, int reserved_cpu,
+                                            const ScopedFd& cpu_lock_fd) {
+  compression_cpu_ = reserved_cpu;
+  copier.set_cpu(reserved_cpu);
+  size_t num_threads = 0;
+  for (auto& w : writers) {
+    num_threads += w->num_threads();
+  }
+  // Place the raw data threads first; they do most of the work.
+  Substream order[SUBSTREAM_COUNT] = { RAW_DATA, EVENTS, MMAPS, TASKS };
+  vector<cpu_set_t> masks = rr::place_compression_threads(
+      tracee_cpu, reserved_cpu, cpu_lock_fd, num_threads);
+  size_t next = 0;
+  for (Substream s : order) {
+    for (size_t i = 0; i < writer(s).num_threads() && next < masks.size(); ++i) {
+      writer(s).set_thread_affinity(i, masks[next++]);
+    }
+  }
+}
+
 void TraceWriter::setup_cpuid_records(bool has_cpuid_faulting,
                                       const DisableCPUIDFeatures& disable_cpuid_features) {
   has_cpuid_faulting_ = has_cpuid_faulting;
@@ -1398,13 +1427,30 @@ void TraceWriter::setup_cpuid_records(bool has_cpuid_faulting,
 }
 
 void TraceWriter::close(CloseStatus status, const TraceUuid* uuid) {
-  for (auto& w : writers) {
-    w->close();
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    writer(s).close();
+    if (writer(s).producer_block_count()) {
+      LOG(info) << "Blocked " << writer(s).producer_block_count()
+                << " times for " << writer(s).producer_blocked_sec()
+                << "s waiting for " << substream(s).name << " compression";
+    }
+  }
+  vector<string> failed_copies = copier.finish();
+  for (auto& f : failed_copies) {
+    LOG(error) << "Failed to copy " << f << "; replay may diverge";
   }
 
   MallocMessageBuilder header_msg;
   trace::Header::Builder header = header_msg.initRoot<trace::Header>();
   header.setBindToCpu(this->bind_to_cpu);
+  header.setCompressionCpu(compression_cpu_);
+  auto stats = header.initCompressionStats(SUBSTREAM_COUNT);
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    stats[s].setSubstream(str_to_data(substream(s).name));
+    stats[s].setProducerBlockCount(writer(s).producer_block_count());
+    stats[s].setProducerBlockedSec(writer(s).producer_blocked_sec());
+    stats[s].setMinLevel(writer(s).min_level());
+  }
   header.setTicksSemantics(
     to_trace_ticks_semantics(PerfCounters::default_ticks_semantics()));
   header.setSyscallbufProtocolVersion(SYSCALLBUF_PROTOCOL_VERSION);
@@ -1444,7 +1490,11 @@ void TraceWriter::close(CloseStatus status, const TraceUuid* uuid) {
   } else {
     header.setUuid(Data::Reader(uuid->bytes, sizeof(TraceUuid::bytes)));
   }
-  header.setOk(status == CLOSE_OK);
+  header.setOk(status == CLOSE_OK && failed_copies.empty());
+  auto failed = header.initFailedCopies(failed_copies.size());
+  for (size_t i = 0; i < failed_copies.size(); ++i) {
+    failed.set(i, str_to_data(failed_copies[i]));
+  }
   header.setChaosMode(chaos_mode ? trace::ChaosMode::KNOWN_TRUE : trace::ChaosMode::KNOWN_FALSE);
   MemoryRange exclusion_range = AddressSpace::get_global_exclusion_range(nullptr);
   header.setExclusionRangeStart(exclusion_range.start().as_int());
@@ -1511,6 +1561,41 @@ void TraceReader::rewind() {
   DEBUG_ASSERT(good());
 }
 
+bool TraceReader::read_uuid(const string& dir, TraceUuid* uuid) {
+  string path = resolve_trace_name(dir) + "/version";
+  ScopedFd version_fd(path.c_str(), O_RDONLY);
+  if (!version_fd.is_open()) {
+    return false;
+  }
+  string version_str;
+  while (true) {
+    char ch;
+    if (read(version_fd, &ch, 1) != 1) {
+      return false;
+    }
+    if (ch == '\n') {
+      break;
+    }
+    version_str += ch;
+  }
+  char* end_ptr;
+  long int version = strtol(version_str.c_str(), &end_ptr, 10);
+  if (*end_ptr != 0 || version != TRACE_VERSION) {
+    return false;
+  }
+  try {
+    PackedFdMessageReader header_msg(version_fd);
+    Data::Reader data = header_msg.getRoot<trace::Header>().getUuid();
+    if (data.size() != sizeof(uuid->bytes)) {
+      return false;
+    }
+    memcpy(uuid->bytes, data.begin(), sizeof(uuid->bytes));
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
 TraceReader::TraceReader(const string& dir)
     : TraceStream(resolve_trace_name(dir), 1) {
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
@@ -1593,7 +1678,27 @@ TraceReader::TraceReader(const string& dir)
             path.c_str(), syscallbuf_protocol_version, SYSCALLBUF_PROTOCOL_VERSION, path.c_str(), path.c_str());
     exit(EX_DATAERR);
   }
+  if (header.getFailedCopies().size() > 0) {
+    fprintf(stderr, "\n"
+                    "rr: warning: These files in trace `%s' changed while "
+                    "they were being\n"
+                    "             copied during recording, so they may not "
+                    "match what the\n"
+                    "             tracees mapped. Replay may diverge.\n",
+            dir().c_str());
+    for (auto f : header.getFailedCopies()) {
+      fprintf(stderr, "               %s\n", data_to_str(f).c_str());
+    }
+    fputc('\n', stderr);
+  }
   bind_to_cpu = header.getBindToCpu();
+  compression_cpu_ = header.getCompressionCpu();
+  for (auto stats : header.getCompressionStats()) {
+    compression_stats_.push_back({ data_to_str(stats.getSubstream()),
+                                   stats.getProducerBlockCount(),
+                                   stats.getProducerBlockedSec(),
+                                   stats.getMinLevel() });
+  }
   preload_thread_locals_recorded_ = header.getPreloadThreadLocalsRecorded();
   ticks_semantics_ = from_trace_ticks_semantics(header.getTicksSemantics());
   rrcall_base_ = header.getRrcallBase();
@@ -1676,6 +1781,8 @@ TraceReader::TraceReader(const TraceReader& other)
   }
 
   bind_to_cpu = other.bind_to_cpu;
+  compression_cpu_ = other.compression_cpu_;
+  compression_stats_ = other.compression_stats_;
   trace_uses_cpuid_faulting = other.trace_uses_cpuid_faulting;
   cpuid_records_ = other.cpuid_records_;
   raw_recs = other.raw_recs;
@@ -11,6 +11,7 @@
 #include <string>
 #include <vector>
 
+#include "BackgroundCopier.h"
 #include "CompressedReader.h"
 #include "CompressedWriter.h"
 #include "Event.h"
@@ -79,6 +80,7 @@ public:
 
   int bound_to_cpu() const { return bind_to_cpu; }
   void set_bound_cpu(int bound) { bind_to_cpu = bound; }
+  int compression_cpu() const { return compression_cpu_; }
 
   /**
    * Return the current "global time" (event count) for this
@@ -139,6 +141,8 @@ protected:
   string trace_dir;
   // CPU core# that the tracees are bound to
   int32_t bind_to_cpu;
+  // CPU core# that the compression threads are bound to
+  int32_t compression_cpu_;
 
   // Arbitrary notion of trace time, ticked on the recording of
   // each event (trace frame).
@@ -252,6 +256,13 @@ public:
   TraceWriter(const std::string& file_name,
               const string& output_trace_dir, TicksSemantics ticks_semantics);
 
+  /**
+   * Set the affinity of all compression threads according to
+   * place_compression_threads. |reserved_cpu| is recorded in the trace.
+   */
+  void place_compression_threads(int tracee_cpu, int reserved_cpu,
+                                 const ScopedFd& cpu_lock_fd);
+
   /**
    * Called after the calling thread is actually bound to |bind_to_cpu|.
    */
@@ -302,6 +313,8 @@ private:
   const CompressedWriter& writer(Substream s) const { return *writers[s]; }
 
   std::unique_ptr<CompressedWriter> writers[SUBSTREAM_COUNT];
+  // Copies mapped files into the trace directory off the main thread.
+  BackgroundCopier copier;
   /**
    * Files that have already been mapped without being copied to the trace,
    * i.e. that we have already assumed to be immutable.
@@ -440,6 +453,13 @@ public:
    */
   TraceReader(const string& dir);
 
+  /**
+   * Read only the UUID from the header of the trace in 'dir' (the latest
+   * trace if empty), without opening the trace's substreams. Returns false
+   * if there's no readable header from this version of rr.
+   */
+  static bool read_uuid(const string& dir, TraceUuid* uuid);
+
   /**
    * Create a copy of this stream that has exactly the same
    * state as 'other', but for which mutations of this
@@ -471,6 +491,17 @@ public:
 
   SupportedArch arch() const { return arch_; }
 
+  struct CompressionStats {
+    std::string substream;
+    uint64_t producer_block_count;
+    double producer_blocked_sec;
+    int min_level;
+  };
+  // Empty for traces recorded before these were saved.
+  const std::vector<CompressionStats>& compression_stats() const {
+    return compression_stats_;
+  }
+
   bool chaos_mode(bool* known) const {
     *known = chaos_mode_known_;
     return chaos_mode_;
@@ -505,6 +536,7 @@ private:
   std::unique_ptr<CompressedReader> readers[SUBSTREAM_COUNT];
   std::vector<CPUIDRecord> cpuid_records_;
   std::vector<RawDataMetadata> raw_recs;
+  std::vector<CompressionStats> compression_stats_;
   TicksSemantics ticks_semantics_;
   double monotonic_time_;
   std::unique_ptr<TraceUuid> uuid_;
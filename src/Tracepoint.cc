@@ -0,0 +1,450 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "Tracepoint.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <sstream>
+
+#include "BreakpointCondition.h"
+#include "ElfReader.h"
+#include "GdbExpression.h"
+#include "GdbRegister.h"
+#include "ReplaySession.h"
+#include "ReplayTask.h"
+#include "ReplayTimeline.h"
+#include "log.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+// The few opcodes of gdb's agent expression bytecode that tracepoint fields
+// compile to. See GdbExpression.cc for the full set.
+enum {
+  OP_add = 0x02,
+  OP_sub = 0x03,
+  OP_ref8 = 0x17,
+  OP_ref16 = 0x18,
+  OP_ref32 = 0x19,
+  OP_ref64 = 0x1a,
+  OP_const64 = 0x25,
+  OP_reg = 0x26,
+  OP_end = 0x27,
+};
+
+struct NamedRegister {
+  const char* name;
+  GdbRegister reg;
+};
+
+static const NamedRegister x86_registers[] = {
+  { "eax", DREG_EAX }, { "ecx", DREG_ECX }, { "edx", DREG_EDX },
+  { "ebx", DREG_EBX }, { "esp", DREG_ESP }, { "ebp", DREG_EBP },
+  { "esi", DREG_ESI }, { "edi", DREG_EDI }, { "eip", DREG_EIP },
+  { "eflags", DREG_EFLAGS }, { "sp", DREG_ESP }, { "pc", DREG_EIP },
+};
+
+static const NamedRegister x64_registers[] = {
+  { "rax", DREG_RAX }, { "rbx", DREG_RBX }, { "rcx", DREG_RCX },
+  { "rdx", DREG_RDX }, { "rsi", DREG_RSI }, { "rdi", DREG_RDI },
+  { "rbp", DREG_RBP }, { "rsp", DREG_RSP }, { "r8", DREG_R8 },
+  { "r9", DREG_R9 }, { "r10", DREG_R10 }, { "r11", DREG_R11 },
+  { "r12", DREG_R12 }, { "r13", DREG_R13 }, { "r14", DREG_R14 },
+  { "r15", DREG_R15 }, { "rip", DREG_RIP }, { "eflags", DREG_64_EFLAGS },
+  { "sp", DREG_RSP }, { "pc", DREG_RIP },
+};
+
+static bool register_number(SupportedArch arch, const string& name,
+                            GdbRegister* reg) {
+  const NamedRegister* table;
+  size_t count;
+  switch (arch) {
+    case x86:
+      table = x86_registers;
+      count = array_length(x86_registers);
+      break;
+    case x86_64:
+      table = x64_registers;
+      count = array_length(x64_registers);
+      break;
+    case aarch64: {
+      if (name == "sp") {
+        *reg = DREG_SP;
+        return true;
+      }
+      if (name == "pc") {
+        *reg = DREG_PC;
+        return true;
+      }
+      char* end;
+      long n = name[0] == 'x' ? strtol(name.c_str() + 1, &end, 10) : -1;
+      if (n < 0 || n > 30 || name.size() < 2 || *end) {
+        return false;
+      }
+      *reg = GdbRegister(DREG_X0 + n);
+      return true;
+    }
+    default:
+      return false;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    if (name == table[i].name) {
+      *reg = table[i].reg;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void push_u16(vector<uint8_t>* code, uint16_t v) {
+  code->push_back(v >> 8);
+  code->push_back(v & 0xff);
+}
+
+static void push_u64(vector<uint8_t>* code, uint64_t v) {
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    code->push_back((v >> shift) & 0xff);
+  }
+}
+
+/**
+ * Compile a tracepoint field to agent bytecode. Returns false if it names
+ * something that isn't a register of |arch| or a number.
+ */
+static bool compile_field(SupportedArch arch, const Tracepoints::Field& field,
+                          vector<uint8_t>* code) {
+  const string& expr = field.expr;
+  size_t pos = 0;
+  uint8_t pending_op = 0;
+  while (pos <= expr.size()) {
+    size_t end = expr.find_first_of("+-", pos);
+    if (end == string::npos) {
+      end = expr.size();
+    }
+    string term = expr.substr(pos, end - pos);
+    size_t first = term.find_first_not_of(' ');
+    size_t last = term.find_last_not_of(' ');
+    if (first == string::npos) {
+      return false;
+    }
+    term = term.substr(first, last - first + 1);
+    if (isdigit(term[0])) {
+      char* num_end;
+      uint64_t v = strtoull(term.c_str(), &num_end, 0);
+      if (*num_end) {
+        return false;
+      }
+      code->push_back(OP_const64);
+      push_u64(code, v);
+    } else {
+      GdbRegister reg;
+      if (!register_number(arch, term, &reg)) {
+        return false;
+      }
+      code->push_back(OP_reg);
+      push_u16(code, reg);
+    }
+    if (pending_op) {
+      code->push_back(pending_op);
+    }
+    if (end == expr.size()) {
+      break;
+    }
+    pending_op = expr[end] == '+' ? OP_add : OP_sub;
+    pos = end + 1;
+  }
+  switch (field.deref) {
+    case 0:
+      break;
+    case 1:
+      code->push_back(OP_ref8);
+      break;
+    case 2:
+      code->push_back(OP_ref16);
+      break;
+    case 4:
+      code->push_back(OP_ref32);
+      break;
+    case 8:
+      code->push_back(OP_ref64);
+      break;
+    default:
+      return false;
+  }
+  code->push_back(OP_end);
+  return true;
+}
+
+class TracepointCondition : public BreakpointCondition {
+public:
+  TracepointCondition(shared_ptr<Tracepoints::Output> output,
+                      const vector<Tracepoints::Field>& fields,
+                      vector<GdbExpression>&& expressions)
+      : output(output),
+        fields(fields),
+        expressions(std::move(expressions)) {}
+
+  virtual bool evaluate(Task* t) const override {
+    if (!t->session().is_replaying()) {
+      return false;
+    }
+    // Only log a hit the first time replay gets there. Replays after seeking
+    // backwards, including reverse-execution searches, pass it again.
+    // Ticks alone don't identify a position (a loop body without
+    // conditional branches hits again at the same tick count), so hits at
+    // the task's latest logged (time, ticks) are told apart by registers.
+    FrameTime time = static_cast<ReplayTask*>(t)->current_frame_time();
+    Ticks ticks = t->tick_count();
+    LoggedPosition& last = last_logged[t->rec_tid];
+    if (!last.regs.empty()) {
+      if (time < last.time || (time == last.time && ticks < last.ticks)) {
+        return false;
+      }
+      if (time == last.time && ticks == last.ticks) {
+        for (const Registers& r : last.regs) {
+          if (r == t->regs()) {
+            return false;
+          }
+        }
+      } else {
+        last.regs.clear();
+      }
+    }
+    last.time = time;
+    last.ticks = ticks;
+    last.regs.push_back(t->regs());
+
+    stringstream line;
+    line << time << " " << t->rec_tid << ": ";
+    for (size_t i = 0; i < fields.size(); ++i) {
+      line << fields[i].text;
+      if (fields[i].expr.empty()) {
+        continue;
+      }
+      GdbExpression::Value v;
+      if (expressions[i].evaluate(t, &v)) {
+        line << "0x" << hex << v.i << dec;
+      } else {
+        line << "<error>";
+      }
+    }
+    line << "\n";
+    string s = line.str();
+    write_all(output->fd, s.c_str(), s.size());
+    return false;
+  }
+
+private:
+  shared_ptr<Tracepoints::Output> output;
+  vector<Tracepoints::Field> fields;
+  // One per field; unused for fields without an expression.
+  vector<GdbExpression> expressions;
+  // The furthest position at which each task logged a hit, and the
+  // registers of every hit logged there.
+  struct LoggedPosition {
+    LoggedPosition() : time(0), ticks(0) {}
+    FrameTime time;
+    Ticks ticks;
+    vector<Registers> regs;
+  };
+  mutable map<pid_t, LoggedPosition> last_logged;
+};
+
+Tracepoints::Tracepoints() : output(make_shared<Output>()) {}
+
+Tracepoints::~Tracepoints() {}
+
+void Tracepoints::set_output(const string& file_name) {
+  auto out = make_shared<Output>();
+  out->owned_fd = ScopedFd(file_name.c_str(),
+                           O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (!out->owned_fd.is_open()) {
+    FATAL() << "Can't open tracepoint output " << file_name;
+  }
+  out->fd = out->owned_fd;
+  output = out;
+}
+
+string Tracepoints::add(const string& spec) {
+  size_t colon = spec.find(':');
+  if (colon == string::npos || colon == 0) {
+    return "Tracepoints look like <location>:<format>";
+  }
+  Spec s;
+  s.location = spec.substr(0, colon);
+  const string format = spec.substr(colon + 1);
+  Field field;
+  field.deref = 0;
+  for (size_t i = 0; i < format.size(); ++i) {
+    if (format[i] == '}') {
+      return "Unmatched '}' in tracepoint format";
+    }
+    if (format[i] != '{') {
+      field.text.push_back(format[i]);
+      continue;
+    }
+    size_t close = format.find('}', i);
+    if (close == string::npos) {
+      return "Unmatched '{' in tracepoint format";
+    }
+    string expr = format.substr(i + 1, close - i - 1);
+    size_t size_sep = expr.find(':');
+    if (size_sep != string::npos) {
+      char* end;
+      field.deref = strtoul(expr.c_str() + size_sep + 1, &end, 10);
+      if (*end || (field.deref != 1 && field.deref != 2 &&
+                   field.deref != 4 && field.deref != 8)) {
+        return "Tracepoint field sizes must be 1, 2, 4 or 8";
+      }
+      expr.resize(size_sep);
+    }
+    if (expr.find_first_not_of(' ') == string::npos) {
+      return "Empty tracepoint field";
+    }
+    field.expr = expr;
+    s.fields.push_back(field);
+    field = Field();
+    field.deref = 0;
+    i = close;
+  }
+  if (!field.text.empty()) {
+    s.fields.push_back(field);
+  }
+  specs.push_back(std::move(s));
+  return string();
+}
+
+/**
+ * Find |name| in the ELF symbol table of the executable file |file_name|.
+ * Results are cached since install() retries unresolved tracepoints often.
+ */
+static bool find_exe_symbol(const string& file_name, const string& name,
+                            uintptr_t* file_offset) {
+  static map<pair<string, string>, pair<bool, uintptr_t>> cache;
+  auto key = make_pair(file_name, name);
+  auto it = cache.find(key);
+  if (it == cache.end()) {
+    pair<bool, uintptr_t> result(false, 0);
+    ScopedFd fd(file_name.c_str(), O_RDONLY);
+    if (fd.is_open()) {
+      ElfFileReader reader(fd);
+      const char* tables[][2] = { { ".symtab", ".strtab" },
+                                  { ".dynsym", ".dynstr" } };
+      for (auto& table : tables) {
+        SymbolTable syms = reader.read_symbols(table[0], table[1]);
+        for (size_t i = 0; i < syms.size() && !result.first; ++i) {
+          uintptr_t offset;
+          if (syms.is_name(i, name.c_str()) && syms.addr(i) &&
+              reader.addr_to_offset(syms.addr(i), offset)) {
+            result = make_pair(true, offset);
+          }
+        }
+      }
+    }
+    it = cache.insert(make_pair(key, result)).first;
+  }
+  *file_offset = it->second.second;
+  return it->second.first;
+}
+
+static remote_code_ptr resolve_location(ReplayTask* t,
+                                        const string& location) {
+  if (isdigit(location[0])) {
+    char* end;
+    uintptr_t addr = strtoull(location.c_str(), &end, 0);
+    if (*end || !t->vm()->has_mapping(addr)) {
+      return nullptr;
+    }
+    return addr;
+  }
+
+  string name = location;
+  uintptr_t delta = 0;
+  size_t plus = location.find('+');
+  if (plus != string::npos) {
+    name = location.substr(0, plus);
+    delta = strtoull(location.c_str() + plus + 1, nullptr, 0);
+  }
+  // Map the symbol's file offset to wherever the executable is mapped.
+  const string& exe = t->vm()->exe_image();
+  string file_name;
+  uintptr_t offset = 0;
+  for (const auto& m : t->vm()->maps()) {
+    if (m.recorded_map.fsname() != exe) {
+      continue;
+    }
+    if (file_name.empty()) {
+      file_name = m.map.fsname();
+      if (!find_exe_symbol(file_name, name, &offset)) {
+        return nullptr;
+      }
+    }
+    uint64_t start = m.map.file_offset_bytes();
+    if (offset >= start && offset < start + m.map.size()) {
+      return m.map.start().as_int() + (offset - start) + delta;
+    }
+  }
+  return nullptr;
+}
+
+void Tracepoints::install(ReplayTimeline& timeline, ReplayTask* t) {
+  if (!t || specs.empty()) {
+    return;
+  }
+  AddressSpaceUid vm_uid = t->vm()->uid();
+  for (auto& s : specs) {
+    if (s.installed_in.count(vm_uid)) {
+      continue;
+    }
+    remote_code_ptr addr = resolve_location(t, s.location);
+    if (!addr) {
+      continue;
+    }
+    vector<GdbExpression> expressions;
+    bool ok = true;
+    for (const auto& f : s.fields) {
+      vector<uint8_t> code;
+      if (!f.expr.empty() && !compile_field(t->arch(), f, &code)) {
+        ok = false;
+        break;
+      }
+      expressions.push_back(GdbExpression(code.data(), code.size()));
+    }
+    // Don't retry in this address space, whether or not it worked.
+    s.installed_in.insert(vm_uid);
+    if (!ok) {
+      LOG(warn) << "Can't evaluate tracepoint format at " << s.location;
+      continue;
+    }
+    unique_ptr<BreakpointCondition> condition(
+        new TracepointCondition(output, s.fields, std::move(expressions)));
+    if (timeline.add_tracepoint(t, addr, std::move(condition))) {
+      LOG(debug) << "Placed tracepoint " << s.location << " at " << addr;
+    } else {
+      LOG(warn) << "Can't place tracepoint " << s.location << " at " << addr;
+    }
+  }
+}
+
+void Tracepoints::clear(ReplayTimeline& timeline) {
+  timeline.remove_tracepoints();
+  specs.clear();
+}
+
+size_t Tracepoints::pending() const {
+  size_t count = 0;
+  for (const auto& s : specs) {
+    if (s.installed_in.empty()) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+} // namespace rr
@@ -0,0 +1,99 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_TRACEPOINT_H_
+#define RR_TRACEPOINT_H_
+
+#include <unistd.h>
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ScopedFd.h"
+#include "TaskishUid.h"
+
+namespace rr {
+
+class ReplayTask;
+class ReplayTimeline;
+
+/**
+ * rr-side tracepoints: breakpoints that never stop. Each time replay reaches
+ * one, rr evaluates the registers and memory named in its format, appends a
+ * line to the tracepoint output and carries on, without a round trip to the
+ * debugger. That makes printf-style debugging of a recording run at close
+ * to replay speed.
+ *
+ * A tracepoint is specified as "<location>:<format>". The location is an
+ * address, or a symbol in the executable with an optional "+offset". The
+ * format is copied literally except for fields: "{expr}" prints the value of
+ * expr, and "{expr:N}" prints the N-byte (1, 2, 4 or 8) value at address
+ * expr. An expr is a sum or difference of register names (as gdb names them)
+ * and integer constants, e.g. "{rsp+8:8}". Fields are compiled to gdb agent
+ * bytecode and evaluated with GdbExpression.
+ *
+ * Each line is prefixed with the event number and the recorded tid. A hit is
+ * logged only the first time replay passes it, so seeking backwards and
+ * replaying again doesn't duplicate records.
+ */
+class Tracepoints {
+public:
+  Tracepoints();
+  ~Tracepoints();
+
+  /**
+   * Append records to |file_name| instead of stdout.
+   */
+  void set_output(const std::string& file_name);
+
+  /**
+   * Add the tracepoint described by |spec|. Returns an error message if
+   * |spec| is malformed, or an empty string. The tracepoint takes effect
+   * once install() can resolve its location.
+   */
+  std::string add(const std::string& spec);
+
+  /**
+   * Place tracepoints whose location can now be resolved in |t|'s address
+   * space. Cheap once everything has been placed.
+   */
+  void install(ReplayTimeline& timeline, ReplayTask* t);
+
+  /**
+   * Remove all tracepoints.
+   */
+  void clear(ReplayTimeline& timeline);
+
+  size_t size() const { return specs.size(); }
+  size_t pending() const;
+
+  struct Field {
+    // Printed before the value.
+    std::string text;
+    // Empty for trailing text with no value.
+    std::string expr;
+    // Bytes to read at the address |expr| evaluates to, or 0 to print
+    // |expr| itself.
+    size_t deref;
+  };
+  struct Spec {
+    std::string location;
+    std::vector<Field> fields;
+    // Address spaces the tracepoint has been placed in.
+    std::set<AddressSpaceUid> installed_in;
+  };
+  struct Output {
+    Output() : fd(STDOUT_FILENO) {}
+    ScopedFd owned_fd;
+    int fd;
+  };
+
+private:
+  std::vector<Spec> specs;
+  std::shared_ptr<Output> output;
+};
+
+} // namespace rr
+
+#endif /* RR_TRACEPOINT_H_ */
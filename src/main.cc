@@ -56,6 +56,8 @@ void print_global_options(FILE* out) {
       "Global options:\n"
       "  --disable-cpuid-faulting   disable use of CPUID faulting\n"
       "  --disable-ptrace-exit_events disable use of PTRACE_EVENT_EXIT\n"
+      "  --io-uring                 use io_uring for trace file I/O when the\n"
+      "                             kernel supports it\n"
       "  --resource-path=PATH       specify the paths that rr should use to "
       "find\n"
       "                             files such as rr_page_*.  These files "
@@ -129,6 +131,7 @@ bool parse_global_option(std::vector<std::string>& args) {
     { 2, "resource-path", HAS_PARAMETER },
     { 3, "log", HAS_PARAMETER },
     { 4, "non-interactive", NO_PARAMETER },
+    { 5, "io-uring", NO_PARAMETER },
     { 'A', "microarch", HAS_PARAMETER },
     { 'C', "checksum", HAS_PARAMETER },
     { 'D', "dump-on", HAS_PARAMETER },
@@ -167,6 +170,9 @@ bool parse_global_option(std::vector<std::string>& args) {
     case 4:
       flags.non_interactive = true;
       break;
+    case 5:
+      flags.use_io_uring = true;
+      break;
     case 'A':
       flags.forced_uarch = opt.value;
       break;
@@ -0,0 +1,18 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+/* Bytes that must be escaped in binary packets, and some that don't. */
+static unsigned char buf[] = { '#', '$', '}', '*', 0, 0xff, 0x7d, 0x20 };
+
+static void breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+int main(void) {
+  breakpoint();
+  test_assert(buf[0] == '#');
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
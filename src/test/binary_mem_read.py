@@ -0,0 +1,19 @@
+from util import *
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+# gdb versions that know binary-upload read this with 'x' packets.
+send_gdb('p/x buf')
+expect_gdb(r'\{0x23, 0x24, 0x7d, 0x2a, 0x0, 0xff, 0x7d, 0x20\}')
+
+# Unwinding starts from the registers expedited in the stop reply.
+send_gdb('bt')
+expect_gdb(r'#1 .* main')
+
+send_gdb('c')
+expect_rr('EXIT-SUCCESS')
+
+ok()
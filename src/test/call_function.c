@@ -14,6 +14,10 @@ void mutate_var(void) {
   atomic_printf("var is %d\n", var);
 }
 
+void set_var(int v) { var = v; }
+
+int get_var(void) { return var; }
+
 void print_nums(void) {
   int i;
   for (i = 1; i <= 5; ++i) {
@@ -0,0 +1,28 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+#define CHUNK_SIZE (1 << 20)
+#define CHUNKS 128
+
+int main(void) {
+  char* buf = xmalloc(CHUNK_SIZE);
+  int fd = open("/dev/urandom", O_RDONLY);
+  int i;
+  test_assert(fd >= 0);
+
+  /* Every read is saved in the trace's data substream. Random data is
+     expensive to compress and compresses badly, so the compression threads
+     fall behind. */
+  for (i = 0; i < CHUNKS; ++i) {
+    int done = 0;
+    while (done < CHUNK_SIZE) {
+      int ret = read(fd, buf + done, CHUNK_SIZE - done);
+      test_assert(ret > 0);
+      done += ret;
+    }
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,19 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+static int counter;
+
+static void __attribute__((noinline)) breakpoint(int i) { counter += i; }
+
+int main(void) {
+  int i;
+
+  for (i = 0; i < 100000; ++i) {
+    breakpoint(i);
+  }
+
+  atomic_printf("counter=%d\n", counter);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,19 @@
+from util import *
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('cond 1 i==99990')
+
+send_gdb('c')
+# Every false hit is resumed at the trap. This should be quick.
+expect_gdb('Breakpoint 1')
+send_gdb('p i')
+expect_gdb('= 99990')
+
+send_gdb('cond 1 i%2==1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+send_gdb('p i')
+expect_gdb('= 99991')
+
+ok()
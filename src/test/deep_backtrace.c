@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+#define DEPTH 500
+
+static void breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+static int recurse(int depth) {
+  /* Keep a frame-sized buffer live so the stack spans many pages. */
+  volatile char buf[64];
+  volatile int value = depth;
+  buf[0] = (char)depth;
+  if (depth == DEPTH) {
+    breakpoint();
+    value = -1;
+    breakpoint();
+    return value;
+  }
+  return recurse(depth + 1) + buf[0] - (char)depth + value - depth;
+}
+
+int main(void) {
+  test_assert(recurse(0) == -1);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
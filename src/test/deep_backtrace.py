@@ -0,0 +1,28 @@
+from util import *
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+send_gdb('bt -3')
+expect_gdb(r'#501 .* recurse \(depth=0\)')
+expect_gdb(r'#502 .* main')
+
+send_gdb('up')
+expect_gdb('recurse')
+send_gdb('p value')
+expect_gdb(r'\$1 = 500')
+
+# The cached stack must not survive the replay moving on.
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+send_gdb('up')
+expect_gdb('recurse')
+send_gdb('p value')
+expect_gdb(r'\$2 = -1')
+
+send_gdb('c')
+expect_rr('EXIT-SUCCESS')
+
+ok()
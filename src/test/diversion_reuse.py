@@ -0,0 +1,46 @@
+from util import *
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1, breakpoint')
+
+send_gdb('call set_var(22)')
+send_gdb('p get_var()')
+expect_gdb('= 22')
+# 'when' ends the diversion without moving the replay.
+send_gdb('when')
+expect_gdb('Current event')
+
+# This call should reuse the diversion above, with its changes undone.
+send_gdb('p get_var()')
+expect_gdb('= -42')
+send_gdb('when')
+expect_gdb('Current event')
+
+send_gdb('diversion-stats')
+expect_gdb('Diversions cloned: 1')
+expect_gdb('Clones avoided: 1')
+
+# This reuses the diversion again, but printing executes a real write(),
+# whose kernel-side effects can't be undone, so the call after it needs a
+# fresh clone.
+send_gdb('call mutate_var()')
+expect_gdb('var is 22')
+send_gdb('when')
+expect_gdb('Current event')
+send_gdb('call atomic_printf("var=%d\\n", var)')
+expect_gdb('var=-42')
+send_gdb('when')
+expect_gdb('Current event')
+
+send_gdb('diversion-stats')
+expect_gdb('Diversions cloned: 2')
+expect_gdb('Clones avoided: 2')
+
+send_gdb('c')
+expect_rr('var is -42')
+send_gdb('c')
+expect_rr('EXIT-SUCCESS')
+
+ok()
@@ -0,0 +1,22 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+static volatile uint64_t counter;
+static volatile int done;
+
+static void handle_alarm(__attribute__((unused)) int sig) { done = 1; }
+
+int main(void) {
+  signal(SIGALRM, handle_alarm);
+  alarm(3);
+
+  atomic_puts("spinning");
+  /* Run for a few seconds without any syscalls, so replay reaches no
+     events while we spin. */
+  while (!done) {
+    ++counter;
+  }
+  atomic_puts("done");
+  return 0;
+}
@@ -0,0 +1,16 @@
+from util import *
+
+send_gdb('monitor progress on')
+expect_gdb('Progress reports are on')
+
+send_gdb('c')
+expect_rr('spinning')
+# We get progress reports and can interrupt even though replay reaches no
+# new events while the tracee spins.
+expect_gdb(r'rr: at event \d+ of \d+')
+interrupt_gdb()
+
+send_gdb('monitor progress off')
+expect_gdb('Progress reports are off')
+
+ok()
@@ -0,0 +1,19 @@
+from util import *
+
+send_gdb('b main')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+send_gdb('show remote library-info-svr4-packet')
+expect_gdb('currently enabled')
+
+# The library list should come from rr's qXfer reply and still match what
+# the link_map chain says.
+send_gdb('info sharedlibrary')
+expect_gdb(r'libc[.-]')
+
+send_gdb('c')
+expect_rr('EXIT-SUCCESS')
+
+ok()
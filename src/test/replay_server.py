@@ -0,0 +1,18 @@
+from util import *
+
+send_gdb('b first_breakpoint')
+expect_gdb('Breakpoint 1')
+
+send_gdb('b second_breakpoint')
+expect_gdb('Breakpoint 2')
+
+send_gdb('c')
+expect_gdb('Breakpoint 1, first_breakpoint')
+
+send_gdb('c')
+expect_gdb('Breakpoint 2, second_breakpoint')
+
+send_gdb('reverse-cont')
+expect_gdb('Breakpoint 1, first_breakpoint')
+
+ok()
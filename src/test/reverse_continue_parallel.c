@@ -0,0 +1,31 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+#define STRETCHES 6
+
+static volatile uint64_t counter;
+
+static void target(void) {}
+
+static void breakpoint(void) {}
+
+int main(void) {
+  int i;
+  uint64_t j;
+
+  target();
+  /* Each stretch is long enough for replay to take a reverse-exec checkpoint
+     at the event that ends it, so reverse-continuing from the end back to
+     target() has several intervals to search. */
+  for (i = 0; i < STRETCHES; ++i) {
+    for (j = 0; j < ((uint64_t)1 << 28); ++j) {
+      ++counter;
+    }
+    sched_yield();
+  }
+  breakpoint();
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
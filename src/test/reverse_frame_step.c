@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+static int total;
+
+static void breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+static void __attribute__((noinline)) work(int n) {
+  int i;
+  for (i = 0; i < n; ++i) {
+    total += i % 7;
+  }
+}
+
+static void __attribute__((noinline)) inner(void) {
+  total = 1;
+  work(10000000);
+  total = 2;
+  breakpoint();
+}
+
+int main(void) {
+  inner();
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,30 @@
+from util import *
+
+send_gdb('break breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+send_gdb('rr-reverse-finish')
+expect_gdb(r'inner \(\)')
+expect_gdb(r'breakpoint\(\);')
+
+send_gdb('rr-reverse-next')
+expect_gdb('total = 2;')
+# work() has added the sum of i % 7 for i < 10000000 to the initial 1.
+send_gdb('p total')
+expect_gdb('= 29999995')
+
+# The call to work() is run over at full speed.
+send_gdb('rr-reverse-next')
+expect_gdb(r'work\(10000000\);')
+send_gdb('p total')
+expect_gdb('= 1')
+
+send_gdb('rr-reverse-next')
+expect_gdb('total = 1;')
+
+send_gdb('rr-reverse-finish')
+expect_gdb(r'main \(\)')
+
+ok()
@@ -0,0 +1,30 @@
+from util import *
+
+send_gdb('b C')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+def state():
+    send_gdb('p/x $pc')
+    expect_gdb(r'\$\d+ = (0x[0-9a-f]+)')
+    pc = last_match().group(1)
+    send_gdb('p/x *(long*)$sp')
+    expect_gdb(r'\$\d+ = (0x[0-9a-f]+)')
+    return (pc, last_match().group(1))
+
+# Step forward into atomic_puts and beyond, remembering each state.
+states = [state()]
+for i in range(40):
+    send_gdb('stepi')
+    states.append(state())
+
+# Repeated reverse-stepi must walk back through exactly the same states,
+# whether or not they're served from the singlestep history.
+for i in range(40):
+    send_gdb('reverse-stepi')
+    s = state()
+    if s != states[-2 - i]:
+        failed('reverse-stepi %d reached %s, expected %s' % (i, s, states[-2 - i]))
+
+ok()
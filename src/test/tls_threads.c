@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+#define NUM_THREADS 8
+
+__thread int tlsvar;
+
+static pthread_barrier_t ready;
+static pthread_barrier_t done;
+
+void breakpoint_fn(void) {}
+
+static void* thread_fn(void* arg) {
+  tlsvar = (int)(uintptr_t)arg;
+  pthread_barrier_wait(&ready);
+  pthread_barrier_wait(&done);
+  return NULL;
+}
+
+int main(void) {
+  pthread_t threads[NUM_THREADS];
+  int i;
+
+  pthread_barrier_init(&ready, NULL, NUM_THREADS + 1);
+  pthread_barrier_init(&done, NULL, NUM_THREADS + 1);
+  tlsvar = 100;
+  for (i = 0; i < NUM_THREADS; ++i) {
+    pthread_create(&threads[i], NULL, thread_fn, (void*)(uintptr_t)(i + 1));
+  }
+  pthread_barrier_wait(&ready);
+  breakpoint_fn();
+  pthread_barrier_wait(&done);
+  for (i = 0; i < NUM_THREADS; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  tlsvar = 200;
+  breakpoint_fn();
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
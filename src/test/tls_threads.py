@@ -0,0 +1,22 @@
+from util import *
+
+send_gdb('break breakpoint_fn')
+expect_gdb('Breakpoint 1')
+
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+send_gdb('print tlsvar')
+expect_gdb(' = 100')
+send_gdb('thread apply all print tlsvar')
+expect_gdb(' = 8')
+send_gdb('print tlsvar')
+expect_gdb(' = 100')
+
+# The other threads have exited by the next stop, so cached thread
+# handles must not be reused.
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+send_gdb('print tlsvar')
+expect_gdb(' = 200')
+
+ok()
@@ -0,0 +1,17 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+static int total;
+
+void __attribute__((noinline)) traced(int value) { total += value; }
+
+int main(void) {
+  int i;
+  for (i = 0; i < 5; ++i) {
+    traced(i * 10);
+  }
+  atomic_printf("total=%d\n", total);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
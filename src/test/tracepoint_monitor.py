@@ -0,0 +1,26 @@
+from util import *
+
+arch = get_exe_arch()
+reg = 'x0' if arch == 'aarch64' else 'rdi'
+
+send_gdb('break main')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+send_gdb('tracepoint traced:value={%s}' % reg)
+expect_gdb('Tracepoint placed.')
+
+send_gdb('break traced if value == 20')
+expect_gdb('Breakpoint 2')
+send_gdb('c')
+expect_gdb('Breakpoint 2')
+
+# Only the first three calls are logged.
+send_gdb('delete-tracepoints')
+expect_gdb('Tracepoints deleted.')
+send_gdb('delete 2')
+send_gdb('c')
+expect_gdb('exited normally')
+
+ok()
@@ -526,13 +526,13 @@ function rand_range { min=$1; max=$2
 # So for example, |checkpoint_test simple 3 5| means to record the
 # "simple" test, and attach the debugger at every X'th event, where X
 # is a random number in [3, 5].
-function checkpoint_test { exe=$1; min=$2; max=$3;
+function checkpoint_test { exe=$1; min=$2; max=$3; replayargs=$4;
     record $exe
     num_events=$(count_events)
     stride=$(rand_range $min $max)
     for i in $(seq 1 $stride $num_events); do
         echo Checkpointing at event $i ...
-        debug restart_finish "-g $i"
+        debug restart_finish "-g $i $replayargs"
         if [[ "$test_passed" != "y" ]]; then
             break
         fi
@@ -0,0 +1,36 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+static void breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+/* Far too large for the debug registers. The fields around |values| share
+   its pages, so writing them faults without triggering the watchpoint. */
+static volatile struct {
+  int before[16];
+  int values[1024];
+  int after[16];
+} big;
+
+int main(void) {
+  int i;
+
+  breakpoint();
+
+  for (i = 0; i < 16; ++i) {
+    big.before[i] = i;
+  }
+  big.values[700] = 42;
+  for (i = 0; i < 16; ++i) {
+    big.after[i] = i;
+  }
+  big.values[1] = 1337;
+
+  atomic_printf("values[1]=%d values[700]=%d\n", big.values[1],
+                big.values[700]);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,29 @@
+from util import *
+
+send_gdb('break breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+# 4KB can't be watched with debug registers; rr write-protects the pages.
+send_gdb('watch -l big.values')
+expect_gdb('Hardware watchpoint 2')
+
+send_gdb('c')
+expect_gdb('Hardware watchpoint 2')
+expect_gdb(r'New value = \{0 <repeats 700 times>, 42')
+
+send_gdb('c')
+expect_gdb('Hardware watchpoint 2')
+expect_gdb(r'New value = \{0, 1337, 0 <repeats 698 times>, 42')
+
+send_gdb('reverse-cont')
+expect_gdb('Hardware watchpoint 2')
+expect_gdb(r'New value = \{0 <repeats 700 times>, 42')
+
+send_gdb('delete 2')
+send_gdb('c')
+expect_rr('EXIT-SUCCESS')
+expect_gdb('exited normally')
+
+ok()
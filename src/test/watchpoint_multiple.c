@@ -0,0 +1,32 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "util.h"
+
+static void breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+static volatile int a;
+static volatile int b;
+static volatile char buf[64];
+
+int main(void) {
+  int i;
+  int sum = 0;
+
+  a = 1;
+  for (i = 0; i < 1000; ++i) {
+    sum += i;
+  }
+  b = 2;
+  /* Probably a string instruction, which replay fast-forwards. */
+  memset((char*)buf, 0, sizeof(buf));
+  buf[10] = 3;
+  a = sum;
+
+  breakpoint();
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,42 @@
+from util import *
+
+send_gdb('break breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+send_gdb('watch a')
+expect_gdb('Hardware watchpoint 2')
+send_gdb('watch b')
+expect_gdb('Hardware watchpoint 3')
+send_gdb('watch buf[10]')
+expect_gdb('Hardware watchpoint 4')
+
+# Reverse execution singlesteps past many instructions that can't write
+# memory; the watched values must still be tracked across the ones that do.
+send_gdb('reverse-cont')
+expect_gdb('Hardware watchpoint 2')
+expect_gdb('Old value = 499500')
+expect_gdb('New value = 1')
+
+send_gdb('reverse-cont')
+expect_gdb('Hardware watchpoint 4')
+expect_gdb('Old value = 3')
+expect_gdb('New value = 0')
+
+send_gdb('reverse-cont')
+expect_gdb('Hardware watchpoint 3')
+expect_gdb('Old value = 2')
+expect_gdb('New value = 0')
+
+send_gdb('reverse-cont')
+expect_gdb('Hardware watchpoint 2')
+expect_gdb('Old value = 1')
+expect_gdb('New value = 0')
+
+send_gdb('c')
+expect_gdb('Hardware watchpoint 2')
+expect_gdb('Old value = 0')
+expect_gdb('New value = 1')
+
+ok()
@@ -1387,6 +1387,29 @@ vector<string> read_proc_status_fields(pid_t tid, const char* name,
   return result;
 }
 
+int64_t read_private_memory_bytes(pid_t tid) {
+  char buf[1000];
+  sprintf(buf, "/proc/%d/smaps_rollup", tid);
+  FILE* f = fopen(buf, "r");
+  if (!f) {
+    return -1;
+  }
+  static const char* const fields[] = { "Private_Clean:", "Private_Dirty:",
+                                        "SwapPss:" };
+  int64_t result = 0;
+  while (fgets(buf, sizeof(buf), f)) {
+    for (auto field : fields) {
+      size_t len = strlen(field);
+      if (strncmp(buf, field, len) == 0) {
+        // Values are in kB.
+        result += strtoll(buf + len, nullptr, 10) * 1024;
+      }
+    }
+  }
+  fclose(f);
+  return result;
+}
+
 static bool check_for_pax_kernel() {
   auto results = read_proc_status_fields(getpid(), "PaX");
   return !results.empty();
@@ -2001,15 +2024,94 @@ string get_cpu_lock_file() {
 }
 
 /**
- * Pick a CPU at random to bind to, unless --cpu-unbound has been given,
- * in which case we return -1.
+ * Parse a kernel CPU list such as "0-3,8,10-11".
  */
-int choose_cpu(BindCPU bind_cpu, ScopedFd &cpu_lock_fd_out) {
-  if (bind_cpu == UNBOUND_CPU) {
-    return -1;
+static vector<int> parse_cpu_list(const string& list) {
+  vector<int> cpus;
+  stringstream ss(list);
+  string item;
+  while (getline(ss, item, ',')) {
+    char* end;
+    long first = strtol(item.c_str(), &end, 10);
+    if (end == item.c_str()) {
+      continue;
+    }
+    long last = first;
+    if (*end == '-') {
+      last = strtol(end + 1, nullptr, 10);
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+      cpus.push_back(cpu);
+    }
   }
+  return cpus;
+}
 
-  // Find out which CPUs we're allowed to run on at all.
+static string read_sysfs_line(const string& path) {
+  ifstream file(path);
+  string line;
+  getline(file, line);
+  return line;
+}
+
+/**
+ * What we know about where a logical CPU sits in the machine. Any field
+ * we can't read from sysfs is left at its default, which makes the CPU
+ * look like it shares nothing with anyone.
+ */
+struct CpuTopology {
+  // All logical CPUs on the same physical core, including this one.
+  vector<int> siblings;
+  // Lowest-numbered CPU sharing our last-level cache, or -1.
+  int llc_id = -1;
+  // NUMA node, or -1.
+  int node = -1;
+};
+
+static CpuTopology read_cpu_topology(int cpu) {
+  CpuTopology topo;
+  string cpu_dir = "/sys/devices/system/cpu/cpu" + to_string(cpu);
+  topo.siblings =
+      parse_cpu_list(read_sysfs_line(cpu_dir + "/topology/thread_siblings_list"));
+  if (topo.siblings.empty()) {
+    topo.siblings.push_back(cpu);
+  }
+
+  int llc_level = -1;
+  for (int index = 0;; ++index) {
+    string cache_dir = cpu_dir + "/cache/index" + to_string(index);
+    string level = read_sysfs_line(cache_dir + "/level");
+    if (level.empty()) {
+      break;
+    }
+    if (atoi(level.c_str()) > llc_level) {
+      vector<int> shared =
+          parse_cpu_list(read_sysfs_line(cache_dir + "/shared_cpu_list"));
+      if (!shared.empty()) {
+        llc_level = atoi(level.c_str());
+        topo.llc_id = *min_element(shared.begin(), shared.end());
+      }
+    }
+  }
+
+  DIR* dir = opendir(cpu_dir.c_str());
+  if (dir) {
+    while (struct dirent* entry = readdir(dir)) {
+      if (!strncmp(entry->d_name, "node", 4) && isdigit(entry->d_name[4])) {
+        topo.node = atoi(entry->d_name + 4);
+        break;
+      }
+    }
+    closedir(dir);
+  }
+  return topo;
+}
+
+/**
+ * Returns the CPUs we're allowed to run on, optionally restricted to the
+ * ones our perf counters support.
+ */
+static vector<int> allowed_cpus(bool need_perf_counters) {
   // sched_getaffinity intersects the task's `cpu_mask`
   // (/proc/.../status Cpus_allowed_list) with `cpu_active_mask`
   // which is almost the same as /sys/devices/system/cpu/online
@@ -2018,12 +2120,120 @@ int choose_cpu(BindCPU bind_cpu, ScopedFd &cpu_lock_fd_out) {
   if (ret < 0) {
     FATAL() << "sched_getaffinity failed";
   }
-  std::vector<int> cpus;
+  vector<int> cpus;
   for (int i = 0; i < CPU_SETSIZE; ++i) {
-    if (CPU_ISSET(i, &affinity_mask) && PerfCounters::support_cpu(i)) {
+    if (CPU_ISSET(i, &affinity_mask) &&
+        (!need_perf_counters || PerfCounters::support_cpu(i))) {
       cpus.push_back(i);
     }
   }
+  return cpus;
+}
+
+static bool try_lock_cpu(const ScopedFd& cpu_lock_fd, int cpu) {
+  struct flock lock {
+    .l_type = F_WRLCK,
+    .l_whence = SEEK_SET,
+    .l_start = cpu,
+    .l_len = 1,
+    .l_pid = 0
+  };
+  int err = fcntl(cpu_lock_fd, F_SETLK, &lock);
+  if (err == -1 && errno != EACCES && errno != EAGAIN) {
+    FATAL() << "Unexpected error trying to acquire CPU lock";
+  }
+  return err == 0;
+}
+
+/**
+ * Returns the set of CPUs some other rr process currently holds a lock on.
+ * Locks held by this process are not reported by F_GETLK, which is what we
+ * want: they are handled by our callers.
+ */
+static vector<bool> cpus_locked_by_others(const ScopedFd& cpu_lock_fd) {
+  vector<bool> busy(CPU_SETSIZE, false);
+  if (!cpu_lock_fd.is_open()) {
+    return busy;
+  }
+  int configured_cpus =
+      min((int)sysconf(_SC_NPROCESSORS_CONF), (int)CPU_SETSIZE);
+  for (int cpu = 0; cpu < configured_cpus; ++cpu) {
+    struct flock lock {
+      .l_type = F_WRLCK,
+      .l_whence = SEEK_SET,
+      .l_start = cpu,
+      .l_len = 1,
+      .l_pid = 0
+    };
+    if (fcntl(cpu_lock_fd, F_GETLK, &lock) == 0 && lock.l_type != F_UNLCK) {
+      busy[cpu] = true;
+    }
+  }
+  return busy;
+}
+
+/**
+ * Orders free CPUs by how little they would contend with other rr
+ * processes: first CPUs whose whole physical core is idle, then CPUs
+ * whose last-level cache has the fewest busy CPUs. `cpus` should be
+ * shuffled beforehand so that ties are broken randomly.
+ */
+static vector<int> rank_free_cpus(const vector<int>& cpus,
+                                  const vector<bool>& busy) {
+  struct Candidate {
+    int cpu;
+    int busy_siblings;
+    int busy_llc_cpus;
+  };
+  map<int, int> busy_per_llc;
+  vector<CpuTopology> topologies;
+  for (int cpu : cpus) {
+    topologies.push_back(read_cpu_topology(cpu));
+    if (busy[cpu]) {
+      ++busy_per_llc[topologies.back().llc_id];
+    }
+  }
+  vector<Candidate> candidates;
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    if (busy[cpus[i]]) {
+      continue;
+    }
+    Candidate c = { cpus[i], 0, 0 };
+    for (int sibling : topologies[i].siblings) {
+      if (sibling != cpus[i] && busy[sibling]) {
+        ++c.busy_siblings;
+      }
+    }
+    if (topologies[i].llc_id >= 0) {
+      c.busy_llc_cpus = busy_per_llc[topologies[i].llc_id];
+    }
+    candidates.push_back(c);
+  }
+  stable_sort(candidates.begin(), candidates.end(),
+              [](const Candidate& a, const Candidate& b) {
+                if (a.busy_siblings != b.busy_siblings) {
+                  return a.busy_siblings < b.busy_siblings;
+                }
+                return a.busy_llc_cpus < b.busy_llc_cpus;
+              });
+  vector<int> ret;
+  for (auto& c : candidates) {
+    ret.push_back(c.cpu);
+  }
+  return ret;
+}
+
+/**
+ * Pick a CPU to bind to, unless --cpu-unbound has been given,
+ * in which case we return -1.
+ */
+int choose_cpu(BindCPU bind_cpu, ScopedFd &cpu_lock_fd_out) {
+  if (bind_cpu == UNBOUND_CPU) {
+    return -1;
+  }
+
+  // Find out which CPUs we're allowed to run on at all.
+  vector<int> cpus = allowed_cpus(true);
   if (cpus.empty()) {
     FATAL() << "Can't find a valid CPU to run on";
   }
@@ -2031,8 +2241,9 @@ int choose_cpu(BindCPU bind_cpu, ScopedFd &cpu_lock_fd_out) {
   // When many copies of rr are running on the same machine, it's easy for them
   // to oversubscribe a CPU. To avoid this situation, we have a lock file, where
   // each running rr process will lock the n-th byte if it is running on that
-  // particular CPU. That way subsequent rr processes can avoid in-use cores
-  // if possible.
+  // particular CPU (or using it for its compression threads, see
+  // choose_compression_cpu). That way subsequent rr processes can avoid
+  // in-use cores if possible.
   string cpu_lock_file = get_cpu_lock_file();
   cpu_lock_fd_out = ScopedFd(cpu_lock_file.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
 
@@ -2049,7 +2260,7 @@ int choose_cpu(BindCPU bind_cpu, ScopedFd &cpu_lock_fd_out) {
     }
   }
 
-  // Pin tracee tasks to a random logical CPU, both in
+  // Pin tracee tasks to a logical CPU, both in
   // recording and replay.  Tracees can see which HW
   // thread they're running on by asking CPUID, and we
   // don't have a way to emulate it yet.  So if a tracee
@@ -2065,42 +2276,25 @@ int choose_cpu(BindCPU bind_cpu, ScopedFd &cpu_lock_fd_out) {
   // better interaction with CPU frequency scaling.
   if (bind_cpu >= 0) {
     if (cpu_lock_fd_out.is_open()) {
-      struct flock lock {
-        .l_type = F_WRLCK,
-        .l_whence = SEEK_SET,
-        .l_start = bind_cpu,
-        .l_len = 1,
-        .l_pid = 0
-      };
-      // Try to acquire the lock for this CPU
-      (void)fcntl(cpu_lock_fd_out, F_SETLK, &lock);
-      // Ignore fcntl errors - nothing we can do
+      // Try to acquire the lock for this CPU; if someone else has it
+      // there's nothing we can do.
+      (void)try_lock_cpu(cpu_lock_fd_out, bind_cpu);
     }
     return bind_cpu;
   }
 
   if (cpu_lock_fd_out.is_open()) {
-    // Try twice to allocate a CPU. If we fail twice, pick a random one
+    // Prefer CPUs on physical cores no other rr is using, so that we don't
+    // end up sharing execution resources with another tracee via SMT.
+    // Try twice to allocate a CPU, since other rr processes may be racing
+    // with us. If we fail twice, pick a random one.
     for (int i = 0; i < 2; ++i) {
-      std::shuffle (cpus.begin(), cpus.end(), std::default_random_engine(random()));
-      for (int cpu : cpus) {
-        struct flock lock {
-          .l_type = F_WRLCK,
-          .l_whence = SEEK_SET,
-          .l_start = cpu,
-          .l_len = 1,
-          .l_pid = 0
-        };
-        // Try to acquire the lock for this CPU
-        int err = fcntl(cpu_lock_fd_out, F_SETLK, &lock);
-        if (err == 0) {
+      shuffle(cpus.begin(), cpus.end(), default_random_engine(random()));
+      vector<bool> busy = cpus_locked_by_others(cpu_lock_fd_out);
+      for (int cpu : rank_free_cpus(cpus, busy)) {
+        if (try_lock_cpu(cpu_lock_fd_out, cpu)) {
           return cpu;
         }
-        else if (err == -1) {
-          if (errno != EACCES && errno != EAGAIN) {
-            FATAL() << "Unexpected error trying to acquire CPU lock";
-          }
-        }
       }
     }
   }
@@ -2110,6 +2304,165 @@ int choose_cpu(BindCPU bind_cpu, ScopedFd &cpu_lock_fd_out) {
   return cpus[random() % cpus.size()];
 }
 
+int choose_compression_cpu(int tracee_cpu, const ScopedFd& cpu_lock_fd) {
+  if (tracee_cpu < 0 || !cpu_lock_fd.is_open()) {
+    return -1;
+  }
+
+  vector<int> cpus = allowed_cpus(false);
+  shuffle(cpus.begin(), cpus.end(), default_random_engine(random()));
+  vector<bool> busy = cpus_locked_by_others(cpu_lock_fd);
+  CpuTopology tracee_topo = read_cpu_topology(tracee_cpu);
+
+  // Prefer a CPU on another physical core that shares the tracee's
+  // last-level cache, so the data being compressed is likely still cached
+  // without the compression threads competing with the tracee for
+  // execution resources. Failing that, stay within the tracee's NUMA node.
+  // An SMT sibling of the tracee CPU is the last resort. Within each class,
+  // prefer cores no other rr is using. We don't reserve a CPU on another
+  // node; the compression threads would then pull every buffer across the
+  // interconnect.
+  vector<pair<int, int>> candidates;
+  for (int cpu : cpus) {
+    if (cpu == tracee_cpu || busy[cpu]) {
+      continue;
+    }
+    CpuTopology topo = read_cpu_topology(cpu);
+    int rank;
+    if (find(tracee_topo.siblings.begin(), tracee_topo.siblings.end(), cpu) !=
+        tracee_topo.siblings.end()) {
+      rank = 4;
+    } else if (tracee_topo.llc_id >= 0 && topo.llc_id == tracee_topo.llc_id) {
+      rank = 0;
+    } else if (tracee_topo.node >= 0 && topo.node == tracee_topo.node) {
+      rank = 2;
+    } else {
+      continue;
+    }
+    if (rank < 4) {
+      for (int sibling : topo.siblings) {
+        if (sibling != cpu && busy[sibling]) {
+          ++rank;
+          break;
+        }
+      }
+    }
+    candidates.push_back(make_pair(rank, cpu));
+  }
+  stable_sort(candidates.begin(), candidates.end(),
+              [](const pair<int, int>& a, const pair<int, int>& b) {
+                return a.first < b.first;
+              });
+  for (auto& c : candidates) {
+    if (try_lock_cpu(cpu_lock_fd, c.second)) {
+      return c.second;
+    }
+  }
+  return -1;
+}
+
+/* At most this many compression threads are placed on one physical core. */
+static const size_t MAX_COMPRESSION_THREADS_PER_CORE = 2;
+
+vector<cpu_set_t> place_compression_threads(int tracee_cpu, int reserved_cpu,
+                                            const ScopedFd& cpu_lock_fd,
+                                            size_t num_threads) {
+  vector<cpu_set_t> masks;
+  if (tracee_cpu < 0) {
+    return masks;
+  }
+
+  // Never run compression on the tracee CPU; rr and the tracees are bound
+  // there, so every compression timeslice is stolen from the recording.
+  // Avoid the rest of the tracee's core too, since SMT siblings compete for
+  // its execution resources; they're only used if nothing else is free.
+  vector<bool> busy = cpus_locked_by_others(cpu_lock_fd);
+  CpuTopology tracee_topo = read_cpu_topology(tracee_cpu);
+  vector<int> same_node_cpus;
+  vector<int> other_cpus;
+  vector<int> sibling_cpus;
+  // Every allowed CPU except the tracee's, for when other rr processes have
+  // locked all of the rest.
+  vector<int> shared_cpus;
+  for (int cpu : allowed_cpus(false)) {
+    if (cpu == tracee_cpu) {
+      continue;
+    }
+    shared_cpus.push_back(cpu);
+    if (busy[cpu]) {
+      continue;
+    }
+    if (find(tracee_topo.siblings.begin(), tracee_topo.siblings.end(), cpu) !=
+        tracee_topo.siblings.end()) {
+      sibling_cpus.push_back(cpu);
+    } else if (tracee_topo.node < 0 ||
+               read_cpu_topology(cpu).node == tracee_topo.node) {
+      same_node_cpus.push_back(cpu);
+    } else {
+      other_cpus.push_back(cpu);
+    }
+  }
+  // Stay on the producer's NUMA node when we can, so compression reads the
+  // buffer from local memory.
+  // Sharing CPUs with other recordings still beats competing with our own
+  // tracee, so only leave the threads unbound if the tracee's CPU is the
+  // only one we have.
+  const vector<int>& cpus = !same_node_cpus.empty() ? same_node_cpus
+                            : !other_cpus.empty()   ? other_cpus
+                            : !sibling_cpus.empty() ? sibling_cpus
+                                                    : shared_cpus;
+  if (cpus.empty()) {
+    return masks;
+  }
+
+  // Group the candidates by physical core, the reserved CPU's core first.
+  auto core_id = [](int cpu) {
+    vector<int> siblings = read_cpu_topology(cpu).siblings;
+    return *min_element(siblings.begin(), siblings.end());
+  };
+  vector<vector<int>> cores;
+  map<int, size_t> core_index;
+  if (find(cpus.begin(), cpus.end(), reserved_cpu) != cpus.end()) {
+    core_index[core_id(reserved_cpu)] = 0;
+    cores.push_back({ reserved_cpu });
+  }
+  for (int cpu : cpus) {
+    if (cpu == reserved_cpu) {
+      continue;
+    }
+    int id = core_id(cpu);
+    auto it = core_index.find(id);
+    if (it == core_index.end()) {
+      core_index[id] = cores.size();
+      cores.push_back({ cpu });
+    } else {
+      cores[it->second].push_back(cpu);
+    }
+  }
+
+  cpu_set_t all;
+  CPU_ZERO(&all);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &all);
+  }
+  // Fill cores in order, capping the number of threads on each; any
+  // threads left over may float over all the candidate CPUs.
+  for (size_t i = 0; i < num_threads; ++i) {
+    size_t core = i / MAX_COMPRESSION_THREADS_PER_CORE;
+    if (core >= cores.size()) {
+      masks.push_back(all);
+      continue;
+    }
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int cpu : cores[core]) {
+      CPU_SET(cpu, &mask);
+    }
+    masks.push_back(mask);
+  }
+  return masks;
+}
+
 uint32_t crc32(uint32_t crc, unsigned char* buf, size_t len) {
   static const uint32_t crc32_table[256] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -324,6 +324,13 @@ std::vector<std::string> read_proc_status_fields(pid_t tid, const char* name,
                                                  const char* name2 = nullptr,
                                                  const char* name3 = nullptr);
 
+/**
+ * Returns the number of bytes of memory that only |tid|'s address space
+ * maps (resident or swapped), according to /proc/<tid>/smaps_rollup.
+ * Returns -1 if that can't be read (e.g. Linux < 4.14).
+ */
+int64_t read_private_memory_bytes(pid_t tid);
+
 /**
  * Mainline Linux kernels use an invisible (to /proc/<pid>/maps) guard page
  * for stacks. grsecurity kernels don't.
@@ -498,6 +505,25 @@ std::string get_cpu_lock_file();
    for coordination with other rr processes */
 int choose_cpu(BindCPU bind_cpu, ScopedFd& cpu_lock_fd_out);
 
+/* Pick a CPU near |tracee_cpu| (one on another core sharing its last-level
+   cache, else one on its NUMA node, else an SMT sibling) for our compression
+   threads and lock it in |cpu_lock_fd| so other rr processes avoid it.
+   Returns -1 if the tracee isn't bound or no suitable CPU is free. */
+int choose_compression_cpu(int tracee_cpu, const ScopedFd& cpu_lock_fd);
+
+/* Compute an affinity mask for each of |num_threads| compression threads.
+   Threads never share |tracee_cpu|, avoid the rest of its physical core
+   unless no other CPU is free, stay on its NUMA node when possible, fill the
+   core of |reserved_cpu| (see choose_compression_cpu) first, and are capped
+   per physical core. If other rr processes have locked every other CPU, the
+   threads share those rather than the tracee's. Returns an empty vector,
+   leaving the threads unbound, if the tracee isn't bound or |tracee_cpu| is
+   the only allowed CPU. */
+std::vector<cpu_set_t> place_compression_threads(int tracee_cpu,
+                                                 int reserved_cpu,
+                                                 const ScopedFd& cpu_lock_fd,
+                                                 size_t num_threads);
+
 /* Updates an IEEE 802.3 CRC-32 least significant bit first from each byte in
  * |buf|.  Pre- and post-conditioning is not performed in this function and so
  * should be performed by the caller, as required. */